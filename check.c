@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "format-dump.h"
+#include "format-rtp.h"
+#include "check.h"
+
+/* The dump is mapped (or read whole, if it is not a file),
+ * and its records are walked by their dlen. A record whose dlen
+ * does not fit, or that says it has more of the packet than there
+ * was, breaks the framing: with resync, we look for the next place
+ * where CHECKCHAIN records in a row make sense, and go on from there;
+ * otherwise, that is where the check ends. Other problems, such as
+ * a wrong RTP version or time going back, are only counted.
+ * The good records can be written into a new dump as we go. */
+
+struct check {
+	const unsigned char	*map;
+	off_t			 size;
+	int			 verbose;
+	uint64_t		 records;
+	uint64_t		 bytes;
+	uint64_t		 rtp;
+	uint64_t		 other;
+	uint64_t		 snapped;
+	uint64_t		 errors;
+	uint64_t		 badver;
+	uint64_t		 shorthdr;
+	uint64_t		 backwards;
+	uint64_t		 resyncs;
+	uint64_t		 skipped;
+	off_t			 first;	/* offset of the first error */
+	uint32_t		 tmin;
+	uint32_t		 tmax;
+};
+
+/* Report a problem at the given offset. */
+static void
+problem(struct check *c, off_t off, const char *what)
+{
+	if (c->errors++ == 0)
+		c->first = off;
+	if (c->verbose || c->errors == 1)
+		warnx("offset %lld: %s", (long long) off, what);
+}
+
+/* Read the header of the record at off, in local byte order.
+ * Return 0 if the record is framed right, -1 otherwise. */
+static int
+framed(const struct check *c, off_t off, struct dpkthdr *pkt)
+{
+	if (off + (off_t) DPKTHDRSIZE > c->size)
+		return -1;
+	memcpy(pkt, c->map + off, DPKTHDRSIZE);
+	parse_dpkthdr(pkt);
+	if (pkt->dlen < DPKTHDRSIZE || off + pkt->dlen > c->size)
+		return -1;
+	if (pkt->plen && pkt->dlen - DPKTHDRSIZE > pkt->plen)
+		return -1;
+	return 0;
+}
+
+/* Do the records starting at off make sense? They must be framed
+ * right, be RTP, and keep the time going forward, but not by much.
+ * Return 1 if CHECKCHAIN of them in a row (or all up to the end)
+ * do, 0 otherwise. */
+static int
+plausible(const struct check *c, off_t off)
+{
+	struct dpkthdr pkt;
+	struct rtphdr rtp;
+	uint32_t msec = 0;
+	int n;
+	for (n = 0; n < CHECKCHAIN && off < c->size; n++) {
+		if (framed(c, off, &pkt) == -1 || pkt.plen == 0
+		|| pkt.dlen < DPKTHDRSIZE + 12
+		|| (n && (pkt.msec < msec || pkt.msec - msec > CHECKSPAN)))
+			return 0;
+		memcpy(&rtp, c->map + off + DPKTHDRSIZE, 12);
+		if (rtp.v != RTPVERSION)
+			return 0;
+		msec = pkt.msec;
+		off += pkt.dlen;
+	}
+	return 1;
+}
+
+/* Write the run of len good records at off to the output.
+ * Return 0 for success, -1 for error. */
+static int
+salvage(const struct check *c, int ofd, off_t off, off_t len)
+{
+	ssize_t w;
+	while (len > 0) {
+		if ((w = write(ofd, c->map + off, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("Error writing the salvaged records");
+			return -1;
+		}
+		off += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/* Read the rest of a stream we cannot map into memory.
+ * Return the buffer, or NULL for error. */
+static unsigned char*
+slurp(int fd, off_t *size)
+{
+	unsigned char *buf = NULL, *p;
+	size_t have = 0, len = 0;
+	ssize_t r;
+	for (;;) {
+		if (have == len) {
+			len = len ? 2 * len : 1 << 20;
+			if ((p = realloc(buf, len)) == NULL) {
+				warn(NULL);
+				free(buf);
+				return NULL;
+			}
+			buf = p;
+		}
+		if ((r = read(fd, buf + have, len - have)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("Error reading dump");
+			free(buf);
+			return NULL;
+		}
+		if (r == 0)
+			break;
+		have += r;
+	}
+	*size = have;
+	return buf;
+}
+
+static void
+report(const struct check *c)
+{
+	fprintf(stderr, "check.records %llu\n", (unsigned long long) c->records);
+	fprintf(stderr, "check.bytes %llu\n", (unsigned long long) c->bytes);
+	fprintf(stderr, "check.rtp %llu\n", (unsigned long long) c->rtp);
+	fprintf(stderr, "check.other %llu\n", (unsigned long long) c->other);
+	fprintf(stderr, "check.snapped %llu\n", (unsigned long long) c->snapped);
+	if (c->records)
+		fprintf(stderr, "check.span %u.%03u-%u.%03u\n",
+			c->tmin / 1000, c->tmin % 1000,
+			c->tmax / 1000, c->tmax % 1000);
+	fprintf(stderr, "check.errors %llu\n", (unsigned long long) c->errors);
+	if (c->errors == 0)
+		return;
+	fprintf(stderr, "check.first %lld\n", (long long) c->first);
+	fprintf(stderr, "check.badversion %llu\n",
+		(unsigned long long) c->badver);
+	fprintf(stderr, "check.shortheader %llu\n",
+		(unsigned long long) c->shorthdr);
+	fprintf(stderr, "check.backwards %llu\n",
+		(unsigned long long) c->backwards);
+	fprintf(stderr, "check.resyncs %llu\n",
+		(unsigned long long) c->resyncs);
+	fprintf(stderr, "check.skipped %llu\n",
+		(unsigned long long) c->skipped);
+}
+
+/* Check the dump on ifd: its header, and each of its records.
+ * If ofd is not -1, write a dump of the good records into it.
+ * With resync, go on past the damage. Print what we found.
+ * Return 0 for a good dump, -1 for a damaged one or error. */
+int
+check_dump(int ifd, int ofd, int resync, int verbose)
+{
+	struct check c;
+	struct sockaddr_in addr;
+	struct dumphdr hdr;
+	struct dpkthdr pkt;
+	struct rtphdr rtp;
+	struct timeval start;
+	struct stat st;
+	unsigned char *buf = NULL;
+	void *map = MAP_FAILED;
+	off_t off = 0, run = 0, skip;
+	uint32_t last = 0;
+	int error = 0, ns;
+	memset(&c, 0, sizeof(c));
+	c.verbose = verbose;
+	c.first = -1;
+	if ((ns = read_dumpline(ifd, &addr)) == -1) {
+		warnx("Not a dump file");
+		return -1;
+	} else if (ns) {
+		warnx("Only a plain dump can be checked");
+		return -1;
+	}
+	if (read_dumphdr(ifd, &hdr, DUMPHDRSIZE) == -1)
+		return -1;
+	if (check_dumphdr(&hdr, &addr) == -1)
+		problem(&c, 0, "dump line does not agree with dump header");
+	start.tv_sec = hdr.time.sec;
+	start.tv_usec = hdr.time.usec;
+	if (ofd != -1 && (write_dumpline(ofd, &addr) == -1
+	|| write_dumphdr(ofd, &addr, &start) == -1)) {
+		warnx("Error writing dump header");
+		return -1;
+	}
+	if (fstat(ifd, &st) == 0 && S_ISREG(st.st_mode)
+	&& (off = lseek(ifd, 0, SEEK_CUR)) != -1 && st.st_size > off
+	&& (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ifd, 0))
+	!= MAP_FAILED) {
+		posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+		c.map = map;
+		c.size = st.st_size;
+	} else {
+		/* Not a file, or nothing to map: read what is left. */
+		if ((buf = slurp(ifd, &c.size)) == NULL)
+			return -1;
+		c.map = buf;
+		off = 0;
+	}
+	run = off;
+	while (off < c.size) {
+		if (framed(&c, off, &pkt) == -1) {
+			problem(&c, off, off + (off_t) DPKTHDRSIZE > c.size
+			|| (pkt.dlen >= DPKTHDRSIZE && (pkt.plen == 0
+			|| pkt.dlen - DPKTHDRSIZE <= pkt.plen))
+			? "truncated record" : "bad record length");
+			if (ofd != -1 && salvage(&c, ofd, run, off - run)) {
+				error = -1;
+				break;
+			}
+			if (!resync)
+				break;
+			for (skip = off + 1; skip < c.size; skip++)
+				if (plausible(&c, skip))
+					break;
+			c.skipped += skip - off;
+			if (skip < c.size) {
+				c.resyncs++;
+				if (verbose)
+					warnx("offset %lld: resynced after "
+						"%lld bytes", (long long) skip,
+						(long long) (skip - off));
+			}
+			run = off = skip;
+			continue;
+		}
+		if (c.records == 0)
+			c.tmin = pkt.msec;
+		c.records++;
+		c.bytes += pkt.dlen;
+		if (c.records > 1 && pkt.msec < last) {
+			problem(&c, off, "time goes back");
+			c.backwards++;
+		}
+		last = pkt.msec;
+		if (pkt.msec > c.tmax)
+			c.tmax = pkt.msec;
+		if (pkt.plen == 0) {
+			c.other++;
+		} else if (pkt.dlen < DPKTHDRSIZE + 12) {
+			problem(&c, off, "short RTP header");
+			c.shorthdr++;
+		} else {
+			memcpy(&rtp, c.map + off + DPKTHDRSIZE, 12);
+			if (rtp.v != RTPVERSION) {
+				problem(&c, off, "bad RTP version");
+				c.badver++;
+			} else
+				c.rtp++;
+			if (pkt.dlen - DPKTHDRSIZE < pkt.plen)
+				c.snapped++;
+		}
+		off += pkt.dlen;
+	}
+	if (ofd != -1 && off > run && salvage(&c, ofd, run, off - run))
+		error = -1;
+	report(&c);
+	if (map != MAP_FAILED)
+		munmap(map, c.size);
+	free(buf);
+	return error == -1 || c.errors ? -1 : 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Reading many dump files as one, in the order of time.
+ * Needs format-dump.h. */
+/* Checking a dump file for damage, such as a capture that crashed
+ * leaves behind, and salvaging the good records of it.
+ * Needs format-dump.h. */
+
+#define CHECKCHAIN	4		/* records in a row to resync on */
+#define CHECKSPAN	3600000		/* msec a resync may skip at most */
+
+int	check_dump	(int, int, int, int);
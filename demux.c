@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "demux.h"
+#include "format-dump.h"
+
+/* The streams are kept in an array, in the order they came,
+ * and found by their key in a hash table of their indices
+ * (plus one, so that zero is free), with open addressing.
+ * The open files are also on a list, the most recently written
+ * first; a closed file gives its buffer to the next one opened. */
+
+#define NONE	UINT32_MAX
+
+struct file {
+	uint64_t	 key;
+	int		 fd;	/* or -1 if not open */
+	int		 made;	/* the file has been created */
+	int		 bad;	/* the file cannot be written */
+	unsigned char	*buf;	/* while open */
+	size_t		 buflen;
+	uint32_t	 prev;	/* on the list of the open files */
+	uint32_t	 next;
+};
+
+struct demux {
+	const char	*path;	/* as given, with the key of each stream */
+	int		 bypt;	/* the key has the payload type too */
+	unsigned	 max;	/* open files at most */
+	unsigned	 nopen;
+	int		(*start)(int, void*);
+	void		*arg;
+	struct file	*files;
+	uint32_t	 nfiles;
+	uint32_t	 sfiles;
+	uint32_t	*table;
+	uint32_t	 tsize;	/* a power of two */
+	uint32_t	 head;	/* written most recently */
+	uint32_t	 tail;	/* written least recently */
+	unsigned char	*spare;	/* the buffer of the last closed file */
+	int		 failed;	/* to write out a closed file */
+};
+
+/* Make a new demultiplexer. Each stream goes to a file
+ * named after the output with its key: out.0000abcd.rtp
+ * for the SSRC 0xabcd, or out.0000abcd.8.rtp with the payload
+ * type 8 too, or out.other.rtp for what is not RTP.
+ * At most max files are kept open, or DEMUXFILES for 0.
+ * Return the demultiplexer, or NULL for error. */
+struct demux*
+demux_open(const char *path, int bypt, unsigned max)
+{
+	struct demux *d;
+	if ((d = calloc(1, sizeof(*d))) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+	d->path = path;
+	d->bypt = bypt;
+	d->max = max ? max : DEMUXFILES;
+	d->head = d->tail = NONE;
+	return d;
+}
+
+/* Have start called with arg to write the start of each new file.
+ * Return 0 for success, -1 for error. */
+int
+demux_start(struct demux *d, int (*start)(int, void*), void *arg)
+{
+	d->start = start;
+	d->arg = arg;
+	return 0;
+}
+
+/* Name the file of the stream with the given key.
+ * Return 0 for success, -1 for error. */
+static int
+name(struct demux *d, uint64_t key, char *buf, size_t size)
+{
+	char tag[32];
+	if (key == DEMUXOTHER)
+		snprintf(tag, sizeof(tag), "other");
+	else if (d->bypt)
+		snprintf(tag, sizeof(tag), "%08x.%u",
+			(uint32_t) key, (unsigned) (key >> 32));
+	else
+		snprintf(tag, sizeof(tag), "%08x", (uint32_t) key);
+	return tag_dumpname(buf, size, d->path, tag);
+}
+
+static uint32_t
+hash(uint64_t key, uint32_t size)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+}
+
+/* Double the hash table, or make the first one.
+ * Return 0 for success, -1 for error. */
+static int
+grow(struct demux *d)
+{
+	uint32_t *t, i, h, size = d->tsize ? 2 * d->tsize : 1024;
+	if ((t = calloc(size, sizeof(*t))) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+	for (i = 0; i < d->nfiles; i++) {
+		for (h = hash(d->files[i].key, size); t[h];
+		h = (h + 1) & (size - 1))
+			;
+		t[h] = i + 1;
+	}
+	free(d->table);
+	d->table = t;
+	d->tsize = size;
+	return 0;
+}
+
+/* Find the stream with the given key, or add it as new.
+ * Return the stream, or NULL for error. */
+static struct file*
+find(struct demux *d, uint64_t key)
+{
+	struct file *f;
+	uint32_t h, size;
+	if (d->tsize) {
+		for (h = hash(key, d->tsize); d->table[h];
+		h = (h + 1) & (d->tsize - 1))
+			if (d->files[d->table[h] - 1].key == key)
+				return &d->files[d->table[h] - 1];
+	}
+	if (d->nfiles == NONE - 1) {
+		warnx("Too many streams");
+		return NULL;
+	}
+	if (4 * ((uint64_t) d->nfiles + 1) > 3 * (uint64_t) d->tsize
+	&& grow(d) == -1)
+		return NULL;
+	if (d->nfiles == d->sfiles) {
+		size = d->sfiles ? 2 * d->sfiles : 1024;
+		if ((f = realloc(d->files, size * sizeof(*f))) == NULL) {
+			warn(NULL);
+			return NULL;
+		}
+		d->files = f;
+		d->sfiles = size;
+	}
+	for (h = hash(key, d->tsize); d->table[h];
+	h = (h + 1) & (d->tsize - 1))
+		;
+	d->table[h] = d->nfiles + 1;
+	f = &d->files[d->nfiles++];
+	memset(f, 0, sizeof(*f));
+	f->key = key;
+	f->fd = -1;
+	f->prev = f->next = NONE;
+	return f;
+}
+
+static void
+unlink_open(struct demux *d, struct file *f)
+{
+	if (f->prev == NONE)
+		d->head = f->next;
+	else
+		d->files[f->prev].next = f->next;
+	if (f->next == NONE)
+		d->tail = f->prev;
+	else
+		d->files[f->next].prev = f->prev;
+	f->prev = f->next = NONE;
+}
+
+static void
+link_open(struct demux *d, struct file *f)
+{
+	uint32_t i = f - d->files;
+	f->prev = NONE;
+	f->next = d->head;
+	if (d->head == NONE)
+		d->tail = i;
+	else
+		d->files[d->head].prev = i;
+	d->head = i;
+}
+
+/* Write out len bytes to the file of the stream.
+ * Return 0 for success, -1 for error. */
+static int
+writeout(struct demux *d, struct file *f, const void *buf, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t w;
+	size_t off = 0;
+	while (off < len) {
+		if ((w = write(f->fd, (const char*) buf + off, len - off))
+		== -1) {
+			if (errno == EINTR)
+				continue;
+			if (name(d, f->key, path, sizeof(path)) == 0)
+				warn("%s", path);
+			return -1;
+		}
+		off += w;
+	}
+	return 0;
+}
+
+/* Write out the buffer of the stream.
+ * Return 0 for success, -1 for error. */
+static int
+flush(struct demux *d, struct file *f)
+{
+	int rv = writeout(d, f, f->buf, f->buflen);
+	f->buflen = 0;
+	return rv;
+}
+
+/* Close the file of the stream, keeping its buffer for the next one.
+ * Return 0 for success, -1 for error. */
+static int
+shut(struct demux *d, struct file *f)
+{
+	int rv = flush(d, f);
+	if (close(f->fd) == -1) {
+		warn("close");
+		rv = -1;
+	}
+	f->fd = -1;
+	unlink_open(d, f);
+	if (d->spare == NULL)
+		d->spare = f->buf;
+	else
+		free(f->buf);
+	f->buf = NULL;
+	d->nopen--;
+	return rv;
+}
+
+/* Open the file of the stream: create it and write its start
+ * the first time, append to it later. Close the file written
+ * least recently if too many are open, or if we run out of them.
+ * Return 0 for success, -1 for error. */
+static int
+reopen(struct demux *d, struct file *f)
+{
+	char path[PATH_MAX];
+	int flags = f->made ? O_WRONLY|O_APPEND : O_WRONLY|O_CREAT|O_TRUNC;
+	if (name(d, f->key, path, sizeof(path)) == -1)
+		return -1;
+	if (d->nopen >= d->max && shut(d, &d->files[d->tail]) == -1)
+		d->failed = 1;
+	while ((f->fd = open(path, flags, 0644)) == -1) {
+		if ((errno != EMFILE && errno != ENFILE) || d->nopen == 0) {
+			warn("%s", path);
+			return -1;
+		}
+		/* Keep fewer open from now on. */
+		d->max = d->nopen;
+		if (shut(d, &d->files[d->tail]) == -1)
+			d->failed = 1;
+	}
+	if (!f->made && d->start && d->start(f->fd, d->arg) == -1) {
+		warnx("%s: Error writing the start", path);
+		close(f->fd);
+		f->fd = -1;
+		return -1;
+	}
+	f->made = 1;
+	if ((f->buf = d->spare) == NULL
+	&& (f->buf = malloc(DEMUXBUF)) == NULL) {
+		warn(NULL);
+		close(f->fd);
+		f->fd = -1;
+		return -1;
+	}
+	d->spare = NULL;
+	f->buflen = 0;
+	link_open(d, f);
+	d->nopen++;
+	return 0;
+}
+
+/* Append len bytes to the file of the stream with the given key.
+ * Once the file of a stream cannot be opened or written,
+ * the rest of its records are lost.
+ * Return bytes written, or -1 for error. */
+ssize_t
+demux_write(struct demux *d, uint64_t key, const void *buf, size_t len)
+{
+	struct file *f;
+	if ((f = find(d, key)) == NULL || f->bad)
+		return -1;
+	if (f->fd == -1 && reopen(d, f) == -1) {
+		f->bad = 1;
+		return -1;
+	}
+	if (d->head != (uint32_t) (f - d->files)) {
+		unlink_open(d, f);
+		link_open(d, f);
+	}
+	if (f->buflen + len > DEMUXBUF && flush(d, f) == -1) {
+		f->bad = 1;
+		return -1;
+	}
+	if (len > DEMUXBUF) {
+		if (writeout(d, f, buf, len) == -1) {
+			f->bad = 1;
+			return -1;
+		}
+		return len;
+	}
+	memcpy(f->buf + f->buflen, buf, len);
+	f->buflen += len;
+	return len;
+}
+
+/* Write out and close all the files, and free the demultiplexer.
+ * Return 0 for success, -1 for error. */
+int
+demux_close(struct demux *d)
+{
+	int rv;
+	if (d == NULL)
+		return 0;
+	rv = d->failed ? -1 : 0;
+	while (d->head != NONE)
+		if (shut(d, &d->files[d->head]) == -1)
+			rv = -1;
+	free(d->spare);
+	free(d->files);
+	free(d->table);
+	free(d);
+	return rv;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Writing each stream of a capture into a file of its own.
+ * The streams are told apart by a key: the SSRC, possibly
+ * with the payload type above it, or DEMUXOTHER for what is not RTP.
+ * The files are named after the key, and only so many are kept open;
+ * the one written least recently gets closed to open another,
+ * and reopened to append when its stream comes again. Each open file
+ * has a buffer of DEMUXBUF bytes, written out when full or closed. */
+
+#define DEMUXBUF	8192	/* bytes buffered per open file */
+#define DEMUXFILES	256	/* open files at most, by default */
+#define DEMUXOTHER	UINT64_MAX
+
+#define DEMUXKEY(ssrc, pt)	((uint64_t) (pt) << 32 | (ssrc))
+
+struct demux;
+
+struct demux	*demux_open	(const char*, int, unsigned);
+int		 demux_start	(struct demux*, int (*)(int, void*), void*);
+ssize_t		 demux_write	(struct demux*, uint64_t,
+				 const void*, size_t);
+int		 demux_close	(struct demux*);
@@ -0,0 +1,387 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "format-dump.h"
+#include "format-rtp.h"
+#include "filter.h"
+
+#if HAVE_SO_ATTACH_FILTER
+#include <linux/filter.h>
+#endif
+
+/* Parse a number from the start of s as strtod(3) does,
+ * but insist on a value in [0, max]; with msec, in seconds
+ * and converted to milliseconds.
+ * Return 0 for success, -1 for error. */
+static int
+getnum(const char *name, char **s, int msec, double max, uint32_t *n)
+{
+	char *e;
+	double d;
+	errno = 0;
+	d = msec ? strtod(*s, &e) : (double) strtoul(*s, &e, 0);
+	if (e == *s || errno || d < 0 || d > max) {
+		warnx("%s: bad value '%s'", name, *s);
+		return -1;
+	}
+	*n = msec ? (uint32_t) (d * 1000) : (uint32_t) d;
+	*s = e;
+	return 0;
+}
+
+/* Parse a range of the form from-to, from-, -to, or a single value.
+ * Return 0 for success, -1 for error. */
+static int
+getrange(const char *name, char *s, int msec, double max,
+	uint32_t *min, uint32_t *top)
+{
+	if (s == NULL || *s == '\0') {
+		warnx("%s needs a value", name);
+		return -1;
+	}
+	*min = 0;
+	*top = msec ? UINT32_MAX : max;
+	if (*s != '-' && getnum(name, &s, msec, max, min) == -1)
+		return -1;
+	if (*s == '\0') {
+		*top = *min;
+		return 0;
+	}
+	if (*s++ != '-') {
+		warnx("%s: bad range", name);
+		return -1;
+	}
+	if (*s && getnum(name, &s, msec, max, top) == -1)
+		return -1;
+	if (*s || *top < *min) {
+		warnx("%s: bad range", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse the filter specification.
+ * Return 0 for success, -1 for error. */
+int
+filter_parse(struct filter *f, char *spec)
+{
+	char *val;
+	uint32_t a, b;
+	enum { TERM_MARKER, TERM_PT, TERM_SAMPLE, TERM_SEQ, TERM_SIZE,
+		TERM_SSRC, TERM_TIME, TERM_VERSION };
+	char *const terms[] = {
+		(char*) "marker",
+		(char*) "pt",
+		(char*) "sample",
+		(char*) "seq",
+		(char*) "size",
+		(char*) "ssrc",
+		(char*) "time",
+		(char*) "version",
+		NULL
+	};
+	memset(f, 0, sizeof(*f));
+	while (*spec) switch (getsubopt(&spec, terms, &val)) {
+		case TERM_MARKER:
+			if (val == NULL || getnum("marker", &val, 0, 1, &a) == -1)
+				return -1;
+			if (*val) {
+				warnx("marker: bad value");
+				return -1;
+			}
+			f->m = a;
+			f->what |= FILTER_MARKER;
+			break;
+		case TERM_PT:
+			if (val == NULL || getnum("pt", &val, 0, 127, &a) == -1)
+				return -1;
+			if (*val) {
+				warnx("pt: bad value");
+				return -1;
+			}
+			f->pt = a;
+			f->what |= FILTER_PT;
+			break;
+		case TERM_SAMPLE:
+			if (val == NULL
+			|| getnum("sample", &val, 0, UINT16_MAX, &a) == -1)
+				return -1;
+			if (*val || a == 0) {
+				warnx("sample: bad value");
+				return -1;
+			}
+			f->sample = a;
+			f->what |= FILTER_SAMPLE;
+			break;
+		case TERM_SEQ:
+			if (getrange("seq", val, 0, UINT16_MAX, &a, &b) == -1)
+				return -1;
+			f->seqmin = a;
+			f->seqmax = b;
+			f->what |= FILTER_SEQ;
+			break;
+		case TERM_SIZE:
+			if (getrange("size", val, 0, UINT16_MAX, &a, &b) == -1)
+				return -1;
+			f->sizemin = a;
+			f->sizemax = b;
+			f->what |= FILTER_SIZE;
+			break;
+		case TERM_SSRC:
+			if (val == NULL
+			|| getnum("ssrc", &val, 0, UINT32_MAX, &a) == -1)
+				return -1;
+			if (*val) {
+				warnx("ssrc: bad value");
+				return -1;
+			}
+			f->ssrc = a;
+			f->what |= FILTER_SSRC;
+			break;
+		case TERM_TIME:
+			if (getrange("time", val, 1, UINT32_MAX / 1000,
+			&f->tmin, &f->tmax) == -1)
+				return -1;
+			f->what |= FILTER_TIME;
+			break;
+		case TERM_VERSION:
+			if (val == NULL
+			|| getnum("version", &val, 0, 3, &a) == -1)
+				return -1;
+			if (*val) {
+				warnx("version: bad value");
+				return -1;
+			}
+			f->version = a;
+			f->what |= FILTER_VERSION;
+			break;
+		default:
+			warnx("unknown filter term: %s", val);
+			return -1;
+	}
+	return 0;
+}
+
+/* See if a captured packet matches the filter. The RTP header
+ * is only looked at if there is a term about it, and then the
+ * packet must be RTP, with its full header captured.
+ * Return 1 for a match, 0 otherwise. */
+int
+filter_match(const struct filter *f, const struct dpkthdr *pkt,
+	const struct rtphdr *rtp)
+{
+	uint16_t seq;
+	if ((f->what & FILTER_TIME)
+	&& (pkt->msec < f->tmin || pkt->msec > f->tmax))
+		return 0;
+	if ((f->what & FILTER_SIZE)
+	&& (pkt->plen < f->sizemin || pkt->plen > f->sizemax))
+		return 0;
+	if ((f->what & FILTER_RTP) == 0)
+		return 1;
+	if (pkt->plen == 0 || pkt->dlen < DPKTHDRSIZE + 12)
+		return 0;
+	if ((f->what & FILTER_VERSION) && rtp->v != f->version)
+		return 0;
+	if ((f->what & FILTER_MARKER) && rtp->m != f->m)
+		return 0;
+	if ((f->what & FILTER_SSRC) && ntohl(rtp->ssrc) != f->ssrc)
+		return 0;
+	if ((f->what & FILTER_PT) && rtp->pt != f->pt)
+		return 0;
+	seq = ntohs(rtp->seq);
+	if ((f->what & FILTER_SEQ) && (seq < f->seqmin || seq > f->seqmax))
+		return 0;
+	/* Offset each SSRC differently, so that the streams
+	 * do not all have their samples at the same moment. */
+	if ((f->what & FILTER_SAMPLE)
+	&& (seq + ((ntohl(rtp->ssrc) * 0x9e3779b1U) >> 16)) % f->sample)
+		return 0;
+	return 1;
+}
+
+/* See which of a batch of packets match the filter, given their
+ * decoded RTP headers, their capture times and sizes, and the mask
+ * of those that are RTP; the others only match a filter with no RTP
+ * terms. Those that are RTP have the RTP version.
+ * Each term is tested over the whole batch at once.
+ * Return the mask of the packets that match. */
+uint32_t
+filter_hdrs(const struct filter *f, const struct rtphdrs *h,
+	const uint32_t *msec, const uint16_t *plen, uint32_t rtp)
+{
+	uint32_t match = h->n < 32 ? (1U << h->n) - 1 : UINT32_MAX;
+	uint32_t out;
+	unsigned i;
+	if (f->what & FILTER_TIME) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) (msec[i] < f->tmin
+				|| msec[i] > f->tmax) << i;
+		match &= ~out;
+	}
+	if (f->what & FILTER_SIZE) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) (plen[i] < f->sizemin
+				|| plen[i] > f->sizemax) << i;
+		match &= ~out;
+	}
+	if ((f->what & FILTER_RTP) == 0)
+		return match;
+	match &= rtp;
+	if ((f->what & FILTER_VERSION) && f->version != RTPVERSION)
+		return 0;
+	if (f->what & FILTER_MARKER) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) (h->m[i] != f->m) << i;
+		match &= ~out;
+	}
+	if (f->what & FILTER_SSRC) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) (h->ssrc[i] != f->ssrc) << i;
+		match &= ~out;
+	}
+	if (f->what & FILTER_PT) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) (h->pt[i] != f->pt) << i;
+		match &= ~out;
+	}
+	if (f->what & FILTER_SEQ) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) (h->seq[i] < f->seqmin
+				|| h->seq[i] > f->seqmax) << i;
+		match &= ~out;
+	}
+	if (f->what & FILTER_SAMPLE) {
+		for (out = 0, i = 0; i < h->n; i++)
+			out |= (uint32_t) ((h->seq[i]
+				+ ((h->ssrc[i] * 0x9e3779b1U) >> 16))
+				% f->sample != 0) << i;
+		match &= ~out;
+	}
+	return match;
+}
+
+#if HAVE_SO_ATTACH_FILTER
+
+/* The socket filter sees the UDP header before the packet. */
+#define UDPLEN	8
+#define DROP	0xff	/* jump to the end, dropping the packet */
+
+static void
+insn(struct sock_filter *p, unsigned *n,
+	uint16_t code, uint8_t jt, uint8_t jf, uint32_t k)
+{
+	p[*n].code = code;
+	p[*n].jt = jt;
+	p[*n].jf = jf;
+	p[*n].k = k;
+	(*n)++;
+}
+
+/* Compile the terms of the filter but the time into a program
+ * of at most FILTER_BPFMAX instructions, doing what filter_hdrs()
+ * does: keep what has a size in the range, and if there are terms
+ * about the RTP header, is RTP with a header that matches them.
+ * Each test that fails jumps to the last instruction, which drops
+ * the packet; the one before keeps it.
+ * Return the number of instructions, or 0 if there is nothing
+ * to do, or if a term cannot be done in the kernel. */
+unsigned
+filter_bpf(const struct filter *f, struct sock_filter *p)
+{
+	unsigned i, n = 0;
+	if ((f->what & ~FILTER_TIME) == 0)
+		return 0;
+	if (f->what & FILTER_SIZE) {
+		insn(p, &n, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+		insn(p, &n, BPF_JMP | BPF_JGE | BPF_K, 0, DROP,
+			UDPLEN + f->sizemin);
+		insn(p, &n, BPF_JMP | BPF_JGT | BPF_K, DROP, 0,
+			UDPLEN + f->sizemax);
+	}
+	if (f->what & FILTER_RTP) {
+		insn(p, &n, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+		insn(p, &n, BPF_JMP | BPF_JGE | BPF_K, 0, DROP,
+			UDPLEN + sizeof(struct rtphdr));
+		insn(p, &n, BPF_LD | BPF_B | BPF_ABS, 0, 0, UDPLEN);
+		insn(p, &n, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0xc0);
+		insn(p, &n, BPF_JMP | BPF_JEQ | BPF_K, 0, DROP,
+			(f->what & FILTER_VERSION ? f->version : RTPVERSION) << 6);
+		if (f->what & FILTER_VERSION && f->version != RTPVERSION)
+			insn(p, &n, BPF_JMP | BPF_JA, 0, 0, DROP);
+	}
+	if (f->what & FILTER_MARKER) {
+		insn(p, &n, BPF_LD | BPF_B | BPF_ABS, 0, 0, UDPLEN + 1);
+		insn(p, &n, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0x80);
+		insn(p, &n, BPF_JMP | BPF_JEQ | BPF_K, 0, DROP, f->m << 7);
+	}
+	if (f->what & FILTER_PT) {
+		insn(p, &n, BPF_LD | BPF_B | BPF_ABS, 0, 0, UDPLEN + 1);
+		insn(p, &n, BPF_ALU | BPF_AND | BPF_K, 0, 0, 0x7f);
+		insn(p, &n, BPF_JMP | BPF_JEQ | BPF_K, 0, DROP, f->pt);
+	}
+	if (f->what & FILTER_SSRC) {
+		insn(p, &n, BPF_LD | BPF_W | BPF_ABS, 0, 0, UDPLEN + 8);
+		insn(p, &n, BPF_JMP | BPF_JEQ | BPF_K, 0, DROP, f->ssrc);
+	}
+	if (f->what & FILTER_SEQ) {
+		insn(p, &n, BPF_LD | BPF_H | BPF_ABS, 0, 0, UDPLEN + 2);
+		insn(p, &n, BPF_JMP | BPF_JGE | BPF_K, 0, DROP, f->seqmin);
+		insn(p, &n, BPF_JMP | BPF_JGT | BPF_K, DROP, 0, f->seqmax);
+	}
+	if (f->what & FILTER_SAMPLE) {
+		/* (seq + ((ssrc * 0x9e3779b1) >> 16)) % sample */
+		insn(p, &n, BPF_LD | BPF_W | BPF_ABS, 0, 0, UDPLEN + 8);
+		insn(p, &n, BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9e3779b1U);
+		insn(p, &n, BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16);
+		insn(p, &n, BPF_MISC | BPF_TAX, 0, 0, 0);
+		insn(p, &n, BPF_LD | BPF_H | BPF_ABS, 0, 0, UDPLEN + 2);
+		insn(p, &n, BPF_ALU | BPF_ADD | BPF_X, 0, 0, 0);
+		insn(p, &n, BPF_ALU | BPF_MOD | BPF_K, 0, 0, f->sample);
+		insn(p, &n, BPF_JMP | BPF_JEQ | BPF_K, 0, DROP, 0);
+	}
+	insn(p, &n, BPF_RET | BPF_K, 0, 0, UINT32_MAX);
+	insn(p, &n, BPF_RET | BPF_K, 0, 0, 0);
+	for (i = 0; i < n; i++) {
+		if (BPF_CLASS(p[i].code) != BPF_JMP)
+			continue;
+		if (BPF_OP(p[i].code) == BPF_JA)
+			p[i].k = n - 2 - i;
+		if (p[i].jt == DROP)
+			p[i].jt = n - 2 - i;
+		if (p[i].jf == DROP)
+			p[i].jf = n - 2 - i;
+	}
+	return n;
+}
+
+#else
+
+unsigned
+filter_bpf(const struct filter *f, struct sock_filter *p)
+{
+	return 0;
+}
+
+#endif
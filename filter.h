@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Selecting packets by their capture time, size and RTP header.
+ * A filter is a comma-separated list of terms, all of which
+ * a packet must match: time=from-to (seconds since the start
+ * of the dump), size=from-to (bytes of the packet as it came),
+ * ssrc=id, pt=type, version=n, marker=0|1, seq=from-to, sample=n.
+ * Either end of a range may be left out; a single value is a range too.
+ * Sampling keeps one in n packets of every SSRC, chosen by the sequence
+ * number, so that every capture of the same stream keeps the same ones.
+ * All but the time can also be compiled into a classic BPF program
+ * for a socket to run on each datagram before we ever see it. */
+
+#define FILTER_TIME	0x01
+#define FILTER_SSRC	0x02
+#define FILTER_PT	0x04
+#define FILTER_SEQ	0x08
+#define FILTER_SAMPLE	0x10
+#define FILTER_VERSION	0x20
+#define FILTER_MARKER	0x40
+#define FILTER_SIZE	0x80
+#define FILTER_RTP	(FILTER_SSRC|FILTER_PT|FILTER_SEQ|FILTER_SAMPLE\
+			|FILTER_VERSION|FILTER_MARKER)
+
+#define FILTER_BPFMAX	32	/* instructions of a compiled filter */
+
+struct filter {
+	unsigned	what;	/* FILTER_* terms present */
+	uint32_t	tmin;	/* msec */
+	uint32_t	tmax;
+	uint32_t	ssrc;
+	uint16_t	seqmin;
+	uint16_t	seqmax;
+	uint32_t	sample;	/* keep one in this many */
+	uint16_t	sizemin;
+	uint16_t	sizemax;
+	uint8_t		pt;
+	uint8_t		version;
+	uint8_t		m;
+};
+
+struct sock_filter;
+
+int	filter_parse	(struct filter*, char*);
+int	filter_match	(const struct filter*, const struct dpkthdr*,
+			 const struct rtphdr*);
+uint32_t filter_hdrs	(const struct filter*, const struct rtphdrs*,
+			 const uint32_t*, const uint16_t*, uint32_t);
+unsigned filter_bpf	(const struct filter*, struct sock_filter*);
@@ -0,0 +1,611 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "format-dump.h"
+#include "format-arc.h"
+
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/* The header columns of a block start with the table of the SSRCs
+ * in the block, each with the sequence number and timestamp
+ * of its first packet. Then come the columns, with one value
+ * for each packet: the time, the captured length, and how much
+ * longer the packet was, all from the dpkthdr; then whether the
+ * RTP header follows, and if so (otherwise zero) its first two
+ * bytes, the index of the SSRC in the table, and the sequence
+ * number and timestamp, as deltas from the previous packet of
+ * that SSRC. The signed deltas are zigzag-encoded. Each column
+ * is stored as its minimum, the width of the differences from
+ * it in bits, and the bit-packed differences. The payload then
+ * holds whatever the columns do not: the packets less their
+ * first 12 bytes, or the whole packet if that is not RTP. */
+
+enum {
+	COL_MSEC,
+	COL_CAPLEN,
+	COL_PLEN,
+	COL_SPLIT,
+	COL_B0,
+	COL_B1,
+	COL_SSRC,
+	COL_SEQ,
+	COL_TS,
+	NCOLS
+};
+
+#define RTPHDRSIZE	12
+#define PAYMAX		(ARCBYTES + UINT16_MAX)
+#define HDRMAX		(ARCBLOCK * (10 + NCOLS * 4) + NCOLS * 6 + 5)
+
+struct ssrc {
+	uint32_t	ssrc;
+	uint16_t	seq0;	/* of the first packet in the block */
+	uint32_t	ts0;
+	uint16_t	seq;	/* of the last packet */
+	uint32_t	ts;
+};
+
+struct arc {
+	int		 fd;
+	int		 writing;
+	int		 compress;	/* writing: try to compress */
+	int		 headers;	/* reading: only the headers */
+	struct arcblock	 blk;		/* local byte order */
+	unsigned	 n;		/* packets in the block (so far) */
+	unsigned	 next;		/* reading: packet to return next */
+	uint32_t	 msec;		/* of the last packet */
+	uint32_t	 col[NCOLS][ARCBLOCK];
+	struct ssrc	 ssrc[ARCBLOCK];
+	unsigned	 nssrc;
+	unsigned	 last;		/* last SSRC used */
+	unsigned char	*hdr;		/* the header columns */
+	unsigned char	*pay;		/* the payload */
+	size_t		 paylen;	/* used (writing) or taken (reading) */
+	unsigned char	*z;		/* compressed */
+	size_t		 zlen;
+};
+
+static uint32_t
+zig(int32_t v)
+{
+	return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static int32_t
+unzig(uint32_t v)
+{
+	return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+static unsigned char*
+putvar(unsigned char *p, uint32_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = v | 0x80;
+	*p++ = v;
+	return p;
+}
+
+/* Get a varint from p, not going past end.
+ * Return the next position, or NULL for error. */
+static const unsigned char*
+getvar(const unsigned char *p, const unsigned char *end, uint32_t *v)
+{
+	unsigned shift;
+	for (*v = 0, shift = 0; p < end && shift < 35; shift += 7) {
+		*v |= (uint32_t) (*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+static unsigned char*
+put32(unsigned char *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+	return p + 4;
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return ntohl(v);
+}
+
+/* Store a column: its minimum, the bit width, and the bits.
+ * Return the next position. */
+static unsigned char*
+putcol(unsigned char *p, const uint32_t *col, unsigned n)
+{
+	uint32_t min = UINT32_MAX, max = 0;
+	uint64_t acc = 0;
+	unsigned i, w = 0, bits = 0;
+	for (i = 0; i < n; i++) {
+		if (col[i] < min)
+			min = col[i];
+		if (col[i] > max)
+			max = col[i];
+	}
+	while (w < 32 && (max - min) >> w)
+		w++;
+	p = putvar(p, min);
+	*p++ = w;
+	for (i = 0; w && i < n; i++) {
+		acc |= (uint64_t) (col[i] - min) << bits;
+		for (bits += w; bits >= 8; bits -= 8, acc >>= 8)
+			*p++ = acc;
+	}
+	if (bits)
+		*p++ = acc;
+	return p;
+}
+
+/* Get a column stored by putcol(), not going past end.
+ * Return the next position, or NULL for error. */
+static const unsigned char*
+getcol(const unsigned char *p, const unsigned char *end,
+	uint32_t *col, unsigned n)
+{
+	uint32_t min;
+	uint64_t acc = 0;
+	unsigned i, w, bits = 0;
+	if ((p = getvar(p, end, &min)) == NULL || p >= end || (w = *p++) > 32)
+		return NULL;
+	if ((uint64_t) (end - p) < ((uint64_t) n * w + 7) / 8)
+		return NULL;
+	for (i = 0; i < n; i++) {
+		while (bits < w) {
+			acc |= (uint64_t) *p++ << bits;
+			bits += 8;
+		}
+		col[i] = min + (w == 32 ? (uint32_t) acc
+			: (uint32_t) (acc & ((1ULL << w) - 1)));
+		acc >>= w;
+		bits -= w;
+	}
+	return p;
+}
+
+/* Find the SSRC in the table of the block, or add it.
+ * Return its index. */
+static unsigned
+findssrc(struct arc *a, uint32_t ssrc, uint16_t seq, uint32_t ts)
+{
+	unsigned i;
+	if (a->last < a->nssrc && a->ssrc[a->last].ssrc == ssrc)
+		return a->last;
+	for (i = 0; i < a->nssrc; i++)
+		if (a->ssrc[i].ssrc == ssrc)
+			return a->last = i;
+	a->ssrc[i].ssrc = ssrc;
+	a->ssrc[i].seq = a->ssrc[i].seq0 = seq;
+	a->ssrc[i].ts = a->ssrc[i].ts0 = ts;
+	a->nssrc++;
+	return a->last = i;
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t w;
+	while (len) {
+		if ((w = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/* Read len bytes, unless at the very end.
+ * Return 1 for success, 0 for the end, -1 for error. */
+static int
+readall(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	size_t have = 0;
+	ssize_t r;
+	while (have < len) {
+		if ((r = read(fd, p + have, len - have)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		have += r;
+	}
+	if (have == len)
+		return 1;
+	if (have == 0)
+		return 0;
+	errno = EIO;
+	return -1;
+}
+
+/* Compress len bytes at buf into a->z, if that makes them smaller.
+ * Return the compressed size, or 0 for not compressed. */
+static size_t
+squeeze(struct arc *a, const unsigned char *buf, size_t len)
+{
+#if HAVE_ZLIB
+	uLongf zlen = a->zlen;
+	if (a->compress && len
+	&& compress2(a->z, &zlen, buf, len, Z_BEST_SPEED) == Z_OK
+	&& zlen < len)
+		return zlen;
+#endif
+	return 0;
+}
+
+/* Write out the block, if there is anything in it.
+ * Return 0 for success, -1 for error. */
+static int
+flush(struct arc *a)
+{
+	struct arcblock *b = &a->blk;
+	unsigned char bh[ARCBLOCKSIZE], *p;
+	size_t z;
+	unsigned i;
+	if (a->n == 0)
+		return 0;
+	p = putvar(a->hdr, a->nssrc);
+	for (i = 0; i < a->nssrc; i++) {
+		p = put32(p, a->ssrc[i].ssrc);
+		*p++ = a->ssrc[i].seq0 >> 8;
+		*p++ = a->ssrc[i].seq0;
+		p = put32(p, a->ssrc[i].ts0);
+	}
+	for (i = 0; i < NCOLS; i++)
+		p = putcol(p, a->col[i], a->n);
+	b->count = a->n;
+	b->flags = 0;
+	b->hraw = b->hlen = p - a->hdr;
+	b->praw = b->plen = a->paylen;
+	p = bh;
+	p = put32(p, ARCBLOCKMAGIC);
+	p = put32(p, b->count);
+	p = put32(p, b->msec);
+	if ((z = squeeze(a, a->hdr, b->hraw))) {
+		b->flags |= ARC_ZHDR;
+		b->hlen = z;
+		memcpy(a->hdr, a->z, z);
+	}
+	if ((z = squeeze(a, a->pay, b->praw))) {
+		b->flags |= ARC_ZPAY;
+		b->plen = z;
+	}
+	p = put32(p, b->flags);
+	p = put32(p, b->hraw);
+	p = put32(p, b->hlen);
+	p = put32(p, b->praw);
+	p = put32(p, b->plen);
+	if (writeall(a->fd, bh, ARCBLOCKSIZE) == -1
+	|| writeall(a->fd, a->hdr, b->hlen) == -1
+	|| writeall(a->fd, b->flags & ARC_ZPAY ? a->z : a->pay, b->plen)) {
+		warn("Error writing archive block");
+		return -1;
+	}
+	a->n = a->nssrc = a->last = 0;
+	a->paylen = 0;
+	return 0;
+}
+
+static struct arc*
+arc_alloc(int fd)
+{
+	struct arc *a;
+	if ((a = calloc(1, sizeof(struct arc))) == NULL
+	|| (a->hdr = malloc(HDRMAX)) == NULL
+	|| (a->pay = malloc(PAYMAX)) == NULL) {
+		warn("archive");
+		goto bad;
+	}
+	a->fd = fd;
+#if HAVE_ZLIB
+	a->zlen = compressBound(PAYMAX > HDRMAX ? PAYMAX : HDRMAX);
+	if ((a->z = malloc(a->zlen)) == NULL) {
+		warn("archive");
+		goto bad;
+	}
+#endif
+	return a;
+bad:
+	if (a) {
+		free(a->hdr);
+		free(a->pay);
+		free(a);
+	}
+	return NULL;
+}
+
+/* Start writing an archive of traffic captured at addr since start.
+ * Return the archive, or NULL for error. */
+struct arc*
+arc_create(int fd, struct sockaddr_in *addr, struct timeval *start,
+	int compress)
+{
+	struct arc *a;
+	if (write_hashline(fd, ARCMAGIC, addr) == -1) {
+		warnx("Error writing archive line");
+		return NULL;
+	}
+	if (write_dumphdr(fd, addr, start) == -1)
+		return NULL;
+	if ((a = arc_alloc(fd)) == NULL)
+		return NULL;
+	a->writing = 1;
+	a->compress = compress;
+	return a;
+}
+
+/* Add a dump record (the dpkthdr in local byte order,
+ * then the captured packet) to the archive.
+ * Return the record length, or -1 for error. */
+ssize_t
+arc_write(struct arc *a, const void *buf, size_t len)
+{
+	struct dpkthdr pkt;
+	const unsigned char *p = (const unsigned char*) buf + DPKTHDRSIZE;
+	uint32_t ssrc, ts;
+	uint16_t seq;
+	unsigned i, n, caplen, split;
+	memcpy(&pkt, buf, DPKTHDRSIZE);
+	if (pkt.dlen < DPKTHDRSIZE || pkt.dlen > len) {
+		warnx("Bad dump record of %u bytes", pkt.dlen);
+		return -1;
+	}
+	caplen = pkt.dlen - DPKTHDRSIZE;
+	if (a->n && (a->n == ARCBLOCK || a->paylen >= ARCBYTES
+	|| pkt.msec - a->blk.msec >= ARCSPAN) && flush(a) == -1)
+		return -1;
+	if ((n = a->n++) == 0)
+		a->msec = a->blk.msec = pkt.msec;
+	a->col[COL_MSEC][n] = zig(pkt.msec - a->msec);
+	a->col[COL_CAPLEN][n] = caplen;
+	a->col[COL_PLEN][n] = zig((int32_t) pkt.plen - (int32_t) caplen);
+	a->msec = pkt.msec;
+	split = pkt.plen && caplen >= RTPHDRSIZE;
+	a->col[COL_SPLIT][n] = split;
+	if (split) {
+		seq = p[2] << 8 | p[3];
+		ts = get32(p + 4);
+		ssrc = get32(p + 8);
+		i = findssrc(a, ssrc, seq, ts);
+		a->col[COL_B0][n] = p[0];
+		a->col[COL_B1][n] = p[1];
+		a->col[COL_SSRC][n] = i;
+		a->col[COL_SEQ][n] = zig((int16_t) (seq - a->ssrc[i].seq));
+		a->col[COL_TS][n] = zig(ts - a->ssrc[i].ts);
+		a->ssrc[i].seq = seq;
+		a->ssrc[i].ts = ts;
+		p += RTPHDRSIZE;
+		caplen -= RTPHDRSIZE;
+	} else {
+		for (i = COL_B0; i < NCOLS; i++)
+			a->col[i][n] = 0;
+	}
+	memcpy(a->pay + a->paylen, p, caplen);
+	a->paylen += caplen;
+	return pkt.dlen;
+}
+
+/* Start reading an archive, filling in the address
+ * and the header like read_dumpline() and read_dumphdr().
+ * With headers, only the packet headers will be read.
+ * Return the archive, or NULL for error. */
+struct arc*
+arc_open(int fd, struct sockaddr_in *addr, struct dumphdr *hdr, int headers)
+{
+	struct arc *a;
+	if (read_hashline(fd, ARCMAGIC, addr) == -1) {
+		warnx("Error reading archive line");
+		return NULL;
+	}
+	if (read_dumphdr(fd, hdr, DUMPHDRSIZE) == -1)
+		return NULL;
+	if ((a = arc_alloc(fd)) == NULL)
+		return NULL;
+	a->headers = headers;
+	return a;
+}
+
+/* Get len bytes of a section into buf, uncompressing them.
+ * Return 0 for success, -1 for error. */
+static int
+getsect(struct arc *a, unsigned char *buf, size_t raw, size_t len, int z)
+{
+	if (!z)
+		return raw == len && readall(a->fd, buf, len) == 1 ? 0 : -1;
+#if HAVE_ZLIB
+	uLongf have = raw;
+	if (len <= a->zlen && readall(a->fd, a->z, len) == 1
+	&& uncompress(buf, &have, a->z, len) == Z_OK && have == raw)
+		return 0;
+#else
+	warnx("Reading a compressed archive needs zlib");
+#endif
+	return -1;
+}
+
+/* Skip over len bytes of the input. Return 0, or -1 for error. */
+static int
+skip(int fd, size_t len)
+{
+	unsigned char buf[BUFSIZ];
+	size_t n;
+	if (lseek(fd, len, SEEK_CUR) != -1)
+		return 0;
+	for (; len; len -= n) {
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		if (readall(fd, buf, n) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Read the next block, and unpack its header columns.
+ * Return 1 for a block, 0 for the end, -1 for error. */
+static int
+fill(struct arc *a)
+{
+	struct arcblock *b = &a->blk;
+	unsigned char bh[ARCBLOCKSIZE];
+	const unsigned char *p, *end;
+	uint32_t n;
+	unsigned i;
+	int r;
+	if ((r = readall(a->fd, bh, ARCBLOCKSIZE)) != 1)
+		return r;
+	b->magic = get32(bh);
+	b->count = get32(bh + 4);
+	b->msec  = get32(bh + 8);
+	b->flags = get32(bh + 12);
+	b->hraw  = get32(bh + 16);
+	b->hlen  = get32(bh + 20);
+	b->praw  = get32(bh + 24);
+	b->plen  = get32(bh + 28);
+	if (b->magic != ARCBLOCKMAGIC || b->count == 0 || b->count > ARCBLOCK
+	|| b->hraw > HDRMAX || b->praw > PAYMAX) {
+		warnx("Bad archive block");
+		return -1;
+	}
+	if (getsect(a, a->hdr, b->hraw, b->hlen, b->flags & ARC_ZHDR) == -1) {
+		warnx("Error reading archive block headers");
+		return -1;
+	}
+	p = a->hdr;
+	end = a->hdr + b->hraw;
+	if ((p = getvar(p, end, &n)) == NULL || n > b->count
+	|| (size_t) (end - p) < n * 10)
+		goto bad;
+	for (a->nssrc = n, i = 0; i < n; i++, p += 10) {
+		a->ssrc[i].ssrc = get32(p);
+		a->ssrc[i].seq = p[4] << 8 | p[5];
+		a->ssrc[i].ts = get32(p + 6);
+	}
+	for (i = 0; i < NCOLS; i++)
+		if ((p = getcol(p, end, a->col[i], b->count)) == NULL)
+			goto bad;
+	for (n = i = 0; i < b->count; i++) {
+		if (a->col[COL_SSRC][i] >= a->nssrc || a->col[COL_CAPLEN][i]
+		> UINT16_MAX - DPKTHDRSIZE)
+			goto bad;
+		n += a->col[COL_CAPLEN][i];
+		if (a->col[COL_SPLIT][i]) {
+			if (a->col[COL_CAPLEN][i] < RTPHDRSIZE)
+				goto bad;
+			n -= RTPHDRSIZE;
+		}
+	}
+	if (n != b->praw)
+		goto bad;
+	if (a->headers
+	? skip(a->fd, b->plen) == -1
+	: getsect(a, a->pay, b->praw, b->plen, b->flags & ARC_ZPAY) == -1) {
+		warnx("Error reading archive block payload");
+		return -1;
+	}
+	a->n = b->count;
+	a->next = 0;
+	a->msec = b->msec;
+	a->paylen = 0;
+	return 1;
+bad:
+	warnx("Bad archive block headers");
+	return -1;
+}
+
+/* Read the next record, like read_dump(). If only reading
+ * the headers, the record ends after the RTP header.
+ * Return bytes read, 0 for the end, or -1 for error. */
+ssize_t
+arc_read(struct arc *a, void *buf, size_t len)
+{
+	struct dpkthdr *pkt = buf;
+	unsigned char *p = (unsigned char*) buf + DPKTHDRSIZE;
+	struct ssrc *s;
+	unsigned n, caplen, have;
+	int r;
+	if (a->next == a->n && (r = fill(a)) != 1)
+		return r;
+	n = a->next++;
+	caplen = a->col[COL_CAPLEN][n];
+	a->msec += unzig(a->col[COL_MSEC][n]);
+	pkt->msec = a->msec;
+	pkt->dlen = caplen + DPKTHDRSIZE;
+	pkt->plen = caplen + unzig(a->col[COL_PLEN][n]);
+	have = a->col[COL_SPLIT][n] ? RTPHDRSIZE : 0;
+	if (DPKTHDRSIZE + (a->headers ? have : caplen) > len) {
+		warnx("Archived packet of %u bytes is too long", caplen);
+		return -1;
+	}
+	if (have) {
+		s = &a->ssrc[a->col[COL_SSRC][n]];
+		s->seq += unzig(a->col[COL_SEQ][n]);
+		s->ts += unzig(a->col[COL_TS][n]);
+		p[0] = a->col[COL_B0][n];
+		p[1] = a->col[COL_B1][n];
+		p[2] = s->seq >> 8;
+		p[3] = s->seq;
+		put32(p + 4, s->ts);
+		put32(p + 8, s->ssrc);
+	}
+	if (a->headers)
+		return DPKTHDRSIZE + have;
+	memcpy(p + have, a->pay + a->paylen, caplen - have);
+	a->paylen += caplen - have;
+	return DPKTHDRSIZE + caplen;
+}
+
+/* Finish writing the archive (or reading it).
+ * Return 0 for success, -1 for error. */
+int
+arc_close(struct arc *a)
+{
+	int rv = 0;
+	if (a == NULL)
+		return 0;
+	if (a->writing)
+		rv = flush(a);
+	free(a->hdr);
+	free(a->pay);
+	free(a->z);
+	free(a);
+	return rv;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * See the individual source files for information about contributors.
+ * The distribution as a whole is distributed under the following license:
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The archive is a columnar dump: the packets are stored in blocks,
+ * and in each block, the fields of the captured packet headers
+ * and of the RTP headers are stored as columns of deltas,
+ * bit-packed to the width of the widest value, apart from the
+ * rest of the packets. Either part of a block can be compressed.
+ * Reading the headers alone skips the rest altogether. */
+
+#define ARCMAGIC	"#!rtparc1.0 "
+#define ARCBLOCKMAGIC	0x52544142	/* "RTAB" */
+#define ARCBLOCK	1024		/* packets per block at most */
+#define ARCBYTES	(1024 * 1024)	/* payload per block, about */
+#define ARCSPAN		10000		/* msec per block at most */
+
+#define ARC_ZHDR	0x01	/* header columns are compressed */
+#define ARC_ZPAY	0x02	/* payload is compressed */
+
+struct arcblock {
+	uint32_t	magic;
+	uint32_t	count;	/* packets in the block */
+	uint32_t	msec;	/* time of the first packet */
+	uint32_t	flags;	/* ARC_Z* */
+	uint32_t	hraw;	/* size of the header columns */
+	uint32_t	hlen;	/* as stored */
+	uint32_t	praw;	/* size of the payload */
+	uint32_t	plen;	/* as stored */
+};
+
+#define ARCBLOCKSIZE ((size_t) sizeof(struct arcblock))
+
+struct arc;
+
+struct arc	*arc_create	(int, struct sockaddr_in*, struct timeval*, int);
+ssize_t		 arc_write	(struct arc*, const void*, size_t);
+struct arc	*arc_open	(int, struct sockaddr_in*, struct dumphdr*, int);
+ssize_t		 arc_read	(struct arc*, void*, size_t);
+int		 arc_close	(struct arc*);
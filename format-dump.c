@@ -17,6 +17,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -26,20 +27,15 @@
 #include "format-dump.h"
 #include "format-rtp.h"
 
-/* Parse the #! dump line: check that the magic is there,
+/* Parse the rest of a #! line, after the magic:
  * check that the addr/port is valid, and store them.
  * Return 0 on success, or -1 on error. */
-int
-read_dumpline(int fd, struct sockaddr_in *addr)
+static int
+read_addrline(int fd, struct sockaddr_in *addr)
 {
 	char *a, *p;
 	const char *e;
 	char buf[1024];
-	if ((read(fd, buf, DUMPMAGICLEN) != DUMPMAGICLEN)
-	||  (strncmp(buf, DUMPMAGIC, DUMPMAGICLEN) != 0)) {
-		warnx("'%s' not found", DUMPMAGIC);
-		return -1;
-	}
 	for (a = p = buf; read(fd, p, 1) == 1; p++) {
 		if (*p == '\n') {
 			*p = '\0';
@@ -64,21 +60,99 @@ read_dumpline(int fd, struct sockaddr_in *addr)
 	return 0;
 }
 
+/* Parse the #! dump line, of a plain dump or of one with
+ * the nsec timeline: check that the magic is there,
+ * check that the addr/port is valid, and store them.
+ * Return 0 for a plain dump, 1 for the nsec timeline, or -1 on error. */
+int
+read_dumpline(int fd, struct sockaddr_in *addr)
+{
+	char buf[16];
+	int ns;
+	if (read(fd, buf, DUMPMAGICLEN) != (ssize_t) DUMPMAGICLEN) {
+		warnx("'%s' not found", DUMPMAGIC);
+		return -1;
+	}
+	if (strncmp(buf, DUMPMAGIC, DUMPMAGICLEN) == 0) {
+		ns = 0;
+	} else if (strncmp(buf, DUMPNSMAGIC, DUMPMAGICLEN) == 0) {
+		ns = 1;
+	} else {
+		warnx("'%s' not found", DUMPMAGIC);
+		return -1;
+	}
+	return read_addrline(fd, addr) == -1 ? -1 : ns;
+}
+
+/* Parse a #! line starting with the given magic,
+ * as used by the dump file and other formats.
+ * Return 0 on success, or -1 on error. */
+int
+read_hashline(int fd, const char *magic, struct sockaddr_in *addr)
+{
+	char buf[64];
+	size_t len = strlen(magic);
+	if (len > sizeof(buf)
+	||  (read(fd, buf, len) != (ssize_t) len)
+	||  (strncmp(buf, magic, len) != 0)) {
+		warnx("'%s' not found", magic);
+		return -1;
+	}
+	return read_addrline(fd, addr);
+}
+
 /* Write the DUMPLINE, with the given addr/port.
  * Return 0 for success, -1 on error. */
 int
 write_dumpline(int fd, struct sockaddr_in *addr)
+{
+	return write_hashline(fd, DUMPMAGIC, addr);
+}
+
+/* Write the dump line of a dump with the nsec timeline.
+ * Return 0 for success, -1 on error. */
+int
+write_dumpnsline(int fd, struct sockaddr_in *addr)
+{
+	return write_hashline(fd, DUMPNSMAGIC, addr);
+}
+
+/* Write a #! line starting with the given magic.
+ * Return 0 for success, -1 on error. */
+int
+write_hashline(int fd, const char *magic, struct sockaddr_in *addr)
 {
 	int len = 0;
 	char *line = NULL;
-	len = asprintf(&line, "#!rtpplay1.0 %s/%u\n",
-		inet_ntoa(addr->sin_addr), addr->sin_port);
+	len = asprintf(&line, "%s%s/%u\n",
+		magic, inet_ntoa(addr->sin_addr), addr->sin_port);
 	if (write(fd, line, len) != len)
 		return -1;
 	free(line);
 	return len;
 }
 
+/* Name a dump after path with the tag inserted before its suffix:
+ * out.rtp becomes out.tag.rtp, out becomes out.tag.
+ * Return 0 for success, -1 for error. */
+int
+tag_dumpname(char *buf, size_t size, const char *path, const char *tag)
+{
+	int len;
+	const char *dot, *slash;
+	dot = strrchr(path, '.');
+	slash = strrchr(path, '/');
+	if (dot == NULL || dot == path || (slash && dot < slash + 2))
+		dot = path + strlen(path);
+	len = snprintf(buf, size, "%.*s.%s%s",
+		(int) (dot - path), path, tag, dot);
+	if (len < 0 || (size_t) len >= size) {
+		warnx("%s: name too long", path);
+		return -1;
+	}
+	return 0;
+}
+
 void
 print_dumphdr(struct dumphdr *hdr)
 {
@@ -168,18 +242,32 @@ ssize_t
 read_dpkthdr(int fd, void *buf, size_t len)
 {
 	ssize_t r = 0;
-	struct dpkthdr *dpkthdr;
 	if ((r = read(fd, buf, DPKTHDRSIZE)) == 0) {
 		return 0;
 	} else if (r != DPKTHDRSIZE) {
 		warnx("Error reading dumped packet header");
 		return -1;
 	}
-	dpkthdr = (struct dpkthdr*) buf;
+	parse_dpkthdr((struct dpkthdr*) buf);
+	return r;
+}
+
+/* Convert a captured packet header to local byte order. */
+void
+parse_dpkthdr(struct dpkthdr *dpkthdr)
+{
 	dpkthdr->dlen = ntohs(dpkthdr->dlen);
 	dpkthdr->plen = ntohs(dpkthdr->plen);
 	dpkthdr->msec = ntohl(dpkthdr->msec);
-	return r;
+}
+
+/* Convert a captured packet header to network byte order. */
+void
+pack_dpkthdr(struct dpkthdr *dpkthdr)
+{
+	dpkthdr->dlen = htons(dpkthdr->dlen);
+	dpkthdr->plen = htons(dpkthdr->plen);
+	dpkthdr->msec = htonl(dpkthdr->msec);
 }
 
 /* Write a captured packet header into a file,
@@ -190,9 +278,10 @@ write_dpkthdr(int fd, uint16_t plen, uint32_t msec)
 {
 	ssize_t w = 0;
 	struct dpkthdr hdr;
-	hdr.msec = htonl(msec);
-	hdr.plen = htons(plen);
-	hdr.dlen = htons(plen + DPKTHDRSIZE);
+	hdr.msec = msec;
+	hdr.plen = plen;
+	hdr.dlen = plen + DPKTHDRSIZE;
+	pack_dpkthdr(&hdr);
 	if ((w = write(fd, &hdr, DPKTHDRSIZE)) != DPKTHDRSIZE) {
 		warnx("Error writing packet header");
 		return -1;
@@ -200,6 +289,64 @@ write_dpkthdr(int fd, uint16_t plen, uint32_t msec)
 	return w;
 }
 
+/* Get the nsec of a record with the nsec timeline,
+ * stored after the dpkthdr in network byte order. */
+uint64_t
+get_dpktns(const void *rec)
+{
+	const unsigned char *p = (const unsigned char*) rec + DPKTHDRSIZE;
+	uint64_t ns = 0;
+	size_t i;
+	for (i = 0; i < DPKTNSSIZE; i++)
+		ns = ns << 8 | p[i];
+	return ns;
+}
+
+/* Set the nsec of a record with the nsec timeline. */
+void
+set_dpktns(void *rec, uint64_t ns)
+{
+	unsigned char *p = (unsigned char*) rec + DPKTHDRSIZE;
+	size_t i;
+	for (i = DPKTNSSIZE; i > 0; i--, ns >>= 8)
+		p[i - 1] = ns & 0xff;
+}
+
+/* Take the nsec out of a record of len bytes with the nsec timeline,
+ * with the dpkthdr in local byte order, leaving a plain record.
+ * Return the length of that, or -1 if there is no nsec to take. */
+ssize_t
+strip_dpktns(void *rec, size_t len, uint64_t *ns)
+{
+	struct dpkthdr *pkt = rec;
+	unsigned char *p = (unsigned char*) rec + DPKTHDRSIZE;
+	if (len < DPKTHDRSIZE + DPKTNSSIZE
+	|| pkt->dlen < DPKTHDRSIZE + DPKTNSSIZE) {
+		warnx("Record of %zu bytes has no nsec", len);
+		return -1;
+	}
+	*ns = get_dpktns(rec);
+	memmove(p, p + DPKTNSSIZE, len - DPKTHDRSIZE - DPKTNSSIZE);
+	pkt->dlen -= DPKTNSSIZE;
+	return len - DPKTNSSIZE;
+}
+
+/* Make a record with the nsec timeline out of a plain record
+ * of len bytes, with the dpkthdr in local byte order,
+ * into a buffer DPKTNSSIZE bytes longer.
+ * Return the length of the new record. */
+size_t
+add_dpktns(void *ext, const void *rec, size_t len, uint64_t ns)
+{
+	struct dpkthdr *pkt = ext;
+	memcpy(ext, rec, DPKTHDRSIZE);
+	pkt->dlen += DPKTNSSIZE;
+	set_dpktns(ext, ns);
+	memcpy((unsigned char*) ext + DPKTHDRSIZE + DPKTNSSIZE,
+		(const unsigned char*) rec + DPKTHDRSIZE, len - DPKTHDRSIZE);
+	return len + DPKTNSSIZE;
+}
+
 /* Read record from a dump file into a buffer.
  * This means the dpkthdr, the rtphdr, and the payload (as much as stored).
  * Return bytes read, or -1 on error. */
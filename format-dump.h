@@ -38,13 +38,24 @@ struct dpkthdr {
 	uint32_t msec; /* milliseconds since dump start */
 };
 
+/* A dump with the nsec timeline has its own magic, of the same length.
+ * Each of its dpkthdr is followed by the uint64_t nsec since the dump
+ * start, counted in the dlen; the msec is there too, as in a plain dump.
+ * Once read, it is taken out, so that the records look the same. */
+
 #define DUMPMAGIC    "#!rtpplay1.0 "
+#define DUMPNSMAGIC  "#!rtpplay2.0 "
 #define DUMPMAGICLEN strlen(DUMPMAGIC)
 #define DUMPHDRSIZE ((size_t) sizeof(struct dumphdr))
 #define DPKTHDRSIZE ((size_t) sizeof(struct dpkthdr))
+#define DPKTNSSIZE  ((size_t) sizeof(uint64_t))
 
 int	read_dumpline	(int, struct sockaddr_in*);
 int	write_dumpline	(int, struct sockaddr_in*);
+int	write_dumpnsline(int, struct sockaddr_in*);
+int	read_hashline	(int, const char*, struct sockaddr_in*);
+int	write_hashline	(int, const char*, struct sockaddr_in*);
+int	tag_dumpname	(char*, size_t, const char*, const char*);
 
 void	print_dumphdr	(struct dumphdr*);
 ssize_t	read_dumphdr	(int, void*, size_t);
@@ -52,8 +63,15 @@ ssize_t	write_dumphdr	(int, struct sockaddr_in*, struct timeval*);
 int	check_dumphdr	(struct dumphdr*, struct sockaddr_in*);
 
 void	print_dpkthdr	(struct dpkthdr*);
+void	parse_dpkthdr	(struct dpkthdr*);
+void	pack_dpkthdr	(struct dpkthdr*);
 ssize_t	read_dpkthdr	(int, void*, size_t);
 ssize_t	write_dpkthdr	(int, uint16_t, uint32_t);
 
+uint64_t get_dpktns	(const void*);
+void	set_dpktns	(void*, uint64_t);
+ssize_t	strip_dpktns	(void*, size_t, uint64_t*);
+size_t	add_dpktns	(void*, const void*, size_t, uint64_t);
+
 ssize_t	read_dump	(int, void*, size_t);
 ssize_t	write_dump	(int, void*, size_t);
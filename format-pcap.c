@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * See the individual source files for information about contributors.
+ * The distribution as a whole is distributed under the following license:
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "format-dump.h"
+#include "format-rtp.h"
+#include "format-pcap.h"
+
+#define PCAPSNAP	65536	/* bytes of a packet we keep at most */
+
+/* The link types we know, as in pcap-linktype(7). */
+#define LINK_NULL	0
+#define LINK_ETHERNET	1
+#define LINK_RAW	101
+#define LINK_LOOP	108
+#define LINK_SLL	113
+#define LINK_IPV4	228
+
+struct pcapfile {
+	int		fd;
+	int		swap;	/* the file is in the other byte order */
+	int		nsec;	/* the timestamps are in nanoseconds */
+	uint32_t	link;
+	struct timeval	start;
+	int		ahead;	/* the first packet is already in rec */
+	ssize_t		alen;
+	unsigned char	rec[DPKTHDRSIZE + PCAPSNAP];
+	unsigned char	buf[PCAPSNAP];
+};
+
+/* Read len bytes, unless at the very end.
+ * Return 1 for success, 0 for the end, -1 for error. */
+static int
+readall(int fd, void *buf, size_t len)
+{
+	unsigned char *p = buf;
+	size_t have = 0;
+	ssize_t r;
+	while (have < len) {
+		if ((r = read(fd, p + have, len - have)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+		have += r;
+	}
+	if (have == len)
+		return 1;
+	if (have == 0)
+		return 0;
+	errno = EIO;
+	return -1;
+}
+
+static uint32_t
+swap32(uint32_t v)
+{
+	return v >> 24 | (v >> 8 & 0xff00) | (v << 8 & 0xff0000) | v << 24;
+}
+
+static uint32_t
+get32(struct pcapfile *p, const unsigned char *b)
+{
+	uint32_t v;
+	memcpy(&v, b, sizeof(v));
+	return p->swap ? swap32(v) : v;
+}
+
+static uint16_t
+get16be(const unsigned char *b)
+{
+	return b[0] << 8 | b[1];
+}
+
+/* Find the IPv4 packet in a frame of len bytes.
+ * Return its offset, or -1 if there is none. */
+static ssize_t
+linkoff(struct pcapfile *p, const unsigned char *b, size_t len)
+{
+	size_t off;
+	uint16_t type;
+	uint32_t af;
+	switch (p->link) {
+	case LINK_RAW:
+	case LINK_IPV4:
+		return 0;
+	case LINK_NULL:
+	case LINK_LOOP:
+		/* The family is in the byte order of the capturing host,
+		 * but AF_INET is 2 on all of them. */
+		if (len < 4)
+			return -1;
+		memcpy(&af, b, sizeof(af));
+		return (af == 2 || af == 0x02000000) ? 4 : -1;
+	case LINK_SLL:
+		if (len < 16)
+			return -1;
+		return get16be(b + 14) == 0x0800 ? 16 : -1;
+	case LINK_ETHERNET:
+		for (off = 12; off + 2 <= len; off += 4) {
+			type = get16be(b + off);
+			if (type == 0x0800)
+				return off + 2;
+			if (type != 0x8100 && type != 0x88a8)
+				break;
+		}
+		return -1;
+	}
+	return -1;
+}
+
+/* Make a dump record at rec from the frame of len bytes,
+ * captured at the given time;
+ * if it is the first one, that is the start of the dump.
+ * Return the length of the record, or 0 if it is not UDP. */
+static ssize_t
+record(struct pcapfile *p, unsigned char *rec, const unsigned char *b,
+	size_t len, struct timeval *tv, struct sockaddr_in *addr)
+{
+	struct dpkthdr *pkt = (struct dpkthdr*) rec;
+	const unsigned char *udp;
+	struct rtphdr rtp;
+	ssize_t off;
+	size_t ihl, ulen, have;
+	long long usec;
+	if ((off = linkoff(p, b, len)) == -1)
+		return 0;
+	b += off;
+	len -= off;
+	if (len < 20 || (b[0] >> 4) != 4 || b[9] != IPPROTO_UDP
+	|| (ihl = (b[0] & 0x0f) * 4) < 20 || len < ihl + 8
+	|| (get16be(b + 6) & 0x1fff))
+		return 0;
+	udp = b + ihl;
+	if ((ulen = get16be(udp + 4)) < 8)
+		return 0;
+	ulen -= 8;
+	have = len - ihl - 8;
+	if (have > ulen)
+		have = ulen;
+	if (have > UINT16_MAX - DPKTHDRSIZE)
+		have = UINT16_MAX - DPKTHDRSIZE;
+	if (addr) {
+		memset(addr, 0, sizeof(*addr));
+		addr->sin_family = AF_INET;
+		memcpy(&addr->sin_addr.s_addr, b + 16, 4);
+		addr->sin_port = get16be(udp + 2);
+		p->start = *tv;
+	}
+	memcpy(rec + DPKTHDRSIZE, udp + 8, have);
+	pkt->dlen = DPKTHDRSIZE + have;
+	pkt->plen = ulen > UINT16_MAX ? UINT16_MAX : ulen;
+	usec = (tv->tv_sec - p->start.tv_sec) * 1000000LL
+		+ tv->tv_usec - p->start.tv_usec;
+	pkt->msec = usec > 0 ? usec / 1000 : 0;
+	/* What is not RTP, such as RTCP (its packet types
+	 * look like a marked payload type of 72 to 76). */
+	memcpy(&rtp, rec + DPKTHDRSIZE, have < 12 ? have : 12);
+	if (have < 12 || ulen < 12 || rtp.v != RTPVERSION
+	|| (rtp.m && rtp.pt >= 72 && rtp.pt <= 76))
+		pkt->plen = 0;
+	return pkt->dlen;
+}
+
+/* Read the next UDP packet of the capture as a dump record.
+ * Return the length of the record, 0 for the end, -1 for error. */
+static ssize_t
+next(struct pcapfile *p, unsigned char *rec, struct sockaddr_in *addr)
+{
+	unsigned char h[16];
+	struct timeval tv;
+	uint32_t caplen;
+	ssize_t r;
+	int e;
+	for (;;) {
+		if ((e = readall(p->fd, h, sizeof(h))) <= 0) {
+			if (e == -1)
+				warn("Error reading pcap record");
+			return e;
+		}
+		tv.tv_sec = get32(p, h);
+		tv.tv_usec = get32(p, h + 4);
+		if (p->nsec)
+			tv.tv_usec /= 1000;
+		caplen = get32(p, h + 8);
+		if (caplen > sizeof(p->buf)) {
+			warnx("Bad pcap record of %u bytes", caplen);
+			return -1;
+		}
+		if (readall(p->fd, p->buf, caplen) != 1) {
+			warnx("Truncated pcap record");
+			return -1;
+		}
+		if ((r = record(p, rec, p->buf, caplen, &tv, addr)) > 0)
+			return r;
+	}
+}
+
+/* Read the start of the capture, up to its first UDP packet,
+ * and make up a dump header for it.
+ * Return the capture, or NULL for error. */
+struct pcapfile*
+pcap_open(int fd, struct sockaddr_in *addr, struct dumphdr *hdr)
+{
+	struct pcapfile *p;
+	unsigned char h[24];
+	uint32_t magic;
+	if (readall(fd, h, sizeof(h)) != 1) {
+		warnx("Error reading pcap header");
+		return NULL;
+	}
+	if ((p = calloc(1, sizeof(*p))) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+	p->fd = fd;
+	memcpy(&magic, h, sizeof(magic));
+	if (magic == swap32(PCAPMAGIC)
+	||  magic == swap32(PCAPMAGICNSEC)) {
+		p->swap = 1;
+		magic = swap32(magic);
+	}
+	if (magic != PCAPMAGIC && magic != PCAPMAGICNSEC) {
+		warnx("Not a pcap file");
+		goto bad;
+	}
+	p->nsec = magic == PCAPMAGICNSEC;
+	p->link = get32(p, h + 20) & 0x0fffffff;
+	if (p->link != LINK_NULL && p->link != LINK_ETHERNET
+	&& p->link != LINK_RAW && p->link != LINK_LOOP
+	&& p->link != LINK_SLL && p->link != LINK_IPV4) {
+		warnx("Unsupported pcap link type %u", p->link);
+		goto bad;
+	}
+	if ((p->alen = next(p, p->rec, addr)) == -1)
+		goto bad;
+	if (p->alen == 0) {
+		warnx("No UDP packets in the capture");
+		goto bad;
+	}
+	p->ahead = 1;
+	hdr->time.sec = p->start.tv_sec;
+	hdr->time.usec = p->start.tv_usec;
+	hdr->addr = addr->sin_addr.s_addr;
+	hdr->port = addr->sin_port;
+	hdr->zero = 0;
+	return p;
+bad:
+	free(p);
+	return NULL;
+}
+
+/* Read the next UDP packet as a dump record, with the dpkthdr
+ * in local byte order, into buf of len bytes.
+ * Return the length of the record, 0 for the end, -1 for error. */
+ssize_t
+pcap_read(struct pcapfile *p, void *buf, size_t len)
+{
+	struct dpkthdr *pkt = buf;
+	ssize_t r;
+	if (len < DPKTHDRSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (p->ahead) {
+		p->ahead = 0;
+		r = p->alen;
+	} else if ((r = next(p, p->rec, NULL)) <= 0)
+		return r;
+	if ((size_t) r > len)
+		r = len;
+	memcpy(buf, p->rec, r);
+	pkt->dlen = r;
+	return r;
+}
+
+void
+pcap_close(struct pcapfile *p)
+{
+	free(p);
+}
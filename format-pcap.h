@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * See the individual source files for information about contributors.
+ * The distribution as a whole is distributed under the following license:
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Reading the UDP packets of a libpcap(3) capture as dump records:
+ * the captures made by tcpdump(1), with timestamps in microseconds
+ * or nanoseconds, in either byte order, of Ethernet (also with VLAN
+ * tags), Linux cooked, loopback or raw IP links. Only IPv4 is read;
+ * fragments other than the first, and what is not UDP, are skipped.
+ * The dump starts with the first UDP packet, whose destination
+ * becomes the address of the dump. What is not RTP gets stored
+ * with a zero plen, as rtptools do with RTCP. */
+
+#define PCAPMAGIC	0xa1b2c3d4	/* usec timestamps */
+#define PCAPMAGICNSEC	0xa1b23c4d	/* nsec timestamps */
+
+struct pcapfile;
+
+struct pcapfile	*pcap_open	(int, struct sockaddr_in*, struct dumphdr*);
+ssize_t		 pcap_read	(struct pcapfile*, void*, size_t);
+void		 pcap_close	(struct pcapfile*);
@@ -1,8 +1,17 @@
 #include <arpa/inet.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "format-rtp.h"
 
+#if !HAVE_BIGENDIAN && defined(__AVX2__)
+#include <immintrin.h>
+#elif !HAVE_BIGENDIAN && defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif !HAVE_BIGENDIAN && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 void
 print_rtphdr(struct rtphdr* rtp)
 {
@@ -32,7 +41,98 @@ parse_rtphdr(struct rtphdr* rtp)
 	size += 12 + rtp->cc * 4;
 	if (rtp->x) {
 		ext = (struct rtpext*)((unsigned char*)rtp + size);
-		size += 4 + ext->elen * 4;
+		size += 4 + ntohs(ext->elen) * 4;
 	}
 	return size;
 }
+
+/* Swap the n words to local byte order: eight at a time with AVX2,
+ * four at a time with SSSE3 or SSE2, whichever the compiler targets,
+ * and the rest one by one. */
+static void
+swapwords(uint32_t *w, unsigned n)
+{
+	unsigned i = 0;
+#if !HAVE_BIGENDIAN && defined(__AVX2__)
+	const __m256i s8 = _mm256_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (; i + 8 <= n; i += 8)
+		_mm256_storeu_si256((__m256i*) (w + i), _mm256_shuffle_epi8(
+			_mm256_loadu_si256((__m256i*) (w + i)), s8));
+#endif
+#if !HAVE_BIGENDIAN && (defined(__AVX2__) || defined(__SSSE3__))
+	const __m128i s4 = _mm_setr_epi8(
+		3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_si128((__m128i*) (w + i), _mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i*) (w + i)), s4));
+#elif !HAVE_BIGENDIAN && defined(__SSE2__)
+	__m128i v;
+	for (; i + 4 <= n; i += 4) {
+		/* Swap the bytes of each half, then the halves. */
+		v = _mm_loadu_si128((__m128i*) (w + i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((__m128i*) (w + i), v);
+	}
+#endif
+	for (; i < n; i++)
+		w[i] = ntohl(w[i]);
+}
+
+/* Decode the RTP headers of up to RTPBATCH packets, given where
+ * each starts and how many bytes there are of it. The three words
+ * of the fixed headers are gathered into an array each, swapped
+ * together, and split into the fields; only an extension needs
+ * a look at the packet itself.
+ * Return the number of valid packets. */
+unsigned
+decode_rtphdrs(struct rtphdrs *h, unsigned char *const *pkt,
+	const size_t *len, unsigned n)
+{
+	uint32_t w[3][RTPBATCH];
+	uint16_t elen;
+	unsigned i, valid = 0;
+	if (n > RTPBATCH)
+		n = RTPBATCH;
+	for (i = 0; i < n; i++) {
+		if (len[i] < 12) {
+			w[0][i] = w[1][i] = w[2][i] = 0;
+			continue;
+		}
+		memcpy(&w[0][i], pkt[i], 4);
+		memcpy(&w[1][i], pkt[i] + 4, 4);
+		memcpy(&w[2][i], pkt[i] + 8, 4);
+	}
+	swapwords(w[0], n);
+	swapwords(w[1], n);
+	swapwords(w[2], n);
+	h->n = n;
+	h->valid = 0;
+	for (i = 0; i < n; i++) {
+		h->m[i] = w[0][i] >> 23 & 0x01;
+		h->pt[i] = w[0][i] >> 16 & 0x7f;
+		h->seq[i] = w[0][i] & 0xffff;
+		h->ts[i] = w[1][i];
+		h->ssrc[i] = w[2][i];
+		h->hlen[i] = 12 + (w[0][i] >> 24 & 0x0f) * 4;
+		if ((w[0][i] >> 30) == RTPVERSION)
+			h->valid |= 1U << i;
+	}
+	for (i = 0; i < n; i++) {
+		if ((h->valid & (1U << i)) == 0)
+			continue;
+		valid++;
+		if ((w[0][i] & 0x10000000) == 0)
+			continue;
+		/* The extension says how long it is. */
+		if (len[i] >= h->hlen[i] + 4u) {
+			memcpy(&elen, pkt[i] + h->hlen[i] + 2, 2);
+			h->hlen[i] += ntohs(elen) * 4;
+		}
+		h->hlen[i] += 4;
+	}
+	return valid;
+}
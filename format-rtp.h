@@ -48,6 +48,27 @@ struct rtpext {
 	uint16_t elen;	/* extension length in 32-bit words */
 };
 
+/* The RTP headers of a batch of packets, decoded at once into an
+ * array for each field, in local byte order. A packet is valid if
+ * it has the 12 bytes of the fixed header, of the RTP version; its
+ * hlen includes the CSRCs and the extension, and is where the payload
+ * starts, but may be more than the bytes there are of the packet. */
+
+#define RTPBATCH	16	/* headers decoded at once */
+
+struct rtphdrs {
+	unsigned	n;
+	uint32_t	valid;	/* bit i is set if packet i is valid */
+	uint8_t		m[RTPBATCH];
+	uint8_t		pt[RTPBATCH];
+	uint16_t	seq[RTPBATCH];
+	uint32_t	ts[RTPBATCH];
+	uint32_t	ssrc[RTPBATCH];
+	uint32_t	hlen[RTPBATCH];
+};
+
 void	print_rtphdr(struct rtphdr*);
 ssize_t parse_rtphdr(struct rtphdr*);
+unsigned decode_rtphdrs(struct rtphdrs*, unsigned char *const*,
+	const size_t*, unsigned);
 
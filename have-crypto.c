@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <openssl/evp.h>
+
+int
+main(void)
+{
+	unsigned char key[16] = { 0 }, iv[16] = { 0 }, buf[16] = { 0 };
+	EVP_CIPHER_CTX *ctx;
+	int len;
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+		return 1;
+	return !EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, key, iv)
+	|| !EVP_EncryptUpdate(ctx, buf, &len, buf, sizeof(buf));
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdio.h>
+
+#include "hist.h"
+
+/* Position of the most significant bit of a nonzero value. */
+static unsigned
+msb(uint64_t v)
+{
+	unsigned b = 0;
+	if (v >> 32) { v >>= 32; b += 32; }
+	if (v >> 16) { v >>= 16; b += 16; }
+	if (v >>  8) { v >>=  8; b +=  8; }
+	if (v >>  4) { v >>=  4; b +=  4; }
+	if (v >>  2) { v >>=  2; b +=  2; }
+	if (v >>  1) {           b +=  1; }
+	return b;
+}
+
+/* Return the bucket index of a value. */
+static unsigned
+hist_index(uint64_t v)
+{
+	unsigned m;
+	if (v < HISTSUB)
+		return v;
+	m = msb(v);
+	return (m - HISTBITS + 1) * HISTSUB
+		+ ((v >> (m - HISTBITS)) & (HISTSUB - 1));
+}
+
+/* Return the lowest value that falls into the given bucket. */
+uint64_t
+hist_low(unsigned i)
+{
+	unsigned b = i / HISTSUB;
+	if (b == 0)
+		return i;
+	return (uint64_t) (HISTSUB + i % HISTSUB) << (b - 1);
+}
+
+void
+hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(struct hist));
+	h->min = UINT64_MAX;
+}
+
+void
+hist_add(struct hist *h, uint64_t v)
+{
+	h->bucket[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* Add the counts of 'from' into 'to'. */
+void
+hist_merge(struct hist *to, struct hist *from)
+{
+	unsigned i;
+	for (i = 0; i < HISTLEN; i++)
+		to->bucket[i] += from->bucket[i];
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->min < to->min)
+		to->min = from->min;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+/* Return the value at the given percentile (0 to 100),
+ * as the lowest value of the bucket it falls into.
+ * Return 0 for an empty histogram. */
+uint64_t
+hist_pct(struct hist *h, double pct)
+{
+	unsigned i;
+	uint64_t seen = 0, want;
+	if (h->count == 0)
+		return 0;
+	want = pct / 100.0 * h->count;
+	if (want >= h->count)
+		return h->max;
+	for (i = 0; i < HISTLEN; i++)
+		if ((seen += h->bucket[i]) > want)
+			break;
+	if (i == HISTLEN)
+		return h->max;
+	return hist_low(i) < h->min ? h->min : hist_low(i);
+}
+
+/* Print a one-line summary of the histogram,
+ * with the values divided by 'unit' (e.g. 1e3 for ns to usec). */
+void
+hist_print(FILE *f, const char *name, struct hist *h, double unit)
+{
+	if (h->count == 0) {
+		fprintf(f, "%s n 0\n", name);
+		return;
+	}
+	fprintf(f, "%s n %llu min %.1f avg %.1f p50 %.1f p90 %.1f "
+		"p99 %.1f p99.9 %.1f max %.1f\n", name,
+		(unsigned long long) h->count,
+		h->min / unit, (double) h->sum / h->count / unit,
+		hist_pct(h, 50.0) / unit, hist_pct(h, 90.0) / unit,
+		hist_pct(h, 99.0) / unit, hist_pct(h, 99.9) / unit,
+		h->max / unit);
+}
+
+/* Draw the nonempty buckets of the histogram,
+ * with the values divided by 'unit'. */
+void
+hist_plot(FILE *f, struct hist *h, double unit)
+{
+	unsigned i, j, bar;
+	uint64_t top = 0;
+	for (i = 0; i < HISTLEN; i++)
+		if (h->bucket[i] > top)
+			top = h->bucket[i];
+	for (i = 0; i < HISTLEN; i++) {
+		if (h->bucket[i] == 0)
+			continue;
+		bar = 1 + 49 * h->bucket[i] / top;
+		fprintf(f, "%12.1f %10llu ", hist_low(i) / unit,
+			(unsigned long long) h->bucket[i]);
+		for (j = 0; j < bar; j++)
+			fputc('#', f);
+		fputc('\n', f);
+	}
+}
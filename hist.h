@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* A log-linear histogram in the spirit of HdrHistogram:
+ * values below HISTSUB are counted exactly, larger values
+ * fall into HISTSUB linear sub-buckets of each power of two,
+ * which keeps the relative error below 1/HISTSUB.
+ * Adding a value is a few shifts and an increment. */
+
+#define HISTBITS 5
+#define HISTSUB  (1 << HISTBITS)
+#define HISTLEN  ((64 - HISTBITS + 1) * HISTSUB)
+
+struct hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	bucket[HISTLEN];
+};
+
+void		hist_init	(struct hist*);
+void		hist_add	(struct hist*, uint64_t);
+void		hist_merge	(struct hist*, struct hist*);
+uint64_t	hist_pct	(struct hist*, double);
+uint64_t	hist_low	(unsigned);
+void		hist_print	(FILE*, const char*, struct hist*, double);
+void		hist_plot	(FILE*, struct hist*, double);
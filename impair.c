@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "config.h"
+#include "impair.h"
+#include "stats.h"
+
+#define IMPAIRBUF	2048	/* bytes of a recycled buffer */
+
+/* A packet held back, due at the given nsec; those due at the same
+ * time go in the order they came. Its buffer is IMPAIRBUF bytes long
+ * and recycled if the packet fits, or allocated for it otherwise. */
+struct held {
+	uint64_t	 due;
+	uint64_t	 order;
+	unsigned char	*buf;
+	size_t		 len;
+};
+
+struct impair {
+	double		 loss;		/* probabilities */
+	double		 gep;		/* good to bad */
+	double		 ger;		/* bad to good */
+	double		 gebad;		/* loss in the bad state */
+	double		 gegood;	/* loss in the good state */
+	double		 reorder;
+	double		 dup;
+	uint64_t	 delay;		/* nsec */
+	uint64_t	 jitter;
+	int		 normal;	/* jitter distribution */
+	int		 ge;		/* the Gilbert-Elliott model is used */
+	int		 bad;		/* in its bad state */
+	uint64_t	 rng[4];
+	struct held	*heap;
+	size_t		 count;
+	size_t		 size;
+	uint64_t	 order;
+	unsigned char	*free;		/* recycled buffers, linked */
+};
+
+/* Parse a number from the start of s, in [0, max].
+ * Return 0 for success, -1 for error. */
+static int
+getnum(const char *name, char **s, double max, double *d)
+{
+	char *e;
+	errno = 0;
+	*d = strtod(*s, &e);
+	if (e == *s || errno || *d < 0 || *d > max) {
+		warnx("%s: bad value '%s'", name, *s);
+		return -1;
+	}
+	*s = e;
+	return 0;
+}
+
+/* Parse a single number in [0, max] as the whole value.
+ * Return 0 for success, -1 for error. */
+static int
+getval(const char *name, char *s, double max, double *d)
+{
+	if (s == NULL || *s == '\0') {
+		warnx("%s needs a value", name);
+		return -1;
+	}
+	if (getnum(name, &s, max, d) == -1)
+		return -1;
+	if (*s) {
+		warnx("%s: bad value", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* The random numbers are xoshiro256**, seeded with splitmix64. */
+static uint64_t
+rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static void
+seed(struct impair *m, uint64_t s)
+{
+	uint64_t z;
+	int i;
+	for (i = 0; i < 4; i++) {
+		z = (s += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		m->rng[i] = z ^ (z >> 31);
+	}
+}
+
+/* Return a random number in [0, 1). */
+static double
+rnd(struct impair *m)
+{
+	uint64_t *s = m->rng;
+	uint64_t r = rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 45);
+	return (r >> 11) * 0x1.0p-53;
+}
+
+/* Parse the impairment.
+ * Return the impairment, or NULL for error. */
+struct impair*
+impair_open(char *spec)
+{
+	struct impair *m;
+	char *val;
+	double d;
+	int seeded = 0;
+	enum { TERM_DELAY, TERM_DIST, TERM_DUP, TERM_GE, TERM_JITTER,
+		TERM_LOSS, TERM_REORDER, TERM_SEED };
+	char *const terms[] = {
+		(char*) "delay",
+		(char*) "dist",
+		(char*) "dup",
+		(char*) "ge",
+		(char*) "jitter",
+		(char*) "loss",
+		(char*) "reorder",
+		(char*) "seed",
+		NULL
+	};
+	if ((m = calloc(1, sizeof(*m))) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+	m->gebad = 1;
+	while (*spec) switch (getsubopt(&spec, terms, &val)) {
+		case TERM_DELAY:
+			if (getval("delay", val, 3600000, &d) == -1)
+				goto bad;
+			m->delay = d * 1e6;
+			break;
+		case TERM_DIST:
+			if (val && strcmp(val, "normal") == 0)
+				m->normal = 1;
+			else if (val && strcmp(val, "uniform") == 0)
+				m->normal = 0;
+			else {
+				warnx("dist: uniform or normal");
+				goto bad;
+			}
+			break;
+		case TERM_DUP:
+			if (getval("dup", val, 100, &d) == -1)
+				goto bad;
+			m->dup = d / 100;
+			break;
+		case TERM_GE:
+			/* p:r[:bad[:good]] */
+			if (val == NULL || getnum("ge", &val, 100, &d) == -1)
+				goto bad;
+			m->gep = d / 100;
+			if (*val != ':') {
+				warnx("ge: bad value");
+				goto bad;
+			}
+			val++;
+			if (getnum("ge", &val, 100, &d) == -1)
+				goto bad;
+			m->ger = d / 100;
+			if (*val == ':') {
+				val++;
+				if (getnum("ge", &val, 100, &d) == -1)
+					goto bad;
+				m->gebad = d / 100;
+			}
+			if (*val == ':') {
+				val++;
+				if (getnum("ge", &val, 100, &d) == -1)
+					goto bad;
+				m->gegood = d / 100;
+			}
+			if (*val) {
+				warnx("ge: bad value");
+				goto bad;
+			}
+			m->ge = 1;
+			break;
+		case TERM_JITTER:
+			if (getval("jitter", val, 3600000, &d) == -1)
+				goto bad;
+			m->jitter = d * 1e6;
+			break;
+		case TERM_LOSS:
+			if (getval("loss", val, 100, &d) == -1)
+				goto bad;
+			m->loss = d / 100;
+			break;
+		case TERM_REORDER:
+			if (getval("reorder", val, 100, &d) == -1)
+				goto bad;
+			m->reorder = d / 100;
+			break;
+		case TERM_SEED:
+			if (getval("seed", val, UINT64_MAX, &d) == -1)
+				goto bad;
+			seed(m, d);
+			seeded = 1;
+			break;
+		default:
+			warnx("unknown impairment: %s", val);
+			goto bad;
+	}
+	if (!seeded)
+		seed(m, (uint64_t) time(NULL) << 16 ^ getpid());
+	return m;
+bad:
+	free(m);
+	return NULL;
+}
+
+/* Return the delay of a packet, in nsec. The normal distribution
+ * is approximated by the sum of twelve uniform ones (Irwin-Hall). */
+static uint64_t
+delay(struct impair *m)
+{
+	double d;
+	int i;
+	if (m->jitter == 0)
+		return m->delay;
+	if (m->normal) {
+		for (d = -6, i = 0; i < 12; i++)
+			d += rnd(m);
+		d = m->delay + m->jitter * d;
+	} else
+		d = m->delay + m->jitter * (2 * rnd(m) - 1);
+	return d < 0 ? 0 : d;
+}
+
+/* Decide what happens to a packet coming now: it can get lost,
+ * or go out once, or twice, at the times put into due.
+ * Return the number of times it goes out. */
+unsigned
+impair_fate(struct impair *m, uint64_t now, uint64_t *due)
+{
+	unsigned i, n;
+	int lost = 0;
+	if (m->ge) {
+		lost = rnd(m) < (m->bad ? m->gebad : m->gegood);
+		if (rnd(m) < (m->bad ? m->ger : m->gep))
+			m->bad = !m->bad;
+	}
+	if (m->loss && rnd(m) < m->loss)
+		lost = 1;
+	if (lost) {
+		stats.implost++;
+		return 0;
+	}
+	n = 1;
+	if (m->dup && rnd(m) < m->dup) {
+		stats.impdup++;
+		n = 2;
+	}
+	for (i = 0; i < n; i++) {
+		if (m->reorder && rnd(m) < m->reorder) {
+			stats.impreorder++;
+			due[i] = now;
+		} else if ((due[i] = now + delay(m)) > now)
+			stats.impdelay++;
+	}
+	return n;
+}
+
+static int
+before(const struct held *a, const struct held *b)
+{
+	return a->due < b->due || (a->due == b->due && a->order < b->order);
+}
+
+/* Hold a packet back till it is due.
+ * Return 0 for success, -1 for error. */
+int
+impair_hold(struct impair *m, uint64_t due, const void *buf, size_t len)
+{
+	struct held h, *heap;
+	size_t i, up, size;
+	if (m->count == IMPAIRHOLD)
+		return -1;
+	if (m->count == m->size) {
+		size = m->size ? 2 * m->size : 1024;
+		if ((heap = realloc(m->heap, size * sizeof(*heap))) == NULL) {
+			warn(NULL);
+			return -1;
+		}
+		m->heap = heap;
+		m->size = size;
+	}
+	if (len <= IMPAIRBUF && m->free) {
+		h.buf = m->free;
+		memcpy(&m->free, m->free, sizeof(m->free));
+	} else if ((h.buf = malloc(len > IMPAIRBUF ? len : IMPAIRBUF))
+	== NULL) {
+		warn(NULL);
+		return -1;
+	}
+	memcpy(h.buf, buf, len);
+	h.len = len;
+	h.due = due;
+	h.order = m->order++;
+	for (i = m->count++; i > 0; i = up) {
+		up = (i - 1) / 2;
+		if (!before(&h, &m->heap[up]))
+			break;
+		m->heap[i] = m->heap[up];
+	}
+	m->heap[i] = h;
+	return 0;
+}
+
+/* Take the next packet held back if it is due by now,
+ * into a buffer of size bytes.
+ * Return its length, or 0 if none is due. */
+size_t
+impair_take(struct impair *m, uint64_t now, void *buf, size_t size)
+{
+	struct held h, last;
+	size_t i, c, len;
+	if (m->count == 0 || m->heap[0].due > now)
+		return 0;
+	h = m->heap[0];
+	last = m->heap[--m->count];
+	for (i = 0; (c = 2 * i + 1) < m->count; i = c) {
+		if (c + 1 < m->count && before(&m->heap[c + 1], &m->heap[c]))
+			c++;
+		if (!before(&m->heap[c], &last))
+			break;
+		m->heap[i] = m->heap[c];
+	}
+	if (m->count)
+		m->heap[i] = last;
+	len = h.len < size ? h.len : size;
+	memcpy(buf, h.buf, len);
+	if (h.len <= IMPAIRBUF) {
+		memcpy(h.buf, &m->free, sizeof(m->free));
+		m->free = h.buf;
+	} else
+		free(h.buf);
+	return len;
+}
+
+/* Return when the next packet held back is due, or 0 if none is. */
+uint64_t
+impair_due(const struct impair *m)
+{
+	if (m == NULL || m->count == 0)
+		return 0;
+	return m->heap[0].due ? m->heap[0].due : 1;
+}
+
+void
+impair_close(struct impair *m)
+{
+	unsigned char *b;
+	size_t i;
+	if (m == NULL)
+		return;
+	for (i = 0; i < m->count; i++)
+		free(m->heap[i].buf);
+	while ((b = m->free)) {
+		memcpy(&m->free, b, sizeof(m->free));
+		free(b);
+	}
+	free(m->heap);
+	free(m);
+}
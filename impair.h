@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Impairing a stream the way a bad network would, for testing
+ * its receivers. An impairment is a comma-separated list of terms:
+ * loss=percent loses packets at random; ge=p:r[:bad[:good]] loses them
+ * by the Gilbert-Elliott model, going from the good state to the bad
+ * one with the probability p and back with r (in percent), and losing
+ * bad (100 by default) and good (0) percent of the packets there;
+ * delay=msec delays every packet, and jitter=msec varies the delay,
+ * uniformly within the jitter, or with dist=normal as its deviation;
+ * reorder=percent sends packets right away, ahead of those delayed;
+ * dup=percent sends packets twice; seed=n seeds the random numbers,
+ * so that the same stream gets impaired the same way.
+ * The packets held back are kept in a heap by the time they are due. */
+
+#define IMPAIRHOLD	(1 << 20)	/* packets held back at most */
+
+struct impair;
+
+struct impair	*impair_open	(char*);
+unsigned	 impair_fate	(struct impair*, uint64_t, uint64_t*);
+int		 impair_hold	(struct impair*, uint64_t, const void*, size_t);
+size_t		 impair_take	(struct impair*, uint64_t, void*, size_t);
+uint64_t	 impair_due	(const struct impair*);
+void		 impair_close	(struct impair*);
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "format-dump.h"
+#include "merge.h"
+
+/* Each input is read a record header ahead: that is what the inputs
+ * are ordered by, in a heap with the earliest one on top. The rest
+ * of the record is only read when the record is taken, straight into
+ * the caller's buffer; so the memory needed stays the same, however
+ * long the inputs are. The time of a record is its msec (or nsec,
+ * in a dump with the nsec timeline) plus the start of its dump,
+ * in usec since the earliest start of them all; that earliest start
+ * is the start of the merged dump. The nsec of a record is read
+ * with its header, so that the rest is as in a plain dump. */
+
+struct input {
+	const char	*path;
+	int		 fd;
+	uint64_t	 start;	/* usec since the merged start */
+	uint64_t	 when;	/* of the next record, likewise */
+	int		 ns;	/* the nsec timeline */
+	struct dpkthdr	 pkt;	/* the next record's header */
+};
+
+struct merge {
+	struct input	 *in;
+	struct input	**heap;
+	int		  n;	/* inputs in the heap */
+	int		  total;
+	struct sockaddr_in addr;
+	struct dumphdr	  hdr;
+};
+
+/* Is a before b? Inputs of the same time go in the given order. */
+static int
+before(const struct input *a, const struct input *b)
+{
+	return a->when < b->when || (a->when == b->when && a < b);
+}
+
+/* Move the input at i down the heap, to where it belongs. */
+static void
+down(struct merge *m, int i)
+{
+	struct input *t;
+	int c;
+	while ((c = 2 * i + 1) < m->n) {
+		if (c + 1 < m->n && before(m->heap[c + 1], m->heap[c]))
+			c++;
+		if (!before(m->heap[c], m->heap[i]))
+			break;
+		t = m->heap[c];
+		m->heap[c] = m->heap[i];
+		m->heap[i] = t;
+		i = c;
+	}
+}
+
+/* Read the header of the next record of an input.
+ * Return 1 for success, 0 for the end, -1 for error. */
+static int
+ahead(struct input *in)
+{
+	unsigned char rec[DPKTHDRSIZE + DPKTNSSIZE];
+	ssize_t r;
+	if ((r = read_dpkthdr(in->fd, &in->pkt, DPKTHDRSIZE)) <= 0)
+		return r;
+	if (in->pkt.dlen < DPKTHDRSIZE + (in->ns ? DPKTNSSIZE : 0)) {
+		warnx("%s: bad record length %u", in->path, in->pkt.dlen);
+		return -1;
+	}
+	if (in->ns) {
+		if (read(in->fd, rec + DPKTHDRSIZE, DPKTNSSIZE)
+		!= (ssize_t) DPKTNSSIZE) {
+			warnx("%s: error reading the nsec of a record",
+				in->path);
+			return -1;
+		}
+		in->pkt.dlen -= DPKTNSSIZE;
+		in->when = in->start + get_dpktns(rec) / 1000;
+	} else {
+		in->when = in->start + in->pkt.msec * 1000ULL;
+	}
+	return 1;
+}
+
+/* Open the given dump files, read their headers,
+ * and the first record header of each.
+ * Return the merge, or NULL for error. */
+struct merge*
+merge_open(char **paths, int n)
+{
+	struct merge *m;
+	struct input *in;
+	struct dumphdr hdr;
+	struct sockaddr_in addr;
+	uint64_t start, first = UINT64_MAX;
+	int i, r;
+	if ((m = calloc(1, sizeof(*m))) == NULL
+	|| (m->in = calloc(n, sizeof(struct input))) == NULL
+	|| (m->heap = calloc(n, sizeof(struct input*))) == NULL) {
+		warn("merge");
+		goto bad;
+	}
+	for (i = 0; i < n; i++)
+		m->in[i].fd = -1;
+	m->total = n;
+	for (i = 0; i < n; i++) {
+		in = &m->in[i];
+		in->path = paths[i];
+		if ((in->fd = open(in->path, O_RDONLY)) == -1) {
+			warn("%s", in->path);
+			goto bad;
+		}
+		if ((in->ns = read_dumpline(in->fd, &addr)) == -1
+		|| read_dumphdr(in->fd, &hdr, DUMPHDRSIZE) == -1) {
+			warnx("%s: not a dump file", in->path);
+			goto bad;
+		}
+		if (check_dumphdr(&hdr, &addr) == -1)
+			warnx("%s: dump file header is inconsistent", in->path);
+		start = hdr.time.sec * 1000000ULL + hdr.time.usec;
+		in->start = start;
+		if (start < first) {
+			first = start;
+			m->addr = addr;
+			m->hdr = hdr;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		in = &m->in[i];
+		in->start -= first;
+		if ((r = ahead(in)) == -1)
+			goto bad;
+		if (r == 0) {
+			close(in->fd);
+			in->fd = -1;
+			continue;
+		}
+		m->heap[m->n++] = in;
+	}
+	for (i = m->n / 2 - 1; i >= 0; i--)
+		down(m, i);
+	return m;
+bad:
+	merge_close(m);
+	return NULL;
+}
+
+/* Fill in the address and the header of the merged dump:
+ * those of the one which started first. */
+void
+merge_hdr(struct merge *m, struct sockaddr_in *addr, struct dumphdr *hdr)
+{
+	*addr = m->addr;
+	*hdr = m->hdr;
+}
+
+/* Read the earliest record of all the inputs, like read_dump(),
+ * with its time counted from the start of the merged dump.
+ * Return bytes read, 0 for the end, or -1 for error. */
+ssize_t
+merge_read(struct merge *m, void *buf, size_t len)
+{
+	struct input *in;
+	struct dpkthdr *pkt = buf;
+	ssize_t want, r;
+	if (m->n == 0)
+		return 0;
+	in = m->heap[0];
+	want = in->pkt.dlen - DPKTHDRSIZE;
+	if (in->pkt.dlen > len) {
+		warnx("%s: record of %u bytes is too long",
+			in->path, in->pkt.dlen);
+		return -1;
+	}
+	*pkt = in->pkt;
+	pkt->msec = in->when / 1000;
+	if ((r = read(in->fd, (unsigned char*) buf + DPKTHDRSIZE, want))
+	!= want) {
+		warnx("%s: error reading %zd bytes of RTP packet",
+			in->path, want);
+		return -1;
+	}
+	if ((r = ahead(in)) == -1)
+		return -1;
+	if (r == 0) {
+		close(in->fd);
+		in->fd = -1;
+		m->heap[0] = m->heap[--m->n];
+	}
+	down(m, 0);
+	return DPKTHDRSIZE + want;
+}
+
+void
+merge_close(struct merge *m)
+{
+	int i;
+	if (m == NULL)
+		return;
+	for (i = 0; m->in && i < m->total; i++)
+		if (m->in[i].fd != -1)
+			close(m->in[i].fd);
+	free(m->in);
+	free(m->heap);
+	free(m);
+}
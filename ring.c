@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#if HAVE_PTHREAD
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#include "ring.h"
+
+/* Each buffer holds one packet as returned by the reading function,
+ * with its return value: a length of 0 or -1 is the end of the input,
+ * and the last buffer the thread fills. The producer and the consumer
+ * count the buffers they have ever filled and taken; only a sleeping
+ * side needs the lock, and whoever moves their count while the other
+ * one sleeps on it wakes them up; the counts and the sleeping flags
+ * are sequentially consistent, so that no wakeup gets lost. */
+
+enum { HEAD, TAIL };
+
+#if HAVE_PTHREAD
+
+struct slot {
+	ssize_t		len;
+	unsigned char	buf[];
+};
+
+struct ring {
+	unsigned	 depth;
+	size_t		 size;	/* of a buffer */
+	unsigned char	*slots;
+	int		 cpu;	/* to pin the thread to, or -1 */
+	int		 fd;	/* to read from */
+	size_t		 len;	/* to read at most */
+	ssize_t		 (*fill)(int, void*, size_t);
+	ssize_t		 end;	/* the last value read, once taken */
+	int		 ended;
+	int		 running;
+	pthread_t	 thread;
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond[2];
+	atomic_size_t	 count[2];	/* buffers filled, taken */
+	atomic_int	 sleeping[2];	/* on the count */
+	atomic_int	 stop;
+};
+
+static struct slot*
+slot(struct ring *r, size_t n)
+{
+	return (struct slot*)
+		(r->slots + (n % r->depth) * (sizeof(struct slot) + r->size));
+}
+
+/* Move the count by one, and wake up whoever sleeps on it. */
+static void
+move(struct ring *r, int c)
+{
+	atomic_fetch_add(&r->count[c], 1);
+	if (atomic_load(&r->sleeping[c])) {
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond[c]);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+/* Sleep till the count is no longer n,
+ * or till stopped, or for at most RINGWAIT msec.
+ * Return 0 if it has moved, -1 if not. */
+static int
+await(struct ring *r, int c, size_t n)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_REALTIME, &t);
+	t.tv_nsec += RINGWAIT * 1000000L;
+	if (t.tv_nsec >= 1000000000L) {
+		t.tv_nsec -= 1000000000L;
+		t.tv_sec++;
+	}
+	pthread_mutex_lock(&r->lock);
+	atomic_store(&r->sleeping[c], 1);
+	if (atomic_load(&r->count[c]) == n && !atomic_load(&r->stop))
+		pthread_cond_timedwait(&r->cond[c], &r->lock, &t);
+	atomic_store(&r->sleeping[c], 0);
+	pthread_mutex_unlock(&r->lock);
+	return atomic_load(&r->count[c]) == n ? -1 : 0;
+}
+
+/* The input thread: fill the buffers one by one, waiting for
+ * a free one when the ring is full, till the end of the input.
+ * Only the reading itself can be cancelled, by ring_close(). */
+static void *
+run(void *arg)
+{
+	size_t head = 0;
+	struct slot *s;
+	struct ring *r = arg;
+	sigset_t all;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, NULL);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	if (r->cpu != -1)
+		ring_pin(r->cpu);
+	do {
+		while (head - atomic_load(&r->count[TAIL]) == r->depth)
+			if (await(r, TAIL, head - r->depth) == -1
+			&& atomic_load(&r->stop))
+				return NULL;
+		s = slot(r, head);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		s->len = r->fill(r->fd, s->buf, r->len);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		head++;
+		move(r, HEAD);
+	} while (s->len > 0 && !atomic_load(&r->stop));
+	return NULL;
+}
+
+/* Make a ring of depth buffers of size bytes; the thread filling it
+ * gets pinned to the given cpu, unless that is -1.
+ * Return the ring, or NULL for error. */
+struct ring*
+ring_open(unsigned depth, size_t size, int cpu)
+{
+	struct ring *r;
+	if ((r = calloc(1, sizeof(*r))) == NULL
+	|| (r->slots = calloc(depth, sizeof(struct slot) + size)) == NULL) {
+		warn(NULL);
+		free(r);
+		return NULL;
+	}
+	r->depth = depth;
+	r->size = size;
+	r->cpu = cpu;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond[HEAD], NULL);
+	pthread_cond_init(&r->cond[TAIL], NULL);
+	return r;
+}
+
+/* Start the thread reading at most len bytes at a time
+ * from fd, with the given function, which returns
+ * the bytes read, 0 for the end, or -1 for error.
+ * Return 0 for success, -1 for error. */
+int
+ring_start(struct ring *r, ssize_t (*fill)(int, void*, size_t),
+	int fd, size_t len)
+{
+	r->fill = fill;
+	r->fd = fd;
+	r->len = len < r->size ? len : r->size;
+	if ((errno = pthread_create(&r->thread, NULL, run, r))) {
+		warn("pthread_create");
+		return -1;
+	}
+	r->running = 1;
+	return 0;
+}
+
+/* Take the next packet off the ring, into buf of len bytes.
+ * Return its length, 0 for the end, or -1 for error;
+ * -1 with errno set to EAGAIN if none came in RINGWAIT. */
+ssize_t
+ring_read(struct ring *r, void *buf, size_t len)
+{
+	size_t tail;
+	struct slot *s;
+	if (r->ended)
+		return r->end;
+	tail = atomic_load(&r->count[TAIL]);
+	if (atomic_load(&r->count[HEAD]) == tail
+	&& await(r, HEAD, tail) == -1) {
+		errno = EAGAIN;
+		return -1;
+	}
+	s = slot(r, tail);
+	if (s->len <= 0) {
+		r->ended = 1;
+		return r->end = s->len;
+	}
+	if ((size_t) s->len > len)
+		s->len = len;
+	memcpy(buf, s->buf, s->len);
+	len = s->len;
+	move(r, TAIL);
+	return len;
+}
+
+/* Return whether ring_read() would not wait: there is
+ * a packet on the ring, or the end. */
+int
+ring_ready(struct ring *r)
+{
+	return r->ended
+	|| atomic_load(&r->count[HEAD]) != atomic_load(&r->count[TAIL]);
+}
+
+/* Stop the thread, whatever it is doing, and free the ring. */
+void
+ring_close(struct ring *r)
+{
+	if (r == NULL)
+		return;
+	if (r->running) {
+		atomic_store(&r->stop, 1);
+		pthread_mutex_lock(&r->lock);
+		pthread_cond_signal(&r->cond[TAIL]);
+		pthread_mutex_unlock(&r->lock);
+		pthread_cancel(r->thread);
+		pthread_join(r->thread, NULL);
+	}
+	free(r->slots);
+	free(r);
+}
+
+#else
+
+struct ring*
+ring_open(unsigned depth, size_t size, int cpu)
+{
+	warnx("No threads to read the input with");
+	return NULL;
+}
+
+int
+ring_start(struct ring *r, ssize_t (*fill)(int, void*, size_t),
+	int fd, size_t len)
+{
+	return -1;
+}
+
+ssize_t
+ring_read(struct ring *r, void *buf, size_t len)
+{
+	return -1;
+}
+
+int
+ring_ready(struct ring *r)
+{
+	return 0;
+}
+
+void
+ring_close(struct ring *r)
+{
+}
+
+#endif
+
+/* Pin the calling thread to the given cpu.
+ * Return 0 for success, -1 for error. */
+int
+ring_pin(int cpu)
+{
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+		warn("cpu %d", cpu);
+		return -1;
+	}
+	return 0;
+#else
+	warnx("Cannot pin to a cpu here");
+	return -1;
+#endif
+}
+
+/* Run the calling thread, and the threads it starts from now on,
+ * with the real-time priority prio (SCHED_FIFO).
+ * Return 0 for success, -1 for error. */
+int
+ring_rt(int prio)
+{
+#if HAVE_SCHED_SETSCHEDULER
+	struct sched_param sp;
+	sp.sched_priority = prio;
+	if (sched_setscheduler(0, SCHED_FIFO, &sp) == -1) {
+		warn("SCHED_FIFO %d", prio);
+		return -1;
+	}
+	return 0;
+#else
+	warnx("Cannot schedule in real time here");
+	return -1;
+#endif
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Reading the input in a thread of its own, ahead of the output:
+ * the thread keeps filling a ring of packet buffers, which the
+ * output side takes the packets from, so that neither waits for
+ * the other as long as there is a free buffer or a full one.
+ * The ring has one producer and one consumer and takes no locks,
+ * except to sleep when it is empty or full. */
+
+#define RINGDEPTH	256	/* buffers in the ring */
+#define RINGWAIT	100	/* msec to wait for a packet at most */
+
+struct ring;
+
+struct ring	*ring_open	(unsigned, size_t, int);
+int		 ring_start	(struct ring*, ssize_t (*)(int, void*, size_t),
+				 int, size_t);
+ssize_t		 ring_read	(struct ring*, void*, size_t);
+int		 ring_ready	(struct ring*);
+void		 ring_close	(struct ring*);
+int		 ring_pin	(int);
+int		 ring_rt	(int);
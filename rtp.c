@@ -14,6 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE /* copy_file_range(2) with glibc */
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -21,31 +23,74 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <err.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <netdb.h>
+#include <poll.h>
+
+#include "config.h"
 
+#if HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#if HAVE_SO_ATTACH_FILTER
+#include <linux/filter.h>
+#endif
+
+#include "check.h"
+#include "demux.h"
 #include "format-dump.h"
+#include "format-arc.h"
+#include "format-pcap.h"
 #include "format-rtp.h"
+#include "filter.h"
+#include "impair.h"
+#include "merge.h"
+#include "ring.h"
+#include "segment.h"
+#include "server.h"
+#include "shm.h"
+#include "srtp.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "xdp.h"
 
 #define BUFLEN 8192
 /* FIXME: This should be enough for each and every packet we read,
  * but we are still wrong: mind the buflen in the reading routines. */
 
+#define TXTMAGIC "#!rtptxt1.0 "
+#define RCVBUFMAX (64 << 20)	/* bytes of receive buffer at most */
+#define GSOSEGS 64		/* datagrams sent in one go at most */
+#define GSOMAX 65507		/* bytes sent in one go at most */
+#define GROBUF 65536		/* bytes received in one go at most */
+#define RTPRIO 50		/* SCHED_FIFO priority of -O rt */
+
 extern const char* __progname;
 struct ifaddrs *ifaces = NULL;
 struct sockaddr_in *addr;
+static struct sockaddr_in netaddr;
 
 typedef enum {
 	FORMAT_DUMP,
 	FORMAT_NET,
 	FORMAT_RAW,
 	FORMAT_TXT,
+	FORMAT_ARC,
+	FORMAT_PCAP,
+	FORMAT_SHM,
 	FORMAT_NONE
 } format_t;
 
@@ -58,6 +103,9 @@ struct format {
 	{ FORMAT_NET,	"net",	NULL	},
 	{ FORMAT_RAW,	"raw",	"raw"	},
 	{ FORMAT_TXT,	"txt",	"txt"	},
+	{ FORMAT_ARC,	"arc",	"arc"	},
+	{ FORMAT_PCAP,	"pcap",	"pcap"	},
+	{ FORMAT_SHM,	"shm",	"shm"	},
 	{ FORMAT_NONE,	NULL,	NULL	}
 };
 #define NUMFORMATS (sizeof(formats) / sizeof(struct format))
@@ -107,17 +155,293 @@ struct pt {
 #define NUMPAYLOAD ((sizeof(payload)) / (sizeof(struct pt)))
 
 static int remote = 0;
+static int serving = 0;
+static int hellofd = -1;
+static unsigned idle = SERVEIDLE;
+static unsigned subs = SERVESUBS;
 static int dumptime = 0;
 static int verbose = 0;
 static format_t ifmt = FORMAT_NONE;
 static format_t ofmt = FORMAT_NONE;
+static const char *statsfile = NULL;
+static const char *tracefile = NULL;
+static unsigned interval = 10;
+static const char *mcastif = NULL;
+static struct in_addr mcastsrc;
+static int mcastloop = 1;
+static int mcastttl = 1;
+static unsigned uring = 0;
+static unsigned pipeline = 0;
+static int cpuin = -1;
+static int cpuout = -1;
+static struct ring *inring = NULL;
+static int rcvbuf = 0;
+static int rcvgrow = 0;
+static int gso = 1;
+static int busypoll = 0;
+static unsigned spin = 0;
+static int rtprio = 0;
+static int memlock = 0;
+static uint64_t rxstamp = 0;
+static int gro = 0;
+static size_t groseg = 0;
+static struct filter filter;
+static int kfilter = 0;
+static int compress = 0;
+static int nsin = 0;
+static int nsout = 0;
+static uint64_t dumpns = 0;
+static struct arc *arcin = NULL;
+static struct arc *arcout = NULL;
+static struct pcapfile *pcapin = NULL;
+static int merging = 0;
+static int checking = 0;
+static int resync = 0;
+static int snaplen = -1;
+static uint64_t segsize = 0;
+static unsigned segsecs = 0;
+static struct seg *segout = NULL;
+static int demuxing = 0;
+static int demuxpt = 0;
+static unsigned demuxfiles = 0;
+static struct demux *demuxout = NULL;
+static struct srtp *srtpin = NULL;
+static struct srtp *srtpout = NULL;
+static struct impair *impairment = NULL;
+static struct merge *mergein = NULL;
+static const char *xdpif = NULL;
+static unsigned xdpqueue = 0;
+static struct xdp *xdpin = NULL;
+static struct shm *shmin = NULL;
+static struct shm *shmout = NULL;
+static struct trace *tracer = NULL;
+static unsigned impstage = 0;
+static uint32_t batches = 0;
+static volatile sig_atomic_t quit = 0;
 
 static void
 usage(void)
 {
 	fprintf(stderr,
-		"%s [-r] [-v] [-i format] [-o format] [input] [output]\n",
-		__progname);
+		"%s [-dlrtv] [-C size] [-e impairment] [-f filter] [-G seconds]"
+		"\n\t[-i format] [-K keyfile] [-k keyfile] [-o format]"
+		" [-O option[,...]]\n\t[-S statsfile] [-s snaplen]"
+		" [-T tracefile] [input] [output]\n"
+		"%s -m [-rtv] [-f filter] [-o format] [-O option[,...]]"
+		" [-S statsfile]\n\t[-T tracefile] input ... output\n"
+		"%s -c [-v] [-O resync] [input] [output]\n",
+		__progname, __progname, __progname);
+}
+
+static void
+onquit(int sig)
+{
+	quit = 1;
+}
+
+/* Parse the numeric value of the named -O option.
+ * Return the value, or -1 for error. */
+static long long
+optnum(const char *name, const char *val, long long min, long long max)
+{
+	long long n;
+	const char *e;
+	if (val == NULL) {
+		warnx("%s needs a value", name);
+		return -1;
+	}
+	n = strtonum(val, min, max, &e);
+	if (e) {
+		warnx("%s %s: %s", name, val, e);
+		return -1;
+	}
+	return n;
+}
+
+/* Parse the comma-separated list of -O options.
+ * Return 0 for success, -1 for error. */
+static int
+setopts(char *opts)
+{
+	char *val;
+	long long n;
+	char *out;
+	enum { OPT_BUSYPOLL, OPT_BYPT, OPT_COMPRESS, OPT_CPU, OPT_FILES,
+		OPT_GSO, OPT_IDLE, OPT_IFACE, OPT_INTERVAL, OPT_KFILTER, OPT_LOOP,
+		OPT_MLOCK, OPT_NSEC, OPT_PIPELINE, OPT_RCVBUF, OPT_RCVGROW,
+		OPT_RESYNC, OPT_RT, OPT_SOURCE, OPT_SPIN, OPT_SUBS, OPT_TTL,
+		OPT_URING, OPT_XDP };
+	char *const tokens[] = {
+		(char*) "busypoll",
+		(char*) "bypt",
+		(char*) "compress",
+		(char*) "cpu",
+		(char*) "files",
+		(char*) "gso",
+		(char*) "idle",
+		(char*) "iface",
+		(char*) "interval",
+		(char*) "kfilter",
+		(char*) "loop",
+		(char*) "mlock",
+		(char*) "nsec",
+		(char*) "pipeline",
+		(char*) "rcvbuf",
+		(char*) "rcvgrow",
+		(char*) "resync",
+		(char*) "rt",
+		(char*) "source",
+		(char*) "spin",
+		(char*) "subs",
+		(char*) "ttl",
+		(char*) "uring",
+		(char*) "xdp",
+		NULL
+	};
+	while (*opts) switch (getsubopt(&opts, tokens, &val)) {
+		case OPT_BUSYPOLL:
+			if ((n = optnum("busypoll", val, 1, 1000000)) == -1)
+				return -1;
+			busypoll = n;
+			break;
+		case OPT_BYPT:
+			demuxpt = 1;
+			break;
+		case OPT_COMPRESS:
+#if HAVE_ZLIB
+			compress = 1;
+#else
+			warnx("compress needs zlib");
+#endif
+			break;
+		case OPT_CPU:
+			/* in[:out], either can be left out */
+			if (val == NULL) {
+				warnx("cpu needs a value");
+				return -1;
+			}
+			if ((out = strchr(val, ':')))
+				*out++ = '\0';
+			if (*val && (cpuin = optnum("cpu", val, 0, 1023)) == -1)
+				return -1;
+			if (out && *out
+			&& (cpuout = optnum("cpu", out, 0, 1023)) == -1)
+				return -1;
+			break;
+		case OPT_FILES:
+			if ((n = optnum("files", val, 1, 1048576)) == -1)
+				return -1;
+			demuxfiles = n;
+			break;
+		case OPT_GSO:
+			if ((n = optnum("gso", val, 0, 1)) == -1)
+				return -1;
+			gso = n;
+			break;
+		case OPT_IDLE:
+			if ((n = optnum("idle", val, 0, 86400)) == -1)
+				return -1;
+			idle = n;
+			break;
+		case OPT_IFACE:
+			if ((mcastif = val) == NULL) {
+				warnx("iface needs a value");
+				return -1;
+			}
+			break;
+		case OPT_INTERVAL:
+			if ((n = optnum("interval", val, 0, 86400)) == -1)
+				return -1;
+			interval = n;
+			break;
+		case OPT_KFILTER:
+			kfilter = 1;
+			break;
+		case OPT_LOOP:
+			if ((n = optnum("loop", val, 0, 1)) == -1)
+				return -1;
+			mcastloop = n;
+			break;
+		case OPT_MLOCK:
+			memlock = 1;
+			break;
+		case OPT_NSEC:
+			nsout = 1;
+			break;
+		case OPT_PIPELINE:
+			if (val == NULL)
+				pipeline = RINGDEPTH;
+			else if ((n = optnum("pipeline", val, 2, 65536)) == -1)
+				return -1;
+			else
+				pipeline = n;
+			break;
+		case OPT_RCVBUF:
+			if ((n = optnum("rcvbuf", val, 1024, RCVBUFMAX)) == -1)
+				return -1;
+			rcvbuf = n;
+			break;
+		case OPT_RCVGROW:
+			rcvgrow = 1;
+			break;
+		case OPT_RESYNC:
+			resync = 1;
+			break;
+		case OPT_RT:
+			if (val == NULL)
+				rtprio = RTPRIO;
+			else if ((n = optnum("rt", val, 1, 99)) == -1)
+				return -1;
+			else
+				rtprio = n;
+			break;
+		case OPT_SOURCE:
+			if (val == NULL || inet_aton(val, &mcastsrc) == 0) {
+				warnx("source needs an address");
+				return -1;
+			}
+			break;
+		case OPT_SPIN:
+			if ((n = optnum("spin", val, 1, 1000000)) == -1)
+				return -1;
+			spin = n;
+			break;
+		case OPT_SUBS:
+			if ((n = optnum("subs", val, 1, 65536)) == -1)
+				return -1;
+			subs = n;
+			break;
+		case OPT_TTL:
+			if ((n = optnum("ttl", val, 0, 255)) == -1)
+				return -1;
+			mcastttl = n;
+			break;
+		case OPT_URING:
+			if (val == NULL)
+				uring = URINGDEPTH;
+			else if ((n = optnum("uring", val, 1, 256)) == -1)
+				return -1;
+			else
+				uring = n;
+			break;
+		case OPT_XDP:
+			/* interface[:queue] */
+			if ((xdpif = val) == NULL) {
+				warnx("xdp needs an interface");
+				return -1;
+			}
+			if ((out = strchr(val, ':'))) {
+				*out++ = '\0';
+				if ((n = optnum("queue", out, 0, 65535)) == -1)
+					return -1;
+				xdpqueue = n;
+			}
+			break;
+		default:
+			warnx("unknown option: %s", val);
+			return -1;
+	}
+	return 0;
 }
 
 format_t
@@ -140,6 +464,17 @@ fmtbysuff(const char *suff)
 	return FORMAT_NONE;
 }
 
+/* Is the path a ring in shared memory, by the format
+ * we were told to use for it, or by its suffix? */
+int
+isshm(const char *path, format_t fmt)
+{
+	const char *p;
+	if (fmt != FORMAT_NONE)
+		return fmt == FORMAT_SHM;
+	return (p = strrchr(path, '.')) && fmtbysuff(p + 1) == FORMAT_SHM;
+}
+
 int
 islocal(struct sockaddr_in *a)
 {
@@ -147,12 +482,243 @@ islocal(struct sockaddr_in *a)
 	if (remote)
 		return 0;
 	for (i = ifaces; i; i = i->ifa_next)
-         	if (a->sin_addr.s_addr ==
+		if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET
+		&& a->sin_addr.s_addr ==
 		((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr)
 			return 1;
 	return 0;
 }
 
+/* Find the address of the interface given by name or address.
+ * Return 0 for success, -1 for error. */
+static int
+ifaddr(const char *name, struct in_addr *a)
+{
+	struct ifaddrs *i;
+	if (inet_aton(name, a))
+		return 0;
+	for (i = ifaces; i; i = i->ifa_next)
+		if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET
+		&& strcmp(i->ifa_name, name) == 0) {
+			*a = ((struct sockaddr_in*)i->ifa_addr)->sin_addr;
+			return 0;
+		}
+	warnx("%s: no such interface", name);
+	return -1;
+}
+
+/* If the group is an input, bind to it and join it,
+ * from the given source only if there is one.
+ * If it is an output, connect to it and set the TTL,
+ * loopback and interface for the outgoing packets.
+ * Return 0 for success, -1 for error. */
+static int
+mcastopen(int fd, struct addrinfo *group, int flags)
+{
+	u_char ttl = mcastttl, loop = mcastloop;
+	struct in_addr ifa;
+	struct sockaddr_in *sin = (struct sockaddr_in*) group->ai_addr;
+	ifa.s_addr = htonl(INADDR_ANY);
+	if (mcastif && ifaddr(mcastif, &ifa) == -1)
+		return -1;
+	if (flags & O_CREAT) {
+		if (-1 == setsockopt(fd, IPPROTO_IP,
+		IP_MULTICAST_TTL, &ttl, sizeof(ttl))) {
+			warn("IP_MULTICAST_TTL");
+			return -1;
+		}
+		if (-1 == setsockopt(fd, IPPROTO_IP,
+		IP_MULTICAST_LOOP, &loop, sizeof(loop))) {
+			warn("IP_MULTICAST_LOOP");
+			return -1;
+		}
+		if (mcastif && -1 == setsockopt(fd, IPPROTO_IP,
+		IP_MULTICAST_IF, &ifa, sizeof(ifa))) {
+			warn("IP_MULTICAST_IF %s", mcastif);
+			return -1;
+		}
+		if (connect(fd, group->ai_addr, group->ai_addrlen) == -1) {
+			warn("connect to group");
+			return -1;
+		}
+		return 0;
+	}
+	if (bind(fd, group->ai_addr, group->ai_addrlen) == -1) {
+		warn("bind to group");
+		return -1;
+	}
+	if (mcastsrc.s_addr != htonl(INADDR_ANY)) {
+#ifdef IP_ADD_SOURCE_MEMBERSHIP
+		struct ip_mreq_source mreq;
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_multiaddr = sin->sin_addr;
+		mreq.imr_sourceaddr = mcastsrc;
+		mreq.imr_interface = ifa;
+		if (-1 == setsockopt(fd, IPPROTO_IP,
+		IP_ADD_SOURCE_MEMBERSHIP, &mreq, sizeof(mreq))) {
+			warn("IP_ADD_SOURCE_MEMBERSHIP");
+			return -1;
+		}
+#else
+		warnx("source-specific multicast not supported");
+		return -1;
+#endif
+	} else {
+		struct ip_mreq mreq;
+		memset(&mreq, 0, sizeof(mreq));
+		mreq.imr_multiaddr = sin->sin_addr;
+		mreq.imr_interface = ifa;
+		if (-1 == setsockopt(fd, IPPROTO_IP,
+		IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))) {
+			warn("IP_ADD_MEMBERSHIP");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Set the receive buffer of the socket to size bytes, over the limit
+ * set by the system if we are allowed to. Linux reports twice what it
+ * was set to (to account for its overhead), or twice its limit.
+ * Return the size we got, or -1 for error. */
+static int
+setrcvbuf(int fd, int size)
+{
+	int got;
+	socklen_t len = sizeof(got);
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+		warn("RCVBUF");
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &got, &len) == -1) {
+		warn("RCVBUF");
+		return -1;
+	}
+#ifdef SO_RCVBUFFORCE
+	if (got / 2 < size) {
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		&size, sizeof(size)) == 0)
+			getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &got, &len);
+		else if (verbose)
+			warnx("Receive buffer is only %d bytes", got / 2);
+	}
+	got /= 2;
+#endif
+	return got;
+}
+
+/* Have the kernel drop what the filter would, before we ever see it;
+ * what comes through still goes through choose(), for the time.
+ * Return 1 if the filter is on the socket, 0 if not. */
+static int
+setfilter(int fd)
+{
+#if HAVE_SO_ATTACH_FILTER
+	struct sock_filter insn[FILTER_BPFMAX];
+	struct sock_fprog prog;
+	if ((prog.len = filter_bpf(&filter, insn)) == 0)
+		return 0;
+	prog.filter = insn;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+	&prog, sizeof(prog)) == -1) {
+		warn("ATTACH_FILTER");
+		return 0;
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Account for the packets the kernel has dropped on the socket,
+ * of which it tells us the running total. With rcvgrow, double
+ * the receive buffer each time it happens, up to RCVBUFMAX. */
+static void
+kerneldrops(int fd, uint32_t total)
+{
+	static uint32_t last = 0;
+	static int size = 0;
+	socklen_t len = sizeof(size);
+	if (total == last || kfilter)
+		return;
+	stats.rxkdrop += (uint32_t) (total - last);
+	last = total;
+	if (!rcvgrow)
+		return;
+	if (size == 0 && getsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+	&size, &len) == 0)
+		size /= 2;
+	if (size > 0 && size < RCVBUFMAX) {
+		size = setrcvbuf(fd, size * 2 < RCVBUFMAX ? size * 2 : RCVBUFMAX);
+		warnx("Kernel dropped %u packets, receive buffer now %d bytes",
+			total, size);
+	}
+}
+
+/* Receive a datagram, like recv(2). Where the kernel can tell us
+ * about the datagrams it had to drop, look at what it says;
+ * with UDP_GRO, it also says how long each of the datagrams
+ * it has put together is, which we keep in groseg (0 if none),
+ * and when the datagram came, which we keep in rxstamp
+ * (nsec of the CLOCK_REALTIME, 0 if it does not say).
+ * Return the datagram size, or -1 for error. */
+static ssize_t
+rxrecv(int fd, void *buf, size_t len, int flags)
+{
+#ifdef SO_RXQ_OVFL
+	ssize_t r;
+	uint32_t total;
+#ifdef UDP_GRO
+	int seg;
+#endif
+#ifdef SO_TIMESTAMPNS
+	struct timespec ts;
+#endif
+	struct msghdr msg;
+	struct cmsghdr *c;
+	struct iovec iov;
+	union {
+		struct cmsghdr	hdr;
+		unsigned char	buf[CMSG_SPACE(sizeof(uint32_t))
+				  + CMSG_SPACE(sizeof(int))
+				  + CMSG_SPACE(sizeof(struct timespec))];
+	} ctl;
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if ((r = recvmsg(fd, &msg, flags)) == -1)
+		return -1;
+	groseg = 0;
+	rxstamp = 0;
+	for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level == SOL_SOCKET
+		&&  c->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&total, CMSG_DATA(c), sizeof(total));
+			kerneldrops(fd, total);
+		}
+#ifdef UDP_GRO
+		if (c->cmsg_level == IPPROTO_UDP
+		&&  c->cmsg_type == UDP_GRO) {
+			memcpy(&seg, CMSG_DATA(c), sizeof(seg));
+			groseg = seg > 0 ? seg : 0;
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		if (c->cmsg_level == SOL_SOCKET
+		&&  c->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+			rxstamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		}
+#endif
+	}
+	return r;
+#else
+	return recv(fd, buf, len, flags);
+#endif
+}
+
 /* Open a path for reading or writing (the flags say which).
  * Set the input/output format, set addr/port if applicable.
  * Return a file descriptor, or -1 for failure. */
@@ -200,6 +766,24 @@ rtpopen(const char *path, int flags)
 			warn("getaddrinfo %s", path);
 			goto bad;
 		}
+		if (xdpif && !(flags & O_CREAT)) {
+			/* Take what comes to the address off the interface,
+			 * whoever it is for; there is no socket to bind. */
+			if ((xdpin = xdp_open(xdpif, xdpqueue,
+			(struct sockaddr_in*) res->ai_addr, verbose)) == NULL)
+				goto bad;
+			memcpy(&netaddr, res->ai_addr, sizeof(netaddr));
+			freeaddrinfo(res);
+			addr = &netaddr;
+			addr->sin_port = port;
+			if (ifmt == FORMAT_NONE) {
+				ifmt = FORMAT_NET;
+			} else if (ifmt != FORMAT_NET) {
+				warnx("Only net input allowed for %s", path);
+				return -1;
+			}
+			return xdp_fd(xdpin);
+		}
 		if (-1 == (fd =
 		socket(res->ai_family, res->ai_socktype, res->ai_protocol))) {
 			warn("socket");
@@ -208,10 +792,56 @@ rtpopen(const char *path, int flags)
 		if (-1 == setsockopt(fd,
 		SOL_SOCKET, SO_REUSEADDR, &fd, sizeof(fd)))
 			warn("REUSEADDR");
-		/* TODO: SO_SNDTIMEO SO_RCVTIMEO SO_TIMESTAMP */
-		addr = (struct sockaddr_in*) res->ai_addr;
+		if (!(flags & O_CREAT)) {
+			/* With a timeout, a blocking recv() gets interrupted
+			 * by signals even with SA_RESTART; see netget(). */
+			struct timeval tv = { 1, 0 };
+			if (-1 == setsockopt(fd,
+			SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+				warn("RCVTIMEO");
+			if (rcvbuf)
+				setrcvbuf(fd, rcvbuf);
+#ifdef SO_RXQ_OVFL
+			/* Have the kernel tell us how many it dropped. */
+			if (-1 == setsockopt(fd,
+			SOL_SOCKET, SO_RXQ_OVFL, &fd, sizeof(fd)))
+				warn("RXQ_OVFL");
+#endif
+#ifdef SO_TIMESTAMPNS
+			/* And when each came, see netsrc_read(). */
+			if (-1 == setsockopt(fd,
+			SOL_SOCKET, SO_TIMESTAMPNS, &fd, sizeof(fd)))
+				warn("TIMESTAMPNS");
+#endif
+#ifdef SO_BUSY_POLL
+			/* Have a blocking recv() poll the device queue. */
+			if (busypoll && -1 == setsockopt(fd,
+			SOL_SOCKET, SO_BUSY_POLL, &busypoll, sizeof(busypoll)))
+				warn("BUSY_POLL");
+#else
+			if (busypoll)
+				warnx("Cannot busy poll here");
+#endif
+			/* The kernel counts what the filter drops as dropped,
+			 * which would have rcvgrow grow the buffer for nothing. */
+			if (kfilter && rcvgrow) {
+				warnx("Not filtering in the kernel with rcvgrow");
+				kfilter = 0;
+			} else if (kfilter)
+				kfilter = setfilter(fd);
+		}
+		/* TODO: SO_SNDTIMEO */
+		/* Keep the address for the dump header, which has the port
+		 * in host order; the socket itself uses res->ai_addr. */
+		memcpy(&netaddr, res->ai_addr, sizeof(netaddr));
+		addr = &netaddr;
 		addr->sin_port = port;
-		if (islocal(addr)) {
+		if (IN_MULTICAST(ntohl(addr->sin_addr.s_addr))) {
+			/* Neither bind to a local address and wait,
+			 * nor say hello: the group is the rendezvous. */
+			if (mcastopen(fd, res, flags) == -1)
+				goto bad;
+		} else if (islocal(addr)) {
 			/* If the local socket is an input, we will read on it;
 			 * if it's an output, we want to receive a message first
 			 * to know who to write to. So bind(2) in any case. */
@@ -219,15 +849,24 @@ rtpopen(const char *path, int flags)
 				warn("bind");
 				goto bad;
 			}
-			if (flags & O_CREAT) {
+			if ((flags & O_CREAT) && serving) {
+				/* Serve whoever subscribes, but only
+				 * start streaming once someone does. */
+				if (serve_init(fd, idle, subs, verbose) == -1)
+					goto bad;
+				while (serve_wait(fd) == -1)
+					if (quit || errno != EINTR)
+						goto bad;
+			} else if (flags & O_CREAT) {
 				/* If this local address is an output,
 				 * wait till we recvfrom() something first,
 				 * to let us know where to send() later. */
 				char b[2];
-				socklen_t len;
+				socklen_t len = sizeof(struct sockaddr);
 				struct sockaddr r;
 				while (recvfrom(fd, b, 1, 0, &r, &len) != 1)
-					;
+					if (quit)
+						goto bad;
 				if (connect(fd, &r, len) == -1) {
 					/* Debian: EAFNOSUPPORT for localhost */
 					warn("connect to output");
@@ -248,6 +887,7 @@ rtpopen(const char *path, int flags)
 					warn("send");
 					goto bad;
 				}
+				hellofd = fd;
 			}
 		}
 		freeaddrinfo(res);
@@ -294,58 +934,100 @@ bad:
  * Return the difference in usec, or 0 for error.
  * This is used to time outgoing packets,
  * so the 0 means "send immediately". */
-uint32_t
+uint64_t
 tvdiff(struct timeval *old, struct timeval *new)
 {
-	uint32_t usec;
+	uint64_t usec;
 	if (old == NULL || new == NULL)
 		return 0;
 	if ((old->tv_sec > new->tv_sec)
 	|| ((old->tv_sec == new->tv_sec) && (old->tv_usec > new->tv_usec)))
 		return 0;
-	usec = (new->tv_sec - old->tv_sec) * 1000000;
+	usec = (uint64_t) (new->tv_sec - old->tv_sec) * 1000000;
 	usec += new->tv_usec - old->tv_usec;
 	return usec;
 }
 
-/* Compute the offset since the given timeval.
- * Return the difference in msec, or 0 for error. */
-uint32_t
-offset(struct timeval *since)
+/* Account for a packet going out 'nsec' after its time. */
+static void
+sentlate(uint64_t nsec)
 {
-	struct timeval now;
-	if (gettimeofday(&now, NULL) == -1) {
-		warn("gettimeofday");
-		return 0;
+	hist_add(&stats.late, nsec);
+	if (nsec > STATSLATE)
+		stats.txlate++;
+}
+
+/* Sleep for the given time. Keep sleeping through signals
+ * (which is how the stats get printed), unless told to quit.
+ * Return 0 for success, -1 for error. */
+static int
+napfor(struct timespec *nap)
+{
+	while (nanosleep(nap, nap) != 0) {
+		if (errno != EINTR) {
+			warn("nanosleep");
+			return -1;
+		}
+		if (quit)
+			return -1;
+		STATS_CHECK();
+	}
+	return 0;
+}
+
+static void	release(void);
+
+/* Sleep for the given time, as napfor() does, but let go
+ * of what the impairment holds back as it comes due meanwhile.
+ * Return 0 for success, -1 for error. */
+static int
+pacenap(struct timespec *nap)
+{
+	uint64_t now = stats_now(), due, wake;
+	wake = now + nap->tv_sec * 1000000000ULL + nap->tv_nsec;
+	while (impairment && (due = impair_due(impairment)) && due < wake) {
+		if (due > now) {
+			nap->tv_sec = (due - now) / 1000000000;
+			nap->tv_nsec = (due - now) % 1000000000;
+			if (napfor(nap) == -1)
+				return -1;
+		}
+		release();
+		now = stats_now();
 	}
-	return tvdiff(since, &now) / 1000;
+	if (wake <= now)
+		return 0;
+	nap->tv_sec = (wake - now) / 1000000000;
+	nap->tv_nsec = (wake - now) % 1000000000;
+	return napfor(nap);
 }
 
 /* The 'zero' describes the start of the dump,
- * the 'when' says (in msec since zero) when the next packet goes out.
+ * the 'when' says (in nsec since zero) when the next packet goes out.
  * Sleep for the appropriate time; then return 0, or -1 if interrupted. */
 int
-dumpsleep(struct timeval *zero, uint32_t when)
+dumpsleep(struct timeval *zero, uint64_t when)
 {
 	struct timeval now;
 	struct timespec nap;
-	uint32_t diff, usec = when * 1000;
+	uint64_t wake, diff;
 	/* some time has already elapsed */
 	if (gettimeofday(&now, NULL) == -1) {
 		warnx("gettimeofday");
 		return -1;
 	}
-	if ((diff = tvdiff(zero, &now)) > usec) {
+	if ((diff = tvdiff(zero, &now) * 1000) > when) {
 		/* we are late already */
+		sentlate(diff - when);
 		return 0;
 	}
-	usec -= diff;
-	nap.tv_sec = usec / 1000000;
-	nap.tv_nsec = (usec % 1000000) * 1000;
-	if (nanosleep(&nap, NULL) != 0) {
-		warn("nanosleep");
+	when -= diff;
+	nap.tv_sec = when / 1000000000;
+	nap.tv_nsec = when % 1000000000;
+	wake = stats_now() + when;
+	if (pacenap(&nap) == -1)
 		return -1;
-	}
+	sentlate(stats_now() - wake);
 	return 0;
 }
 
@@ -362,6 +1044,7 @@ rtpsleep(uint32_t *last, uint32_t next, uint8_t pt)
 {
 	double step;
 	uint32_t diff;
+	uint64_t wake;
 	struct timespec nap;
 	if (*last == 0) {
 		/* first packet */
@@ -385,321 +1068,1701 @@ rtpsleep(uint32_t *last, uint32_t next, uint8_t pt)
 	step = (1.0 * diff) / payload[pt].rate;
 	nap.tv_sec = step;
 	nap.tv_nsec = (step - nap.tv_sec) * 1000000000;
-	if (nanosleep(&nap, NULL) != 0) {
-		warn("nanosleep");
+	wake = stats_now() + nap.tv_sec * 1000000000ULL + nap.tv_nsec;
+	if (pacenap(&nap) == -1)
 		return -1;
-	}
+	sentlate(stats_now() - wake);
 	return 0;
 }
 
-/* Read a dump file from input, send the RTP output via net.
- * Return 0 for success, -1 for error. */
-int
-dump2net(int ifd, int ofd)
+/* Wait for a packet to come, but not past the given nsec.
+ * Return 1 if one came, 0 if the time came first, -1 for error. */
+static int
+netwait(int fd, uint64_t due)
 {
-	ssize_t r, w;
-	int error = 0;
-	struct sockaddr_in addr;
-	struct dumphdr hdr;
-	struct dpkthdr *pkt;
-	struct rtphdr  *rtp;
-	struct timeval zero;
-	uint32_t last = 0;
-	unsigned char buf[BUFLEN];
-	if (read_dumpline(ifd, &addr) == -1) {
-		warnx("Error reading dump line");
-		return -1;
+	struct pollfd pfd;
+	uint64_t now = stats_now();
+	if (due <= now)
+		return 0;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, (due - now + 999999) / 1000000);
+}
+
+/* Receive what is already there, from the socket or the AF_XDP ring.
+ * Return the packet size, or -1 for error (EAGAIN if there is none). */
+static ssize_t
+rxnow(int fd, void *buf, size_t len)
+{
+	return xdpin ? xdp_recv(xdpin, buf, len, 0)
+	: rxrecv(fd, buf, len, MSG_DONTWAIT);
+}
+
+/* Keep receiving what is already there for up to spin usec,
+ * not to pay for going to sleep and waking up again.
+ * Return the packet size, or -1 for error (EAGAIN if none came). */
+static ssize_t
+spinget(int fd, void *buf, size_t len)
+{
+	uint64_t end = stats_now() + spin * 1000ULL;
+	ssize_t r;
+	do {
+		if ((r = rxnow(fd, buf, len)) >= 0 || (errno != EAGAIN
+		&& errno != EWOULDBLOCK && errno != EINTR))
+			return r;
+	} while (!quit && stats_now() < end);
+	return -1;
+}
+
+/* Receive a packet like recv(2), but keep receiving through
+ * the socket timeouts and signals (which is how the stats
+ * get printed), unless told to quit. After a blocking recv(),
+ * take what is already queued without blocking, to account
+ * for how many packets we get per wakeup; unless told to wait,
+ * return what is queued, or -1 with errno set to EAGAIN if none is.
+ * If we said hello
+ * to a remote input, keep saying it, so that it keeps us
+ * among its subscribers. With io_uring, the batches are
+ * accounted for by uring_recv() instead. With packets held back
+ * by the impairment, do not wait past the next one being due.
+ * With AF_XDP, take the packets off its ring instead.
+ * With a spin budget, spin before going to sleep.
+ * Return the packet size, 0 for the end, -1 for error. */
+static ssize_t
+netget(int fd, void *buf, size_t len, int wait)
+{
+	static uint64_t batch = 0;
+	static time_t hello = 0;
+	uint64_t due;
+	time_t now;
+	ssize_t r;
+	int w;
+	if (fd == hellofd && (now = time(NULL)) - hello >= KEEPALIVE) {
+		if (hello && send(fd, "1", 1, 0) == -1)
+			warn("keepalive");
+		hello = now;
 	}
-	if (read_dumphdr(ifd, &hdr, DUMPHDRSIZE) == -1) {
-		warnx("Error reading %zd bytes of dump header", DUMPHDRSIZE);
-		return -1;
+	if (batch) {
+		if ((r = rxnow(fd, buf, len)) > 0) {
+			batch++;
+			return r;
+		}
+		hist_add(&stats.batch, batch);
+		batch = 0;
+		if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+		&& errno != EINTR))
+			return r;
 	}
-	if (check_dumphdr(&hdr, &addr) == -1)
-		warnx("Dump file header is inconsistent");
-	if (verbose)
-		print_dumphdr(&hdr);
-	if (dumptime && gettimeofday(&zero, NULL) == -1) {
-		warnx("gettimeofday");
+	if (!wait) {
+		errno = EAGAIN;
 		return -1;
 	}
-	while ((r = read_dump(ifd, buf, BUFLEN)) > 0) {
-		pkt = (struct dpkthdr*) buf;
-		rtp = (struct rtphdr*) (buf + DPKTHDRSIZE);
-		if (pkt->plen == 0) { /* FIXME: that's RTCP. Currently, we don't
-			send these, because receiving zero size confuses the
-			reader, who considers that an end. But a RTCP packet
-			does not actualy have zero size. We need to properly
-			read the RTCP header, which we don't, yet. */
-			continue;
-		}
-		if ((dumptime
-		? dumpsleep(&zero, pkt->msec)
-		: rtpsleep(&last, ntohl(rtp->ts), rtp->pt)) == -1) {
-		/* FIXME: notice how we use pkt->msec, because that's
-		 * already converted to the local byte order by
-		 * read_dump() -> read_dpkthdr(); but we convert the rtp->ts,
-		 * because we have not properly parsed the RTP packet;
-		 * which we have to, e.g. to change the timestamp. */
-			warnx("packet timing failed");
-			error = -1;
-			continue;
-		}
-		if (verbose)
-			print_dpkthdr(pkt);
-		if (parse_rtphdr(rtp) == -1) {
-			warnx("Error parsing RTP header");
-			error = -1;
-			continue;
-		}
-		if (verbose)
-			print_rtphdr(rtp);
-		if ((w = send(ofd, rtp, pkt->plen, 0)) == -1) {
-			warnx("Error sending %u bytes of RTP", pkt->plen);
-			error = -1;
-			continue;
-		} else if (w < pkt->plen) {
-			warnx("Only sent %zd < %u bytes of RTP", w, pkt->plen);
-			error = -1;
-			continue;
-		}
+	if (spin && !uring && (r = spinget(fd, buf, len)) >= 0) {
+		if (r > 0)
+			batch = 1;
+		return r;
+	}
+	for (;;) {
+		/* The input thread leaves the stats to the output. */
+		if (inring == NULL)
+			STATS_CHECK();
+		if (quit)
+			return 0;
+		if (uring && xdpin == NULL) {
+			if ((r = uring_recv(fd, buf, len)) >= 0)
+				return r;
+		} else if ((due = impair_due(impairment))
+		&& (w = netwait(fd, due)) <= 0) {
+			if (w == 0) {
+				errno = EAGAIN;
+				return -1;
+			}
+		} else if ((r = xdpin ? xdp_recv(xdpin, buf, len, 1)
+		: rxrecv(fd, buf, len, 0)) >= 0)
+			break;
+		if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+			return -1;
 	}
-	return r == -1 ? -1 : error;
+	if (r > 0)
+		batch = 1;
+	return r;
 }
 
-/* Read a dump file from input, write raw audio payload to output.
- * Return 0 for success, -1 for error. */
-int
-dump2raw(int ifd, int ofd)
+/* What the input thread reads the net with.
+ * Return the packet size, 0 for the end, -1 for error. */
+static ssize_t
+netfill(int fd, void *buf, size_t len)
 {
-	struct sockaddr_in addr;
-	struct dumphdr hdr;
-	struct dpkthdr *pkt;
-	struct rtphdr *rtp;
-	unsigned char buf[BUFLEN];
-	unsigned char *p = buf;
-	ssize_t r, w, hlen;
-	int error = 0;
-	if (read_dumpline(ifd, &addr) == -1) {
-		warnx("Error reading dump line");
+	return netget(fd, buf, len, 1);
+}
+
+/* Take the next packet read by the input thread,
+ * starting the thread with fill to read the input.
+ * Return the packet size, 0 for the end, -1 for error. */
+static ssize_t
+ringread(ssize_t (*fill)(int, void*, size_t), int fd, void *buf, size_t len)
+{
+	static int started = 0;
+	ssize_t r;
+	if (!started++ && ring_start(inring, fill, fd, len) == -1)
 		return -1;
+	while ((r = ring_read(inring, buf, len)) == -1 && errno == EAGAIN) {
+		STATS_CHECK();
+		if (quit)
+			return 0;
 	}
-	if (read_dumphdr(ifd, &hdr, DUMPHDRSIZE) == -1) {
-		warnx("Error reading dump header");
+	return r;
+}
+
+/* Receive a packet from the net, or from the input thread;
+ * unless told to wait, only one that is already there.
+ * Return the packet size, 0 for the end, -1 for error. */
+static ssize_t
+netrecv(int fd, void *buf, size_t len, int wait)
+{
+	if (inring == NULL)
+		return netget(fd, buf, len, wait);
+	if (!wait && !ring_ready(inring)) {
+		errno = EAGAIN;
 		return -1;
 	}
-	if (check_dumphdr(&hdr, &addr) == -1)
-		warnx("Dump file header is inconsistent");
-	if (verbose)
-		print_dumphdr(&hdr);
-	while ((r = read_dump(ifd, buf, BUFLEN)) > 0) {
-		pkt = (struct dpkthdr*) (p = buf);
-		rtp = (struct rtphdr*) (buf + DPKTHDRSIZE);
-		if (pkt->plen == 0) /* not RTP */
-			continue;
-		if (verbose)
-			print_dpkthdr(pkt);
-		if ((hlen = parse_rtphdr(rtp)) == -1) {
-			warnx("Error parsing RTP header");
-			error = -1;
-			continue;
-		}
-		if (verbose)
-			print_rtphdr(rtp);
-		if (pkt->dlen - DPKTHDRSIZE < pkt->plen) {
-			warnx("%lu bytes of RTP payload missing",
-				pkt->plen - pkt->dlen + DPKTHDRSIZE);
-		}
-		p += DPKTHDRSIZE + hlen;
-		r -= DPKTHDRSIZE + hlen;
-		if ((w = write(ofd, p, r)) == -1) {
-			warnx("Error writing %zd bytes of payload", r);
-			error = -1;
-			continue;
-		} else if (w < r) {
-			warnx("Only wrote %zd < %zd bytes of payload", w, r);
-			error = -1;
-			continue;
-		}
-	}
-	return r == -1 ? -1 : error;
+	return ringread(netfill, fd, buf, len);
 }
 
-int
-dump2txt(int ifd, int ofd)
+/* Have the kernel put together the datagrams of the same size
+ * that come in a row from the same sender, see groget().
+ * Return 1 if it does, 0 if not. */
+static int
+groinit(int fd)
 {
+#ifdef UDP_GRO
+	int on = 1;
+	return setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+#else
 	return 0;
+#endif
 }
 
-/* Read RTP packets from the net, write a dump file.
- * Return 0 for success, -1 for error. */
-int
-net2dump(int ifd, int ofd)
+/* Receive a packet like netget(), with the datagrams put together
+ * by UDP_GRO taken apart again: each but the last is groseg long.
+ * Those that came at once are returned one by one, without waiting.
+ * Return the packet size, 0 for the end, -1 for error. */
+static ssize_t
+groget(int fd, void *buf, size_t len, int wait)
 {
-	ssize_t r, w;
-	int error = 0;
-	struct rtphdr *rtp;
-	unsigned char buf[BUFLEN];
-	struct timeval start;
-	if (gettimeofday(&start, NULL) == -1) {
-		warn("gettimeofday");
-		return -1;
+	static unsigned char big[GROBUF];
+	static size_t off = 0, end = 0, seg = 0;
+	ssize_t r;
+	size_t n;
+	if (off == end) {
+		if ((r = netget(fd, big, sizeof(big), wait)) <= 0)
+			return r;
+		off = 0;
+		end = r;
+		seg = groseg ? groseg : end;
 	}
-	if (write_dumpline(ofd, addr) == -1) {
-		warnx("Error writing dump line");
+	n = end - off < seg ? end - off : seg;
+	memcpy(buf, big + off, n < len ? n : len);
+	off += n;
+	return n < len ? n : len;
+}
+
+/* Write to a file, either directly or through io_uring.
+ * Return bytes written, or -1 for error. */
+static ssize_t
+fileout(int fd, const void *buf, size_t len)
+{
+	return uring ? uring_write(fd, buf, len) : write(fd, buf, len);
+}
+
+/* Read the start of a dump file, of an archive, or of a pcap
+ * capture. Going to text, only the headers of an archive are read.
+ * Return 0 for success, -1 for error. */
+static int
+dumpopen(int fd, struct sockaddr_in *addr, struct dumphdr *hdr)
+{
+	if (mergein) {
+		merge_hdr(mergein, addr, hdr);
+		return 0;
+	}
+	if (ifmt == FORMAT_ARC)
+		return (arcin = arc_open(fd, addr, hdr,
+			ofmt == FORMAT_TXT)) ? 0 : -1;
+	if (ifmt == FORMAT_PCAP)
+		return (pcapin = pcap_open(fd, addr, hdr)) ? 0 : -1;
+	if ((nsin = read_dumpline(fd, addr)) == -1) {
+		warnx("Error reading dump line");
 		return -1;
 	}
-	if (write_dumphdr(ofd, addr, &start) == -1) {
+	if (read_dumphdr(fd, hdr, DUMPHDRSIZE) == -1) {
+		warnx("Error reading %zd bytes of dump header", DUMPHDRSIZE);
+		return -1;
+	}
+	return 0;
+}
+
+/* Read a record from a dump file, from an archive, from a pcap
+ * capture, or from the dump files being merged.
+ * Return bytes read, 0 for the end, or -1 for error. */
+static ssize_t
+dumpin(int fd, void *buf, size_t len)
+{
+	if (mergein)
+		return merge_read(mergein, buf, len);
+	if (arcin)
+		return arc_read(arcin, buf, len);
+	if (pcapin)
+		return pcap_read(pcapin, buf, len);
+	return uring ? uring_read_dump(fd, buf, len) : read_dump(fd, buf, len);
+}
+
+/* Read a record of a dump, possibly through the input thread.
+ * With the nsec timeline, take the nsec out into dumpns.
+ * Return bytes read, 0 for the end, or -1 for error. */
+static ssize_t
+dumpread(int fd, void *buf, size_t len)
+{
+	ssize_t r;
+	r = inring ? ringread(dumpin, fd, buf, len) : dumpin(fd, buf, len);
+	if (r > 0 && nsin)
+		r = strip_dpktns(buf, r, &dumpns);
+	return r;
+}
+
+/* Write the start of a dump file, or of an archive.
+ * Return 0 for success, -1 for error. */
+static int
+dumpstart(int fd, struct sockaddr_in *addr, struct timeval *start)
+{
+	if (ofmt == FORMAT_ARC)
+		return (arcout = arc_create(fd, addr, start, compress)) ? 0 : -1;
+	if (segout)
+		return seg_start(segout, addr, start);
+	if ((nsout ? write_dumpnsline(fd, addr) : write_dumpline(fd, addr))
+	== -1) {
+		warnx("Error writing dump line");
+		return -1;
+	}
+	if (write_dumphdr(fd, addr, start) == -1) {
 		warnx("Error writing dump header");
 		return -1;
 	}
-	while ((r = recv(ifd, buf, BUFLEN, 0)) > 0) {
-		if (verbose)
-			fprintf(stderr, "%zd bytes of RTP received\n", r);
-		rtp = (struct rtphdr*) buf;
-		if (parse_rtphdr(rtp) == -1) {
-			warnx("Error parsing RTP header");
-			error = -1;
+	return 0;
+}
+
+/* Write a record, with the dpkthdr in local byte order
+ * (which gets changed), to a dump file or an archive;
+ * with the nsec timeline, with its ns put in.
+ * Return bytes of the record written, or -1 for error. */
+static ssize_t
+dumpwrite(int fd, void *buf, size_t len, uint64_t ns)
+{
+	static unsigned char ext[DPKTNSSIZE + BUFLEN];
+	ssize_t w;
+	if (arcout)
+		return arc_write(arcout, buf, len);
+	if (nsout) {
+		len = add_dpktns(ext, buf, len, ns);
+		buf = ext;
+	}
+	if (segout)
+		w = seg_write(segout, buf, len);
+	else {
+		pack_dpkthdr((struct dpkthdr*) buf);
+		w = fileout(fd, buf, len);
+	}
+	return nsout && w == (ssize_t) len ? w - (ssize_t) DPKTNSSIZE : w;
+}
+
+/* Send a packet to the net: either to the one peer
+ * we are connected to, or to all our subscribers.
+ * Return bytes sent, or -1 for error. */
+static ssize_t
+netsend(int fd, const void *buf, size_t len)
+{
+	if (serving)
+		return serve_send(fd, buf, len);
+	return send(fd, buf, len, 0);
+}
+
+/* Copy len bytes from offset off of the input to the output:
+ * within the kernel if we can, with copy_file_range(2) between
+ * files or sendfile(2) to anything else; or else write(2) them
+ * from where the input is mapped.
+ * Return 0 for success, -1 for error. */
+static int
+copyrun(int ifd, int ofd, const unsigned char *map, off_t off, size_t len)
+{
+	static enum { BY_RANGE, BY_SENDFILE, BY_WRITE } how = BY_RANGE;
+	ssize_t w;
+	while (len) {
+		w = -1;
+		errno = ENOSYS;
+#if HAVE_COPY_FILE_RANGE
+		if (how == BY_RANGE)
+			w = copy_file_range(ifd, &off, ofd, NULL, len, 0);
+#endif
+#if HAVE_SENDFILE
+		if (how == BY_SENDFILE)
+			w = sendfile(ofd, ifd, &off, len);
+#endif
+		if (how == BY_WRITE && (w = write(ofd, map + off, len)) > 0)
+			off += w;
+		if (w > 0) {
+			len -= w;
 			continue;
 		}
-		if (verbose)
-			print_rtphdr(rtp);
-		if ((w = write_dpkthdr(ofd, r, offset(&start))) == -1) {
-			warnx("Error writing dump packet header");
-			error = -1;
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (how != BY_WRITE && (w == 0 || errno == ENOSYS
+		|| errno == EXDEV || errno == EINVAL || errno == EBADF
+		|| errno == EOPNOTSUPP)) {
+			how++;
 			continue;
 		}
-		/* TODO: -s size of RTP to save */
-		if ((w = write(ofd, buf, r)) != r) {
-			warnx("Error writing %zd bytes of RTP", r);
+		warn("Error copying %zu bytes of dump", len);
+		return -1;
+	}
+	return 0;
+}
+
+/* Copy the records of a dump file matching the filter (all of them
+ * without one) into a dump file, past the headers of both.
+ * The input is mapped, so that we only look at the record headers;
+ * the runs of matching records are copied in one go, see copyrun().
+ * The records are copied as they are, so their times stay relative
+ * to the start of the input dump, which the new dump header keeps.
+ * As the records come in time order, we stop at the first one
+ * past the time range. This is only for two plain dump files;
+ * anything else goes packet by packet, see run().
+ * Return 0 for success, -1 for error, 1 if we cannot. */
+static int
+dumpmap(int ifd, int ofd)
+{
+	struct dpkthdr pkt;
+	struct rtphdr rtp;
+	struct stat st;
+	unsigned char *map;
+	off_t off, run = -1;
+	size_t n;
+	int error = 0;
+	if (ifmt != FORMAT_DUMP || ofmt != FORMAT_DUMP || mergein || segout
+	|| nsin || nsout || snaplen != -1 || srtpin || srtpout || impairment
+	|| fstat(ifd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0
+	|| (off = lseek(ifd, 0, SEEK_CUR)) == -1
+	|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ifd, 0))
+	== MAP_FAILED)
+		return 1;
+	posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+	while (!quit && off + (off_t) DPKTHDRSIZE <= st.st_size) {
+		STATS_CHECK();
+		memcpy(&pkt, map + off, DPKTHDRSIZE);
+		parse_dpkthdr(&pkt);
+		if (pkt.dlen < DPKTHDRSIZE || off + pkt.dlen > st.st_size) {
+			warnx("Bad dump record at offset %lld", (long long) off);
 			error = -1;
-			continue;
+			break;
+		}
+		stats.rxpkts++;
+		stats.rxbytes += pkt.dlen;
+		if ((filter.what & FILTER_TIME) && pkt.msec > filter.tmax)
+			break;
+		n = pkt.dlen - DPKTHDRSIZE;
+		memcpy(&rtp, map + off + DPKTHDRSIZE,
+			n < sizeof(rtp) ? n : sizeof(rtp));
+		if (filter_match(&filter, &pkt, &rtp)) {
+			if (run == -1)
+				run = off;
+			stats.txpkts++;
+			stats.txbytes += pkt.dlen;
+		} else {
+			stats.rxfilt++;
+			if (run != -1 && copyrun(ifd, ofd, map, run, off - run)) {
+				error = -1;
+				break;
+			}
+			run = -1;
 		}
+		off += pkt.dlen;
+	}
+	if (error == 0 && off < st.st_size
+	&& off + (off_t) DPKTHDRSIZE > st.st_size) {
+		warnx("Truncated dump record at offset %lld", (long long) off);
+		error = -1;
 	}
-	return r == -1 ? -1 : error;
+	if (run != -1 && copyrun(ifd, ofd, map, run, off - run))
+		error = -1;
+	munmap(map, st.st_size);
+	return error;
 }
 
-/* Read RTP packets from the net, write RTP packets to the net.
- * No timing is considered here: write them as you read them.
+/* The packets go from a source, through the stages that apply,
+ * to a sink, in batches of up to BATCH packets. Whatever the
+ * formats, each packet is kept as a dump record: the dpkthdr
+ * in local byte order, followed by what we have of the packet.
+ * A net source makes up the dpkthdr as the packets come in,
+ * and a net sink sends what follows it. The stages pass the
+ * descriptors of the packets along, not the packets; a stage
+ * drops a packet by leaving it out of the batch. The RTP headers
+ * of the batch are decoded as soon as it is read, into arrays
+ * of the fields, which the stages and sinks then look at. */
+
+#define BATCH 32
+
+struct pkt {
+	unsigned char	*buf;	/* the record, one of the pool */
+	struct dpkthdr	*hdr;	/* at the start of buf */
+	struct rtphdr	*rtp;	/* right after hdr */
+	ssize_t		 len;	/* of the record */
+	unsigned	 idx;	/* in the batch as read */
+	uint64_t	 t;	/* when it came from the net, or 0 */
+	uint64_t	 ns;	/* since the start of the stream */
+};
+
+struct batch {
+	unsigned	n;
+	struct pkt	pkt[BATCH];
+	unsigned	nd;	/* of dec in use */
+	uint32_t	msec[BATCH];
+	uint16_t	plen[BATCH];
+	struct rtphdrs	dec[BATCH / RTPBATCH];
+};
+
+/* The decoded RTP header of a packet of the batch. */
+#define DEC(b, p)	(&(b)->dec[(p)->idx / RTPBATCH])
+#define BIT(p)		(1U << (p)->idx % RTPBATCH)
+#define ISRTP(b, p)	(DEC(b, p)->valid & BIT(p))
+#define FIELD(b, p, f)	(DEC(b, p)->f[(p)->idx % RTPBATCH])
+
+/* The address and start time of the stream, as in a dump header. */
+struct stream {
+	struct sockaddr_in	addr;
+	struct timeval		start;
+};
+
+/* A source reads the start of the stream, then up to the given
+ * number of packets at a time, returning how many it read, 0 for
+ * the end, or -1 for error. A sink writes the start of the stream,
+ * the packets, and finishes the output (if it needs to).
+ * Otherwise, they return 0 for success and -1 for error.
+ * What goes wrong with a single packet only sets failed. */
+struct source {
+	int	(*open)	(int, struct stream*);
+	int	(*read)	(int, struct batch*, unsigned);
+};
+
+struct sink {
+	int	(*open)	(int, struct stream*);
+	void	(*write)(int, struct batch*);
+	int	(*close)(int);
+};
+
+typedef void (*stage)(struct batch*);
+
+static unsigned char pool[BATCH][BUFLEN];
+static const struct sink *outsink = NULL;
+static int outfd = -1;
+static uint64_t netzero;
+static int ending = 0;
+static FILE *txtin = NULL;
+static FILE *txtout = NULL;
+static int failed = 0;
+static int past = 0;
+static int together = 0;
+
+/* Describe the record of len bytes in the buffer of the packet. */
+static void
+pktset(struct pkt *p, ssize_t len, uint64_t t)
+{
+	p->hdr = (struct dpkthdr*) p->buf;
+	p->rtp = (struct rtphdr*) (p->buf + DPKTHDRSIZE);
+	p->len = len;
+	p->t = t;
+	p->ns = p->hdr->msec * 1000000ULL;
+}
+
+/* Decode the RTP headers of the batch as read, RTPBATCH at a time.
+ * What the dpkthdr says is not RTP is not, whatever its bytes say. */
+static void
+decode(struct batch *b)
+{
+	unsigned char *hdr[BATCH];
+	size_t len[BATCH];
+	struct pkt *p;
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		p->idx = i;
+		hdr[i] = p->buf + DPKTHDRSIZE;
+		len[i] = p->hdr->plen ? p->len - DPKTHDRSIZE : 0;
+		b->msec[i] = p->hdr->msec;
+		b->plen[i] = p->hdr->plen;
+	}
+	for (b->nd = 0; b->nd * RTPBATCH < b->n; b->nd++)
+		decode_rtphdrs(&b->dec[b->nd], hdr + b->nd * RTPBATCH,
+			len + b->nd * RTPBATCH, b->n - b->nd * RTPBATCH);
+}
+
+/* Keep the i-th packet of the batch as the next of those kept.
+ * The descriptors trade places, so that no buffer gets lost. */
+static void
+keep(struct batch *b, unsigned *kept, unsigned i)
+{
+	struct pkt p;
+	if (*kept != i) {
+		p = b->pkt[*kept];
+		b->pkt[*kept] = b->pkt[i];
+		b->pkt[i] = p;
+	}
+	(*kept)++;
+}
+
+/* Account for a packet written out as w bytes. */
+static void
+written(struct pkt *p, ssize_t w)
+{
+	stats.txpkts++;
+	stats.txbytes += w;
+	if (p->t)
+		hist_add(&stats.delay, stats_now() - p->t);
+}
+
+/* Account for a packet of len bytes not written out whole. */
+static void
+unwritten(ssize_t w, ssize_t len, const char *what)
+{
+	if (w == -1) {
+		warnx("Error writing %zd bytes of %s", len, what);
+		stats.txerr++;
+	} else {
+		warnx("Only wrote %zd < %zd bytes of %s", w, len, what);
+		stats.txshort++;
+	}
+	failed = 1;
+}
+
+/* Read the start of a dump file, an archive, the dump files
+ * being merged, or a pcap capture.
  * Return 0 for success, -1 for error. */
-int
-net2net(int ifd, int ofd)
+static int
+dumpsrc_open(int fd, struct stream *s)
 {
-	ssize_t s, w;
-	int error = 0;
-	struct rtphdr *rtp;
-	unsigned char buf[BUFLEN];
-	while ((s = recv(ifd, buf, BUFLEN, 0)) > 0) {
+	struct dumphdr hdr;
+	if (dumpopen(fd, &s->addr, &hdr) == -1)
+		return -1;
+	if (check_dumphdr(&hdr, &s->addr) == -1)
+		warnx("Dump file header is inconsistent");
+	if (verbose)
+		print_dumphdr(&hdr);
+	s->start.tv_sec = hdr.time.sec;
+	s->start.tv_usec = hdr.time.usec;
+	return 0;
+}
+
+/* Are the two packets due at the same time, as pace() sees it:
+ * at the same time of the dump, or with the same RTP timestamp? */
+static int
+sametime(const struct pkt *a, const struct pkt *b)
+{
+	const struct dpkthdr *ha = a->hdr;
+	const struct dpkthdr *hb = b->hdr;
+	const struct rtphdr *ra = a->rtp;
+	const struct rtphdr *rb = b->rtp;
+	if (dumptime)
+		return a->ns == b->ns;
+	return ha->plen >= sizeof(*ra) && hb->plen >= sizeof(*rb)
+	&& ha->dlen >= DPKTHDRSIZE + sizeof(*ra)
+	&& hb->dlen >= DPKTHDRSIZE + sizeof(*rb)
+	&& ra->ts == rb->ts;
+}
+
+/* Read up to max records of a dump. Being paced, read only those
+ * due at the same time as the first, so that they go out together
+ * and none waits for the others; the first one due later is kept
+ * for the next time.
+ * Return the number read, 0 for the end, -1 for error. */
+static int
+dumpsrc_read(int fd, struct batch *b, unsigned max)
+{
+	static unsigned char ahead[BUFLEN];
+	static ssize_t alen = 0;
+	static ssize_t end = 1;
+	static uint64_t ans;
+	unsigned char *buf;
+	ssize_t r;
+	for (b->n = 0; b->n < max; b->n++) {
+		buf = b->pkt[b->n].buf;
+		if (alen) {
+			memcpy(buf, ahead, r = alen);
+			dumpns = ans;
+			alen = 0;
+		} else if (end <= 0) {
+			break;
+		} else if ((r = dumpread(fd, buf, BUFLEN)) <= 0) {
+			end = r;
+			break;
+		} else {
+			stats.rxpkts++;
+			stats.rxbytes += r;
+		}
+		pktset(&b->pkt[b->n], r, 0);
+		if (nsin)
+			b->pkt[b->n].ns = dumpns;
+		if (together && b->n && !sametime(&b->pkt[0], &b->pkt[b->n])) {
+			memcpy(ahead, buf, alen = r);
+			ans = dumpns;
+			break;
+		}
+	}
+	return b->n ? (int) b->n : (int) end;
+}
+
+/* The stream is what comes to our address, from now on;
+ * the packets are timed from now on the monotonic clock.
+ * Return 0 for success, -1 for error. */
+static int
+netsrc_open(int fd, struct stream *s)
+{
+	s->addr = *addr;
+	if (gettimeofday(&s->start, NULL) == -1) {
+		warn("gettimeofday");
+		return -1;
+	}
+	netzero = stats_now();
+	return 0;
+}
+
+/* When the packet just received came: when the kernel says it did,
+ * if it says (and it is not the input thread that received it),
+ * or now. Return the nsec of the CLOCK_MONOTONIC, like stats_now(). */
+static uint64_t
+rxtime(void)
+{
+	struct timespec ts;
+	uint64_t now = stats_now(), ago;
+	if (rxstamp == 0 || inring
+	|| clock_gettime(CLOCK_REALTIME, &ts) == -1)
+		return now;
+	ago = ts.tv_sec * 1000000000ULL + ts.tv_nsec - rxstamp;
+	return ago < now ? now - ago : now;
+}
+
+/* Receive up to max packets: wait for the first one, then take
+ * those already there, and make up a dpkthdr for each.
+ * Return the number received, 0 for the end, -1 for error. */
+static int
+netsrc_read(int fd, struct batch *b, unsigned max)
+{
+	static ssize_t end = 1;
+	struct pkt *p;
+	ssize_t r;
+	for (b->n = 0; end > 0 && b->n < max; b->n++) {
+		p = &b->pkt[b->n];
+		if ((r = (gro ? groget : netrecv)(fd, p->buf + DPKTHDRSIZE,
+		BUFLEN - DPKTHDRSIZE, b->n == 0)) <= 0) {
+			if (r == -1
+			&& (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			end = r;
+			break;
+		}
+		pktset(p, r + DPKTHDRSIZE, rxtime());
+		p->ns = p->t > netzero ? p->t - netzero : 0;
+		p->hdr->plen = r;
+		p->hdr->dlen = r + DPKTHDRSIZE;
+		p->hdr->msec = p->ns / 1000000;
+		stats.rxpkts++;
+		stats.rxbytes += r;
 		if (verbose)
-			fprintf(stderr, "%zd bytes of RTP received\n", s);
-		rtp = (struct rtphdr*) buf;
-		if (parse_rtphdr(rtp) == -1) {
-			error = -1;
-			warnx("Error parsing RTP header");
+			fprintf(stderr, "%zd bytes of RTP received\n", r);
+	}
+	return b->n ? (int) b->n : (int) end;
+}
+
+/* The stream is what the writer of the ring says it is,
+ * once it starts writing it.
+ * Return 0 for success, -1 for error. */
+static int
+shmsrc_open(int fd, struct stream *s)
+{
+	while (shm_stream(shmin, &s->addr, &s->start) == -1) {
+		STATS_CHECK();
+		if (quit || (errno != EAGAIN && errno != EINTR))
+			return -1;
+	}
+	return 0;
+}
+
+/* Take up to max records off the ring: wait for the first one,
+ * then take those already there, with when they were received.
+ * Return the number read, 0 for the end, -1 for error. */
+static int
+shmsrc_read(int fd, struct batch *b, unsigned max)
+{
+	static ssize_t end = 1;
+	uint64_t t;
+	ssize_t r;
+	for (b->n = 0; end > 0 && b->n < max; b->n++) {
+		while ((r = shm_read(shmin, b->pkt[b->n].buf, BUFLEN, &t,
+		b->n == 0)) == -1 && b->n == 0) {
+			STATS_CHECK();
+			if (quit) {
+				r = 0;
+				break;
+			}
+		}
+		if (r == -1)
+			break;
+		if (r == 0) {
+			end = 0;
+			break;
+		}
+		pktset(&b->pkt[b->n], r, t);
+		stats.rxpkts++;
+		stats.rxbytes += r;
+	}
+	if (b->n)
+		hist_add(&stats.batch, b->n);
+	return b->n ? (int) b->n : (int) end;
+}
+
+/* Text starts with a line giving the address, like a dump;
+ * it has no start time, so the stream starts now.
+ * Return 0 for success, -1 for error. */
+static int
+txtsrc_open(int fd, struct stream *s)
+{
+	if (read_hashline(fd, TXTMAGIC, &s->addr) == -1) {
+		warnx("Error reading text line");
+		return -1;
+	}
+	if ((txtin = fdopen(fd, "r")) == NULL) {
+		warn("fdopen");
+		return -1;
+	}
+	if (gettimeofday(&s->start, NULL) == -1) {
+		warn("gettimeofday");
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse a number of at most max off the line.
+ * Return 0 for success, -1 for error. */
+static int
+txtnum(char **line, int base, unsigned long max, unsigned long *n)
+{
+	char *e;
+	errno = 0;
+	*n = strtoul(*line, &e, base);
+	if (e == *line || errno || *n > max)
+		return -1;
+	*line = e;
+	return 0;
+}
+
+/* Make a record out of a line of text, as written by txtsnk_write():
+ * the RTP header the line describes, without the payload.
+ * Return the length of the record, or -1 for a bad line. */
+static ssize_t
+txtline(char *line, unsigned char *buf)
+{
+	struct dpkthdr *pkt = (struct dpkthdr*) buf;
+	struct rtphdr *rtp = (struct rtphdr*) (buf + DPKTHDRSIZE);
+	unsigned long sec, msec, ssrc, seq, ts, pt, plen, caplen;
+	if (txtnum(&line, 10, UINT32_MAX / 1000 - 1, &sec) == -1
+	|| *line++ != '.' || txtnum(&line, 10, 999, &msec) == -1)
+		return -1;
+	pkt->msec = sec * 1000 + msec;
+	while (isblank((unsigned char) *line))
+		line++;
+	if (*line == '-') {
+		line++;
+		if (txtnum(&line, 10, UINT16_MAX, &plen) == -1
+		|| txtnum(&line, 10, UINT16_MAX, &caplen) == -1)
+			return -1;
+		pkt->plen = plen;
+		return pkt->dlen = DPKTHDRSIZE;
+	}
+	if (txtnum(&line, 0, UINT32_MAX, &ssrc) == -1
+	|| txtnum(&line, 10, UINT16_MAX, &seq) == -1
+	|| txtnum(&line, 10, UINT32_MAX, &ts) == -1
+	|| txtnum(&line, 10, 127, &pt) == -1)
+		return -1;
+	memset(rtp, 0, 12);
+	if (*line == '*') {
+		rtp->m = 1;
+		line++;
+	}
+	if (txtnum(&line, 10, UINT16_MAX, &plen) == -1 || plen < 12
+	|| txtnum(&line, 10, UINT16_MAX, &caplen) == -1)
+		return -1;
+	rtp->v = RTPVERSION;
+	rtp->pt = pt;
+	rtp->seq = htons(seq);
+	rtp->ts = htonl(ts);
+	rtp->ssrc = htonl(ssrc);
+	pkt->plen = plen;
+	return pkt->dlen = DPKTHDRSIZE + 12;
+}
+
+/* Read up to max lines of text into records.
+ * Return the number read, 0 for the end, -1 for error. */
+static int
+txtsrc_read(int fd, struct batch *b, unsigned max)
+{
+	static unsigned lineno = 0;
+	char line[256];
+	ssize_t r;
+	for (b->n = 0; b->n < max; ) {
+		if (fgets(line, sizeof(line), txtin) == NULL) {
+			if (ferror(txtin)) {
+				warn("Error reading text");
+				return b->n ? (int) b->n : -1;
+			}
+			break;
+		}
+		lineno++;
+		stats.rxpkts++;
+		stats.rxbytes += strlen(line);
+		if ((r = txtline(line, b->pkt[b->n].buf)) == -1) {
+			warnx("Bad line %u of text", lineno);
+			stats.rxbad++;
+			failed = 1;
 			continue;
 		}
-		if (verbose)
-			print_rtphdr(rtp);
-		if ((w = write(ofd, buf, s)) == -1) {
-			warnx("Error writing %zd bytes of payload", s);
-			error = -1;
-		} else if (w < s) {
-			warnx("Only wrote %zd < %zd bytes of payload", w, s);
-			error = -1;
+		pktset(&b->pkt[b->n++], r, 0);
+	}
+	return b->n;
+}
+
+/* Write the start of a dump file or an archive.
+ * Return 0 for success, -1 for error. */
+static int
+dumpsnk_open(int fd, struct stream *s)
+{
+	return dumpstart(fd, &s->addr, &s->start);
+}
+
+static void
+dumpsnk_write(int fd, struct batch *b)
+{
+	struct pkt *p;
+	ssize_t w;
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if ((w = dumpwrite(fd, p->buf, p->len, p->ns)) == 0 && segout) {
+			/* The writer is behind; drop rather than wait. */
+			continue;
+		} else if (w != p->len) {
+			unwritten(w, p->len, "dump record");
+			continue;
+		}
+		written(p, w);
+	}
+}
+
+/* The net and raw outputs have no start of their own. */
+static int
+nostart(int fd, struct stream *s)
+{
+	return 0;
+}
+
+/* See if the kernel can send a run of datagrams in one go,
+ * cutting them up at the size we tell it with UDP_SEGMENT;
+ * one that cannot would send them as one big datagram.
+ * Return 1 if it can, 0 if not. */
+static int
+gsoinit(int fd)
+{
+#ifdef UDP_SEGMENT
+	int seg;
+	socklen_t len = sizeof(seg);
+	return getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &seg, &len) == 0;
+#else
+	return 0;
+#endif
+}
+
+/* Send a run of packets of the batch, starting with the i-th,
+ * in one go with UDP_SEGMENT: those of the size of the first
+ * that come in a row, and one shorter that ends the run.
+ * The kernel (or the card) cuts them into the datagrams again.
+ * If it says it cannot, stop trying; if it fails otherwise,
+ * leave the packets for netsnk_write() to send one by one.
+ * Return the number of packets sent, 0 if none. */
+static unsigned
+gsosend(int fd, struct batch *b, unsigned i)
+{
+#ifdef UDP_SEGMENT
+	struct iovec iov[GSOSEGS];
+	struct msghdr msg;
+	struct cmsghdr *c;
+	struct pkt *p;
+	union {
+		struct cmsghdr	hdr;
+		unsigned char	buf[CMSG_SPACE(sizeof(uint16_t))];
+	} ctl;
+	size_t len, total = 0;
+	uint16_t seg;
+	unsigned n;
+	ssize_t w;
+	if (!gso || serving)
+		return 0;
+	seg = b->pkt[i].len - DPKTHDRSIZE;
+	for (n = 0; i + n < b->n && n < GSOSEGS; n++) {
+		p = &b->pkt[i + n];
+		len = p->len - DPKTHDRSIZE;
+		if (len == 0 || len > seg || total + len > GSOMAX)
+			break;
+		iov[n].iov_base = p->rtp;
+		iov[n].iov_len = len;
+		total += len;
+		if (len < seg) {
+			n++;
+			break;
+		}
+	}
+	if (n < 2)
+		return 0;
+	memset(&msg, 0, sizeof(msg));
+	memset(&ctl, 0, sizeof(ctl));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = IPPROTO_UDP;
+	c->cmsg_type = UDP_SEGMENT;
+	c->cmsg_len = CMSG_LEN(sizeof(seg));
+	memcpy(CMSG_DATA(c), &seg, sizeof(seg));
+	while ((w = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (w != (ssize_t) total) {
+		if (w == -1 && (errno == EIO || errno == ENOPROTOOPT
+		|| errno == EOPNOTSUPP)) {
+			warn("Not sending with UDP_SEGMENT");
+			gso = 0;
+		}
+		return 0;
+	}
+	for (p = &b->pkt[i]; p < &b->pkt[i + n]; p++) {
+		if (p->len - DPKTHDRSIZE < p->hdr->plen)
+			stats.rxtrunc++;
+		written(p, p->len - DPKTHDRSIZE);
+	}
+	return n;
+#else
+	return 0;
+#endif
+}
+
+/* Send each packet as it was captured, snapped or not:
+ * in runs with UDP_SEGMENT where we can, see gsosend(). */
+static void
+netsnk_write(int fd, struct batch *b)
+{
+	struct pkt *p;
+	ssize_t r, w;
+	unsigned i, n;
+	for (i = 0; i < b->n; i += n) {
+		if ((n = gsosend(fd, b, i)))
+			continue;
+		n = 1;
+		p = &b->pkt[i];
+		if ((r = p->len - DPKTHDRSIZE) < p->hdr->plen)
+			stats.rxtrunc++;
+		if ((w = netsend(fd, p->rtp, r)) != r) {
+			unwritten(w, r, "RTP");
+			continue;
 		}
+		written(p, w);
 	}
-	return s == -1 ? -1 : error;
 }
 
-/* Read RTP packets from the ifd, write raw audio payload to ofd.
+/* Tell the readers of the ring what stream it is.
  * Return 0 for success, -1 for error. */
-int
-net2raw(int ifd, int ofd)
+static int
+shmsnk_open(int fd, struct stream *s)
 {
-	unsigned char *p;
-	unsigned char buf[BUFLEN];
-	struct rtphdr *rtp;
-	ssize_t s, w, hlen;
-	int error = 0;
-	while ((s = recv(ifd, buf, BUFLEN, 0)) > 0) {
+	return shm_start(shmout, &s->addr, &s->start);
+}
+
+/* Put each record in the ring, snapped to what fits in a slot,
+ * with when it was received, or now if it was not; then wake
+ * the readers waiting for it. */
+static void
+shmsnk_write(int fd, struct batch *b)
+{
+	struct pkt *p;
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if (p->len > SHMRECLEN)
+			p->hdr->dlen = p->len = SHMRECLEN;
+		if (shm_write(shmout, p->buf, p->len,
+		p->t ? p->t : stats_now()) == -1) {
+			unwritten(-1, p->len, "record");
+			continue;
+		}
+		written(p, p->len);
+	}
+	shm_flush(shmout);
+}
+
+/* Write the payload of each packet, after the RTP header. */
+static void
+rawsnk_write(int fd, struct batch *b)
+{
+	struct pkt *p;
+	ssize_t r, w;
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if (p->hdr->dlen - DPKTHDRSIZE < p->hdr->plen) {
+			warnx("%lu bytes of RTP payload missing",
+				p->hdr->plen - p->hdr->dlen + DPKTHDRSIZE);
+			stats.rxtrunc++;
+		}
+		r = p->len - DPKTHDRSIZE - FIELD(b, p, hlen);
+		if ((w = fileout(fd, p->buf + DPKTHDRSIZE + FIELD(b, p, hlen), r))
+		!= r) {
+			unwritten(w, r, "payload");
+			continue;
+		}
+		written(p, w);
+	}
+}
+
+static int
+txtsnk_open(int fd, struct stream *s)
+{
+	if (write_hashline(fd, TXTMAGIC, &s->addr) == -1) {
+		warnx("Error writing text line");
+		return -1;
+	}
+	if ((txtout = fdopen(fd, "w")) == NULL) {
+		warn("fdopen");
+		return -1;
+	}
+	return 0;
+}
+
+/* Describe the packet with a line of text: the time, the SSRC,
+ * sequence number, timestamp, payload type (starred if marked),
+ * the packet length and the stored length; for what is not RTP,
+ * or has no RTP header stored, a dash and the lengths.
+ * Return the length of the line. */
+static int
+txtfmt(char *line, size_t size, struct batch *b, struct pkt *p)
+{
+	if (!ISRTP(b, p))
+		return snprintf(line, size, "%u.%03u - %u %u\n",
+			p->hdr->msec / 1000, p->hdr->msec % 1000, p->hdr->plen,
+			p->hdr->dlen - (unsigned) DPKTHDRSIZE);
+	return snprintf(line, size, "%u.%03u %#x %u %u %u%s %u %u\n",
+		p->hdr->msec / 1000, p->hdr->msec % 1000,
+		FIELD(b, p, ssrc), FIELD(b, p, seq),
+		FIELD(b, p, ts), FIELD(b, p, pt),
+		FIELD(b, p, m) ? "*" : "", p->hdr->plen,
+		p->hdr->dlen - (unsigned) DPKTHDRSIZE);
+}
+
+static void
+txtsnk_write(int fd, struct batch *b)
+{
+	char line[128];
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		txtfmt(line, sizeof(line), b, &b->pkt[i]);
+		fputs(line, txtout);
+		written(&b->pkt[i], 0);
+	}
+}
+
+static int
+txtsnk_close(int fd)
+{
+	if (fclose(txtout) == EOF) {
+		warn("Error writing text");
+		return -1;
+	}
+	return 0;
+}
+
+/* Follow the sequence numbers of what comes from the net. */
+static void
+sequence(struct batch *b)
+{
+	struct rtphdrs *h;
+	unsigned i;
+	for (h = b->dec; h < b->dec + b->nd; h++)
+		for (i = 0; i < h->n; i++)
+			if (h->valid & (1U << i))
+				stats_seq(h->ssrc[i], h->seq[i]);
+}
+
+/* Keep the packets matching the filter. As the packets come
+ * in time order, the first one past the time range is the end. */
+static void
+choose(struct batch *b)
+{
+	uint32_t match[BATCH / RTPBATCH];
+	struct pkt *p;
+	unsigned i, n = 0;
+	for (i = 0; i < b->nd; i++)
+		match[i] = filter_hdrs(&filter, &b->dec[i],
+			b->msec + i * RTPBATCH, b->plen + i * RTPBATCH,
+			b->dec[i].valid);
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if ((filter.what & FILTER_TIME) && p->hdr->msec > filter.tmax) {
+			past = 1;
+			break;
+		}
+		if ((match[p->idx / RTPBATCH] & BIT(p)) == 0) {
+			stats.rxfilt++;
+			continue;
+		}
+		keep(b, &n, i);
+	}
+	b->n = n;
+}
+
+/* Parse the RTP header of each packet, for the sinks that need it.
+ * What is not RTP gets left out. FIXME: that includes RTCP, which
+ * the dumps store with a zero plen; we do not send these, because
+ * receiving zero size confuses the reader, who considers that an end.
+ * But a RTCP packet does not actually have zero size. We need to
+ * properly read the RTCP header, which we don't, yet. */
+static void
+parse(struct batch *b)
+{
+	struct pkt *p;
+	unsigned i, n = 0;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if (p->hdr->plen == 0) {
+			stats.rxskip++;
+			continue;
+		}
 		if (verbose)
-			fprintf(stderr, "%zd bytes of RTP received\n", s);
-		rtp = (struct rtphdr*) (p = buf);
-		if ((hlen = parse_rtphdr(rtp)) == -1) {
-			error = -1;
+			print_dpkthdr(p->hdr);
+		if (!ISRTP(b, p)
+		|| FIELD(b, p, hlen) > p->len - DPKTHDRSIZE) {
 			warnx("Error parsing RTP header");
+			stats.rxbad++;
+			failed = 1;
 			continue;
 		}
 		if (verbose)
-			print_rtphdr(rtp);
-		p += hlen;
-		s -= hlen;
-		if ((w = write(ofd, p, s)) == -1) {
-			warnx("Error writing %zd bytes of payload", s);
-			error = -1;
-		} else if (w < s) {
-			warnx("Only wrote %zd < %zd bytes of payload", w, s);
-			error = -1;
+			print_rtphdr(p->rtp);
+		keep(b, &n, i);
+	}
+	b->n = n;
+}
+
+/* Authenticate and decrypt the SRTP packets, dropping those that
+ * are not authentic or have been seen before; a packet not stored
+ * whole cannot be authenticated. What is not RTP passes as it is. */
+static void
+unprotect(struct batch *b)
+{
+	struct pkt *p;
+	ssize_t r;
+	unsigned i, n = 0;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if (p->hdr->plen == 0) {
+			keep(b, &n, i);
+			continue;
+		}
+		if (!ISRTP(b, p)) {
+			stats.rxbad++;
+			continue;
 		}
+		if (p->len - DPKTHDRSIZE < p->hdr->plen) {
+			stats.rxtrunc++;
+			continue;
+		}
+		if ((r = srtp_unprotect(srtpin, p->buf + DPKTHDRSIZE,
+		FIELD(b, p, hlen), p->len - DPKTHDRSIZE)) < 0) {
+			if (r == -2)
+				stats.rxreplay++;
+			else
+				stats.rxauth++;
+			continue;
+		}
+		p->hdr->plen = r;
+		p->hdr->dlen = p->len = DPKTHDRSIZE + r;
+		keep(b, &n, i);
 	}
-	return s == -1 ? -1 : error;
+	b->n = n;
 }
 
-int
-net2txt(int ifd, int ofd)
+/* Encrypt the RTP packets and append their authentication tag.
+ * A packet not stored whole cannot be encrypted.
+ * What is not RTP passes as it is. */
+static void
+protect(struct batch *b)
 {
-	return 0;
+	struct pkt *p;
+	ssize_t r;
+	unsigned i, n = 0;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if (p->hdr->plen == 0) {
+			keep(b, &n, i);
+			continue;
+		}
+		if (!ISRTP(b, p)) {
+			stats.rxbad++;
+			continue;
+		}
+		if (p->len - DPKTHDRSIZE < p->hdr->plen) {
+			stats.rxtrunc++;
+			continue;
+		}
+		if (p->len + SRTPTAG > BUFLEN
+		|| (r = srtp_protect(srtpout, p->buf + DPKTHDRSIZE,
+		FIELD(b, p, hlen), p->len - DPKTHDRSIZE)) == -1) {
+			warnx("Error encrypting RTP");
+			failed = 1;
+			continue;
+		}
+		p->hdr->plen = r;
+		p->hdr->dlen = p->len = DPKTHDRSIZE + r;
+		keep(b, &n, i);
+	}
+	b->n = n;
 }
 
-int
-txt2dump(int ifd, int ofd)
+/* Keep the whole RTP header and snaplen bytes of payload;
+ * of what is not RTP, keep snaplen bytes. */
+static void
+snap(struct batch *b)
 {
-	return 0;
+	struct pkt *p;
+	ssize_t hlen;
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		hlen = ISRTP(b, p) ? FIELD(b, p, hlen) : 0;
+		if (p->len > (ssize_t) DPKTHDRSIZE + hlen + snaplen)
+			p->hdr->dlen = p->len = DPKTHDRSIZE + hlen + snaplen;
+	}
 }
 
-int
-txt2net(int ifd, int ofd)
+/* Trace what happened to the packets of the batch
+ * from i up to n at the stage. */
+static void
+traced(struct batch *b, unsigned i, unsigned n, int what, int stage)
 {
-	return 0;
+	struct traceevent *e;
+	struct pkt *p;
+	uint64_t now = stats_now();
+	for (; i < n; i++) {
+		p = &b->pkt[i];
+		e = trace_add(tracer, now, what, stage);
+		e->batch = batches;
+		e->msec = p->hdr->msec;
+		e->len = p->len - DPKTHDRSIZE;
+		if (ISRTP(b, p)) {
+			e->flags = TRACE_RTP
+				| (FIELD(b, p, m) ? TRACE_MARKER : 0);
+			e->ssrc = FIELD(b, p, ssrc);
+			e->ts = FIELD(b, p, ts);
+			e->seq = FIELD(b, p, seq);
+			e->pt = FIELD(b, p, pt);
+		} else {
+			e->flags = 0;
+			e->ssrc = e->ts = e->seq = e->pt = 0;
+		}
+	}
 }
 
-int
-txt2raw(int ifd, int ofd)
+/* Let go of what the impairment holds back that is due by now,
+ * straight to the sink: pace() comes before impair(),
+ * which would only let go of it with the next packet. */
+static void
+release(void)
+{
+	static unsigned char held[BATCH][BUFLEN];
+	static struct batch b;
+	uint64_t now = stats_now();
+	size_t len;
+	unsigned n;
+	do {
+		for (n = 0; n < BATCH && (len = impair_take(impairment, now,
+		held[n], BUFLEN)) > 0; n++) {
+			b.pkt[n].buf = held[n];
+			pktset(&b.pkt[n], len, 0);
+		}
+		if ((b.n = n) == 0)
+			break;
+		decode(&b);
+		if (tracer) {
+			traced(&b, 0, n, TRACE_PASS, impstage);
+			traced(&b, 0, n, TRACE_OUT, impstage + 1);
+		}
+		outsink->write(outfd, &b);
+	} while (n == BATCH);
+}
+
+/* Hold each packet until it is time to send it: as it was captured,
+ * relative to the first one, or as its RTP timestamp says.
+ * The batches hold the packets due at the same time here,
+ * see dumpsrc_read(), or one packet, so that none waits for the others. */
+static void
+pace(struct batch *b)
 {
+	static struct timeval zero;
+	static uint64_t first = UINT64_MAX;
+	static uint32_t last = 0;
+	struct pkt *p;
+	unsigned i, n = 0;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		if (first == UINT64_MAX) {
+			/* A trimmed dump does not start at zero;
+			 * neither do we. */
+			first = p->ns;
+			if (dumptime && gettimeofday(&zero, NULL) == -1) {
+				warn("gettimeofday");
+				dumptime = 0;
+			}
+		}
+		if ((dumptime
+		? dumpsleep(&zero, p->ns - first)
+		: rtpsleep(&last, FIELD(b, p, ts), FIELD(b, p, pt))) == -1) {
+			if (quit)
+				break;
+			warnx("packet timing failed");
+			failed = 1;
+			continue;
+		}
+		keep(b, &n, i);
+	}
+	b->n = n;
+}
+
+/* Write the start of the file of each stream being demultiplexed.
+ * Return 0 for success, -1 for error. */
+static int
+demuxstart(int fd, void *arg)
+{
+	struct stream *s = arg;
+	if (ofmt == FORMAT_TXT)
+		return write_hashline(fd, TXTMAGIC, &s->addr) == -1 ? -1 : 0;
+	if (ofmt == FORMAT_RAW)
+		return 0;
+	if (write_dumpline(fd, &s->addr) == -1
+	|| write_dumphdr(fd, &s->addr, &s->start) == -1)
+		return -1;
 	return 0;
 }
 
+/* Keep the start of the stream for the file of each of its streams. */
+static int
+demuxsnk_open(int fd, struct stream *s)
+{
+	static struct stream demuxed;
+	demuxed = *s;
+	return demux_start(demuxout, demuxstart, &demuxed);
+}
+
+/* Write each packet to the file of its SSRC (and payload type),
+ * as a dump record, its payload, or a line of text. */
+static void
+demuxsnk_write(int fd, struct batch *b)
+{
+	char line[128];
+	struct pkt *p;
+	const void *buf;
+	uint64_t key;
+	ssize_t r, w;
+	unsigned i;
+	for (i = 0; i < b->n; i++) {
+		p = &b->pkt[i];
+		key = !ISRTP(b, p) ? DEMUXOTHER : demuxpt
+			? DEMUXKEY(FIELD(b, p, ssrc), FIELD(b, p, pt))
+			: FIELD(b, p, ssrc);
+		if (ofmt == FORMAT_TXT) {
+			r = txtfmt(line, sizeof(line), b, p);
+			buf = line;
+		} else if (ofmt == FORMAT_RAW) {
+			r = p->len - DPKTHDRSIZE - FIELD(b, p, hlen);
+			buf = p->buf + DPKTHDRSIZE + FIELD(b, p, hlen);
+		} else {
+			r = p->len;
+			buf = p->buf;
+			pack_dpkthdr(p->hdr);
+		}
+		if ((w = demux_write(demuxout, key, buf, r)) != r) {
+			unwritten(w, r, formats[ofmt].name);
+			continue;
+		}
+		written(p, w);
+	}
+}
+
+static int
+demuxsnk_close(int fd)
+{
+	int rv = demux_close(demuxout);
+	demuxout = NULL;
+	return rv;
+}
+
+/* Lose, duplicate, delay and reorder the packets as the impairment
+ * says, and let go of those held back that are due by now; once
+ * the input has ended, wait for the next one to be due.
+ * The packets let go of take the buffers of those not kept,
+ * and the batch gets decoded anew. */
+static void
+impair(struct batch *b)
+{
+	struct timespec nap;
+	uint64_t now = stats_now(), due[2], next;
+	unsigned i, c, k, n = 0;
+	size_t len;
+	int pass;
+	if (ending && (next = impair_due(impairment)) > now) {
+		nap.tv_sec = (next - now) / 1000000000;
+		nap.tv_nsec = (next - now) % 1000000000;
+		if (napfor(&nap) == -1)
+			return;
+		now = stats_now();
+	}
+	for (i = 0; i < b->n; i++) {
+		/* What is due now goes right away, unless others wait. */
+		k = impair_fate(impairment, now, due);
+		pass = k && due[0] <= now && impair_due(impairment) == 0;
+		for (c = pass; c < k; c++)
+			if (impair_hold(impairment, due[c],
+			b->pkt[i].buf, b->pkt[i].len) == -1)
+				stats.impfull++;
+		if (pass)
+			keep(b, &n, i);
+	}
+	while (n < BATCH && (len = impair_take(impairment, now,
+	b->pkt[n].buf, BUFLEN)) > 0)
+		pktset(&b->pkt[n++], len, 0);
+	b->n = n;
+	decode(b);
+}
+
+static const struct source dumpsource = { dumpsrc_open, dumpsrc_read };
+static const struct source netsource = { netsrc_open, netsrc_read };
+static const struct source txtsource = { txtsrc_open, txtsrc_read };
+static const struct source shmsource = { shmsrc_open, shmsrc_read };
+
+static const struct sink dumpsink = { dumpsnk_open, dumpsnk_write, NULL };
+static const struct sink netsink = { nostart, netsnk_write, NULL };
+static const struct sink rawsink = { nostart, rawsnk_write, NULL };
+static const struct sink txtsink = { txtsnk_open, txtsnk_write, txtsnk_close };
+static const struct sink shmsink = { shmsnk_open, shmsnk_write, NULL };
+static const struct sink demuxsink = {
+	demuxsnk_open, demuxsnk_write, demuxsnk_close
+};
+
+/* The stages by name, for the trace. */
+static const struct {
+	stage		 st;
+	const char	*name;
+} stagenames[] = {
+	{ sequence,	"sequence" },
+	{ choose,	"filter" },
+	{ unprotect,	"unprotect" },
+	{ parse,	"parse" },
+	{ protect,	"protect" },
+	{ snap,		"snap" },
+	{ pace,		"pace" },
+	{ impair,	"impair" },
+};
+#define NUMSTAGES (sizeof(stagenames) / sizeof(stagenames[0]))
+
+/* Start the trace of the packets through the stages:
+ * stage 0 is reading them, the last one is writing them.
+ * Return 0 for success, -1 for error. */
+static int
+tracestart(const char *path, stage *stages)
+{
+	const char *names[TRACESTAGES + 1];
+	unsigned i, n = 0;
+	names[n++] = "read";
+	for (; *stages; stages++)
+		for (i = 0; i < NUMSTAGES; i++)
+			if (stagenames[i].st == *stages) {
+				if (*stages == impair)
+					impstage = n;
+				names[n++] = stagenames[i].name;
+			}
+	names[n++] = "write";
+	names[n] = NULL;
+	return (tracer = trace_open(path, names)) ? 0 : -1;
+}
+
+/* Take the batch of packets through the stages,
+ * and write what is left of it to the sink.
+ * The packets a stage leaves out end up past those it keeps. */
+static void
+flow(struct batch *b, stage *stages, const struct sink *snk, int ofd)
+{
+	stage *st;
+	unsigned n;
+	decode(b);
+	if (tracer && b->n) {
+		batches++;
+		traced(b, 0, b->n, TRACE_IN, 0);
+	}
+	for (st = stages; *st; st++) {
+		n = b->n;
+		(*st)(b);
+		if (tracer == NULL)
+			continue;
+		/* What the impairment lets go of has been
+		 * written over what it holds back. */
+		if (*st == impair)
+			traced(b, 0, b->n, TRACE_PASS, st - stages + 1);
+		else if (b->n < n)
+			traced(b, b->n, n, TRACE_DROP, st - stages + 1);
+	}
+	if (tracer)
+		traced(b, 0, b->n, TRACE_OUT, st - stages + 1);
+	if (b->n)
+		snk->write(ofd, b);
+}
+
+/* Read the stream from the source, take each batch of packets
+ * through the stages, and write what is left of it to the sink.
+ * Once the source ends, let go of what the impairment holds back.
+ * Return 0 for success, -1 for error. */
+static int
+run(const struct source *src, const struct sink *snk, stage *stages,
+	unsigned max, int ifd, int ofd)
+{
+	struct stream s;
+	struct batch b;
+	unsigned i;
+	int r = 0, rv;
+	memset(&s, 0, sizeof(s));
+	for (i = 0; i < BATCH; i++)
+		b.pkt[i].buf = pool[i];
+	if (src->open(ifd, &s) == -1 || snk->open(ofd, &s) == -1)
+		return -1;
+	outsink = snk;
+	outfd = ofd;
+	if (src == &dumpsource && snk == &dumpsink
+	&& (rv = dumpmap(ifd, ofd)) != 1)
+		return rv;
+	while (!quit && !past && (r = src->read(ifd, &b, max)) > 0) {
+		STATS_CHECK();
+		flow(&b, stages, snk, ofd);
+	}
+	ending = 1;
+	while (!quit && r != -1 && impair_due(impairment)) {
+		b.n = 0;
+		flow(&b, stages, snk, ofd);
+	}
+	rv = (r == -1 || failed) ? -1 : 0;
+	if (snk->close && snk->close(ofd) == -1)
+		rv = -1;
+	return rv;
+}
+
 int
 main(int argc, char** argv)
 {
-	int c;
+	int c, rv;
+	long long n;
+	char *p;
 	int ifd = STDIN_FILENO;
 	int ofd = STDOUT_FILENO;
+	struct sigaction sa;
 
-	int (*convert)(int ifd, int ofd) = NULL;
-	int (*converter[NUMFORMATS][NUMFORMATS])(int, int) = {
-		{ NULL,     dump2net, dump2raw, dump2txt, NULL },
-		{ net2dump, net2net,  net2raw,  net2txt,  NULL },
-		{ NULL,     NULL,     NULL,	NULL,     NULL },
-		{ txt2dump, txt2net,  txt2raw,  NULL,     NULL },
-		{ NULL,     NULL,     NULL,     NULL,     NULL },
+	const struct source *source[NUMFORMATS] = {
+		&dumpsource, &netsource, NULL, &txtsource,
+		&dumpsource, &dumpsource, &shmsource, NULL
+	};
+	const struct sink *sink[NUMFORMATS] = {
+		&dumpsink, &netsink, &rawsink, &txtsink,
+		&dumpsink, NULL, &shmsink, NULL
 	};
+	stage stages[9], *st = stages;
+	unsigned batch = BATCH;
 
-	while ((c = getopt(argc, argv, "i:o:rtv")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "cC:de:f:G:i:K:k:lmO:o:rS:s:T:tv")) != -1) switch (c) {
+		case 'c':
+			checking = 1;
+			break;
+		case 'C':
+			if ((n = optnum("size", optarg, 1, UINT32_MAX)) == -1)
+				return -1;
+			segsize = n * 1000000;
+			break;
+		case 'd':
+			demuxing = 1;
+			break;
+		case 'e':
+			if ((impairment = impair_open(optarg)) == NULL)
+				return -1;
+			break;
+		case 'f':
+			if (filter_parse(&filter, optarg) == -1)
+				return -1;
+			break;
+		case 'G':
+			if ((n = optnum("seconds", optarg, 1, UINT32_MAX / 1000))
+			== -1)
+				return -1;
+			segsecs = n;
+			break;
 		case 'i':
 			if (((ifmt = fmtbyname(optarg))) == FORMAT_NONE) {
 				warnx("unknown format: %s", optarg);
 				return -1;
 			}
 			break;
+		case 'K':
+			if ((srtpout = srtp_open(optarg)) == NULL)
+				return -1;
+			break;
+		case 'k':
+			if ((srtpin = srtp_open(optarg)) == NULL)
+				return -1;
+			break;
 		case 'o':
 			if ((ofmt = fmtbyname(optarg)) == FORMAT_NONE) {
 				warnx("unknown format: %s", optarg);
 				return -1;
 			}
 			break;
+		case 'l':
+			serving = 1;
+			break;
+		case 'm':
+			merging = 1;
+			break;
+		case 'O':
+			if (setopts(optarg) == -1)
+				return -1;
+			break;
 		case 'r':
 			remote = 1;
 			break;
+		case 'S':
+			statsfile = optarg;
+			break;
+		case 's':
+			if ((snaplen = optnum("snaplen", optarg, 0, BUFLEN)) == -1)
+				return -1;
+			break;
+		case 'T':
+			tracefile = optarg;
+			break;
 		case 't':
 			dumptime = 1;
 			break;
@@ -714,20 +2777,106 @@ main(int argc, char** argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc > 2) {
+	if ((merging ? argc < 2 : argc > 2) || (merging && checking)
+	|| (demuxing && checking)) {
 		usage();
 		return -1;
 	}
 
+	/* Not SA_RESTART: let a blocking call return, so that we quit. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onquit;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, NULL) == -1
+	||  sigaction(SIGTERM, &sa, NULL) == -1)
+		err(1, "sigaction");
+	if (stats_init(statsfile, interval) == -1)
+		return -1;
+
 	if (getifaddrs(&ifaces) == -1)
 		err(1, NULL);
-	if (-1 == (ifd = (*argv
+	if (merging) {
+		if ((mergein = merge_open(argv, argc - 1)) == NULL)
+			return -1;
+		ifmt = FORMAT_DUMP;
+		argv += argc - 1;
+	} else if (*argv && isshm(*argv, ifmt)) {
+		/* Read the ring the writer has made, in memory. */
+		if ((shmin = shm_attach(*argv++)) == NULL)
+			return -1;
+		ifmt = FORMAT_SHM;
+		ifd = -1;
+	} else if (-1 == (ifd = (*argv
 	? rtpopen(*argv++, O_RDONLY)
 	: rtpopen("-",     O_RDONLY)))) {
 		warnx("Cannot open input for reading");
 		return -1;
 	}
-	if (-1 == (ofd = (*argv
+	if (checking) {
+		/* Salvage the good records into a dump, if asked to. */
+		if (ifmt != FORMAT_DUMP) {
+			warnx("Only a dump can be checked");
+			return -1;
+		}
+		if (*argv && -1 == (ofd =
+		rtpopen(*argv, O_WRONLY|O_CREAT|O_TRUNC))) {
+			warnx("Cannot open output for writing");
+			return -1;
+		} else if (*argv == NULL)
+			ofd = -1;
+		if (ofd != -1 && ofmt != FORMAT_DUMP) {
+			warnx("Only a dump can be salvaged into");
+			return -1;
+		}
+		freeifaddrs(ifaces);
+		return check_dump(ifd, ofd, resync, verbose);
+	}
+	if (demuxing && (segsize || segsecs)) {
+		warnx("Cannot rotate the output of each stream");
+		return -1;
+	} else if (demuxing) {
+		/* The files of the streams get created as they come. */
+		if (*argv == NULL || strcmp(*argv, "-") == 0
+		|| strchr(*argv, ':')) {
+			warnx("Only a file output can be demultiplexed");
+			return -1;
+		}
+		if (ofmt == FORMAT_NONE && (p = strrchr(*argv, '.')))
+			ofmt = fmtbysuff(p + 1);
+		if (ofmt == FORMAT_NONE)
+			ofmt = FORMAT_DUMP;
+		if (ofmt != FORMAT_DUMP && ofmt != FORMAT_RAW
+		&& ofmt != FORMAT_TXT) {
+			warnx("Only a dump, raw or txt output"
+				" can be demultiplexed");
+			return -1;
+		}
+		if ((demuxout = demux_open(*argv++, demuxpt, demuxfiles))
+		== NULL)
+			return -1;
+		ofd = -1;
+	} else if (segsize || segsecs) {
+		/* The segments get created as they come. */
+		if (*argv == NULL || strcmp(*argv, "-") == 0
+		|| strchr(*argv, ':')) {
+			warnx("Only a file output can be rotated");
+			return -1;
+		}
+		if (ofmt == FORMAT_NONE && (p = strrchr(*argv, '.')))
+			ofmt = fmtbysuff(p + 1);
+		if (ofmt == FORMAT_NONE)
+			ofmt = FORMAT_DUMP;
+		if ((segout = seg_open(*argv++, segsize, segsecs, nsout))
+		== NULL)
+			return -1;
+		ofd = -1;
+	} else if (*argv && isshm(*argv, ofmt)) {
+		/* Make the ring anew for the readers to come. */
+		if ((shmout = shm_create(*argv++)) == NULL)
+			return -1;
+		ofmt = FORMAT_SHM;
+		ofd = -1;
+	} else if (-1 == (ofd = (*argv
 	? rtpopen(*argv++, O_WRONLY|O_CREAT|O_TRUNC)
 	: rtpopen("-",     O_WRONLY|O_CREAT|O_TRUNC)))) {
 		warnx("Cannot open output for writing");
@@ -743,13 +2892,95 @@ main(int argc, char** argv)
 		warnx("Output format not determined");
 		return -1;
 	}
-	if (ifmt == FORMAT_RAW) {
-		warnx("Only output can be raw");
+	if (source[ifmt] == NULL) {
+		warnx("Only output can be %s", formats[ifmt].name);
+		return -1;
+	}
+	if (sink[ofmt] == NULL) {
+		warnx("Only input can be %s", formats[ofmt].name);
+		return -1;
+	}
+	if (segout && (ifmt != FORMAT_NET || ofmt != FORMAT_DUMP)) {
+		warnx("Only capturing from the net into a dump can rotate");
 		return -1;
 	}
-	if ((convert = converter[ifmt][ofmt]) == NULL) {
-		warnx("No converter for this input/output combination");
+	if (nsout && (ofmt != FORMAT_DUMP || demuxout)) {
+		warnx("Only a dump can have the nsec timeline");
 		return -1;
 	}
-	return convert ? convert(ifd, ofd) : -1;
+	/* The gaps the socket filter makes are not losses. */
+	if ((ifmt == FORMAT_NET && !kfilter) || ifmt == FORMAT_SHM)
+		*st++ = sequence;
+	if (filter.what)
+		*st++ = choose;
+	if (srtpin)
+		*st++ = unprotect;
+	if (ifmt == FORMAT_NET || ofmt == FORMAT_NET || ofmt == FORMAT_RAW)
+		*st++ = parse;
+	if (srtpout)
+		*st++ = protect;
+	if (snaplen != -1)
+		*st++ = snap;
+	if (ofmt == FORMAT_NET && ifmt != FORMAT_NET && ifmt != FORMAT_SHM) {
+		*st++ = pace;
+		together = source[ifmt] == &dumpsource;
+		batch = together ? BATCH : 1;
+	}
+	if (impairment)
+		*st++ = impair;
+	*st = NULL;
+	if (impairment && (uring || pipeline)) {
+		warnx("Not reading ahead with an impairment");
+		uring = pipeline = 0;
+	}
+	if (rtprio && ring_rt(rtprio) == -1)
+		warnx("Not running in real time");
+	if (memlock && mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		warn("Not locking the memory");
+	if (uring && uring_init(uring) == -1) {
+		warnx("Not using io_uring");
+		uring = 0;
+	}
+	if (pipeline && uring)
+		warnx("Not reading in a thread with io_uring");
+	else if (pipeline
+	&& (inring = ring_open(pipeline, BUFLEN, cpuin)) == NULL)
+		warnx("Not reading in a thread");
+	if (xdpif && xdpin == NULL) {
+		warnx("Only a net input can be taken off the interface");
+		return -1;
+	}
+	if (inring ? cpuout != -1 : cpuin != -1)
+		ring_pin(inring ? cpuout : cpuin);
+	/* The socket filter only sees the first of a coalesced run. */
+	if (gso && ifmt == FORMAT_NET && inring == NULL && !uring && !kfilter)
+		gro = groinit(ifd);
+	if (gso && ofmt == FORMAT_NET)
+		gso = gsoinit(ofd);
+	if (tracefile && tracestart(tracefile, stages) == -1)
+		return -1;
+	rv = run(source[ifmt], demuxout ? &demuxsink : sink[ofmt],
+		stages, batch, ifd, ofd);
+	ring_close(inring);
+	if (arcout && arc_close(arcout) == -1)
+		rv = -1;
+	if (segout && seg_close(segout) == -1)
+		rv = -1;
+	demux_close(demuxout);
+	arc_close(arcin);
+	pcap_close(pcapin);
+	merge_close(mergein);
+	srtp_close(srtpin);
+	srtp_close(srtpout);
+	impair_close(impairment);
+	xdp_close(xdpin);
+	shm_close(shmin);
+	shm_close(shmout);
+	trace_close(tracer);
+	if (uring && uring_done() == -1)
+		rv = -1;
+	if (hellofd != -1)
+		serve_done(hellofd);
+	stats_exit(verbose || statsfile);
+	return rv;
 }
@@ -0,0 +1,525 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Measure the latency and pacing accuracy of rtp.
+ *
+ * In the 'net' mode, we send stamped packets to the input
+ * of a rtp tunnel (net2net) and receive them at its output.
+ * The latency is the time from our send() to our recv();
+ * the jitter is how much the spacing of the received packets
+ * differs from the spacing in which we sent them.
+ *
+ * In the 'dump' mode, we write a dump file with packets
+ * evenly spaced at the given rate, let rtp replay it (dump2net),
+ * and receive the packets. The latency is how late each packet
+ * comes compared to the ideal schedule (started at the earliest
+ * packet); the jitter is how much the spacing of the received
+ * packets differs from the spacing in the schedule. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "format-dump.h"
+#include "format-rtp.h"
+#include "hist.h"
+
+#define BENCHMAGIC	0x52545042	/* RTPB */
+#define WARMUP		UINT32_MAX	/* index of warmup packets */
+#define BENCHPT		26		/* a payload type with 90 kHz clock */
+#define BENCHTS		90000		/* rtp takes a zero timestamp as unset */
+
+extern const char* __progname;
+
+/* What we put into the payload of each packet. */
+struct stamp {
+	uint32_t	magic;
+	uint32_t	index;
+	uint64_t	nsec;	/* send time (net) or schedule (dump) */
+};
+
+struct result {
+	uint64_t	sent;
+	uint64_t	recv;
+	uint64_t	dups;
+	uint64_t	reorder;
+	struct hist	latency;
+	struct hist	jitter;
+};
+
+static const char *inaddr  = "127.0.0.1:23450";
+static const char *outaddr = "127.0.0.1:23452";
+static unsigned count = 1000;
+static unsigned size = 172;
+static int plot = 0;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "%s [-H] [-a addr:port] [-b addr:port] "
+		"[-m net|dump] [-n count] [-p pps[,pps...]] [-s size] "
+		"[-- command ...]\n", __progname);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Wait till the given CLOCK_MONOTONIC time in nsec.
+ * Sleep most of the way, spin the rest. */
+static void
+waituntil(uint64_t when)
+{
+	uint64_t t;
+	struct timespec nap;
+	while ((t = now()) < when) {
+		if (when - t > 200000) {
+			t = when - t - 100000;
+			nap.tv_sec = t / 1000000000;
+			nap.tv_nsec = t % 1000000000;
+			nanosleep(&nap, NULL);
+		}
+	}
+}
+
+/* Resolve an addr:port string. Return 0 for success, -1 for error. */
+static int
+resolve(const char *spec, struct sockaddr_in *sin)
+{
+	int e;
+	char *p, *a;
+	struct addrinfo info, *res;
+	if ((a = strdup(spec)) == NULL)
+		err(1, NULL);
+	if ((p = strchr(a, ':')) == NULL) {
+		warnx("'%s' is not addr:port", spec);
+		free(a);
+		return -1;
+	}
+	*p++ = '\0';
+	memset(&info, 0, sizeof(info));
+	info.ai_family = PF_INET;
+	info.ai_socktype = SOCK_DGRAM;
+	info.ai_flags = AI_NUMERICSERV;
+	if ((e = getaddrinfo(*a ? a : NULL, p, &info, &res))) {
+		warnx("'%s': %s", spec, gai_strerror(e));
+		free(a);
+		return -1;
+	}
+	memcpy(sin, res->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(res);
+	free(a);
+	return 0;
+}
+
+/* Fill in a RTP packet with the given stamp.
+ * Return the packet length. */
+static size_t
+mkpacket(unsigned char *buf, uint32_t i, uint32_t ts, uint64_t nsec)
+{
+	struct rtphdr *rtp = (struct rtphdr*) buf;
+	struct stamp s;
+	memset(buf, 0, size);
+	rtp->v = RTPVERSION;
+	rtp->pt = BENCHPT;
+	rtp->seq = htons(i & 0xffff);
+	rtp->ts = htonl(ts);
+	rtp->ssrc = htonl(BENCHMAGIC);
+	s.magic = BENCHMAGIC;
+	s.index = i;
+	s.nsec = nsec;
+	memcpy(buf + sizeof(struct rtphdr), &s, sizeof(s));
+	return size;
+}
+
+/* Write a dump file of 'count' packets evenly spaced at 'pps',
+ * to be replayed by rtp into 'out'. Return the fd, or -1. */
+static int
+mkdump(char *path, unsigned pps, struct sockaddr_in *out)
+{
+	int fd;
+	uint32_t i;
+	uint64_t nsec;
+	struct timeval start;
+	struct sockaddr_in a;
+	unsigned char buf[BUFSIZ];
+	if ((fd = mkstemp(path)) == -1) {
+		warn("%s", path);
+		return -1;
+	}
+	a.sin_addr.s_addr = out->sin_addr.s_addr;
+	a.sin_port = ntohs(out->sin_port);
+	gettimeofday(&start, NULL);
+	if (write_dumpline(fd, &a) == -1 || write_dumphdr(fd, &a, &start) == -1)
+		goto bad;
+	for (i = 0; i < count; i++) {
+		nsec = i * 1000000000ULL / pps;
+		mkpacket(buf, i, BENCHTS + i * 90000ULL / pps, nsec);
+		if (write_dpkthdr(fd, size, nsec / 1000000) == -1
+		|| write(fd, buf, size) != (ssize_t) size)
+			goto bad;
+	}
+	return fd;
+bad:
+	warnx("Error writing %s", path);
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+/* Run the command with the given input and output appended.
+ * Return the pid, or -1 for error. */
+static pid_t
+runrtp(char **cmd, int argc, const char *in, const char *out)
+{
+	int i;
+	pid_t pid;
+	char **argv;
+	if ((argv = calloc(argc + 3, sizeof(char*))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < argc; i++)
+		argv[i] = cmd[i];
+	argv[i++] = (char*) in;
+	argv[i++] = (char*) out;
+	argv[i] = NULL;
+	switch (pid = fork()) {
+	case -1:
+		warn("fork");
+		break;
+	case 0:
+		execvp(argv[0], argv);
+		warn("%s", argv[0]);
+		_exit(127);
+	default:
+		break;
+	}
+	free(argv);
+	return pid;
+}
+
+/* Send 'count' stamped packets to the socket at 'pps'. */
+static void
+sender(int fd, unsigned pps)
+{
+	uint32_t i;
+	uint64_t zero, t;
+	unsigned char buf[BUFSIZ];
+	zero = now();
+	for (i = 0; i < count; i++) {
+		waituntil(zero + i * 1000000000ULL / pps);
+		t = now();
+		mkpacket(buf, i, BENCHTS + i * 90000ULL / pps, t);
+		if (send(fd, buf, size, 0) == -1 && errno != ECONNREFUSED)
+			warn("send");
+	}
+}
+
+/* Receive the packets, note when each of them came, and their stamp.
+ * Give up after a second of silence. Return the number received. */
+static uint64_t
+receiver(int fd, uint64_t *when, uint64_t *stamp, struct result *r)
+{
+	ssize_t n;
+	uint64_t t;
+	uint32_t top = 0;
+	struct pollfd pfd;
+	struct stamp s;
+	unsigned char buf[BUFSIZ];
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (r->recv < count && poll(&pfd, 1, 1000) == 1) {
+		if ((n = recv(fd, buf, sizeof(buf), 0)) == -1)
+			continue;
+		t = now();
+		if ((size_t) n < sizeof(struct rtphdr) + sizeof(struct stamp))
+			continue;
+		memcpy(&s, buf + sizeof(struct rtphdr), sizeof(s));
+		if (s.magic != BENCHMAGIC || s.index >= count)
+			continue;
+		if (when[s.index]) {
+			r->dups++;
+			continue;
+		}
+		if (s.index < top)
+			r->reorder++;
+		else
+			top = s.index;
+		when[s.index] = t;
+		stamp[s.index] = s.nsec;
+		r->recv++;
+	}
+	return r->recv;
+}
+
+/* Compute the latency and jitter histograms
+ * from the receive times and the stamps. */
+static void
+evaluate(uint64_t *when, uint64_t *stamp, struct result *r, int dump)
+{
+	uint32_t i, prev = WARMUP;
+	int64_t d, base = INT64_MAX;
+	if (dump) {
+		/* the schedule starts when the earliest packet came */
+		for (i = 0; i < count; i++)
+			if (when[i] && (int64_t) (when[i] - stamp[i]) < base)
+				base = when[i] - stamp[i];
+	} else {
+		base = 0;
+	}
+	for (i = 0; i < count; i++) {
+		if (when[i] == 0)
+			continue;
+		d = when[i] - stamp[i] - base;
+		hist_add(&r->latency, d < 0 ? 0 : d);
+		if (prev != WARMUP && prev + 1 == i) {
+			d = (when[i] - when[prev]) - (stamp[i] - stamp[prev]);
+			hist_add(&r->jitter, d < 0 ? -d : d);
+		}
+		prev = i;
+	}
+}
+
+static void
+report(struct result *r, const char *mode, unsigned pps)
+{
+	printf("%s %u pps: sent %llu recv %llu lost %llu dup %llu "
+		"reordered %llu\n", mode, pps,
+		(unsigned long long) r->sent, (unsigned long long) r->recv,
+		(unsigned long long) (r->sent - r->recv),
+		(unsigned long long) r->dups, (unsigned long long) r->reorder);
+	hist_print(stdout, "  latency usec", &r->latency, 1e3);
+	if (plot)
+		hist_plot(stdout, &r->latency, 1e3);
+	hist_print(stdout, "  jitter  usec", &r->jitter, 1e3);
+	if (plot)
+		hist_plot(stdout, &r->jitter, 1e3);
+}
+
+/* Make a UDP socket, optionally connected to 'to'.
+ * Return the socket, or -1 for error. */
+static int
+udpsocket(struct sockaddr_in *to)
+{
+	int fd;
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		warn("socket");
+		return -1;
+	}
+	if (to && connect(fd, (struct sockaddr*) to, sizeof(*to)) == -1) {
+		warn("connect");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Wait for the rtp under test to start forwarding:
+ * keep telling its output we are listening and, in the net mode,
+ * keep sending warmup packets to its input, till something comes.
+ * Return 0 for success, -1 for timeout. */
+static int
+warmup(int sfd, int rfd, int dump)
+{
+	int i;
+	struct pollfd pfd;
+	unsigned char buf[BUFSIZ];
+	pfd.fd = rfd;
+	pfd.events = POLLIN;
+	for (i = 0; i < 500; i++) {
+		send(rfd, "1", 1, 0);
+		if (dump) {
+			/* the first packet is already a measured one */
+			if (poll(&pfd, 1, 10) == 1)
+				return 0;
+			continue;
+		}
+		mkpacket(buf, WARMUP, BENCHTS, 0);
+		send(sfd, buf, size, 0);
+		if (poll(&pfd, 1, 10) == 1) {
+			/* drain the warmup packets */
+			while (poll(&pfd, 1, 50) == 1)
+				recv(rfd, buf, sizeof(buf), 0);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Run one measurement at the given packet rate.
+ * Return 0 for success, -1 for error. */
+static int
+bench(char **cmd, int argc, int dump, unsigned pps)
+{
+	int sfd = -1, rfd = -1, dfd = -1, status, rv = -1;
+	pid_t rtp = -1, snd = -1;
+	char path[] = "/tmp/rtpbench.XXXXXX";
+	uint64_t *when = NULL, *stamp = NULL;
+	struct sockaddr_in in, out;
+	struct result *r;
+	if ((r = calloc(1, sizeof(struct result))) == NULL)
+		err(1, NULL);
+	hist_init(&r->latency);
+	hist_init(&r->jitter);
+	if (resolve(inaddr, &in) == -1 || resolve(outaddr, &out) == -1)
+		goto done;
+	if ((when = calloc(count, sizeof(uint64_t))) == NULL
+	||  (stamp = calloc(count, sizeof(uint64_t))) == NULL)
+		err(1, NULL);
+	if ((rfd = udpsocket(&out)) == -1)
+		goto done;
+	if (dump) {
+		if ((dfd = mkdump(path, pps, &out)) == -1)
+			goto done;
+		rtp = runrtp(cmd, argc, path, outaddr);
+	} else {
+		if ((sfd = udpsocket(&in)) == -1)
+			goto done;
+		rtp = runrtp(cmd, argc, inaddr, outaddr);
+	}
+	if (rtp == -1)
+		goto done;
+	/* give it a moment to bind */
+	usleep(100000);
+	if (warmup(sfd, rfd, dump) == -1) {
+		warnx("%s does not forward anything", cmd[0]);
+		goto done;
+	}
+	if (dump) {
+		r->sent = count;
+	} else if ((snd = fork()) == -1) {
+		warn("fork");
+		goto done;
+	} else if (snd == 0) {
+		sender(sfd, pps);
+		_exit(0);
+	} else {
+		r->sent = count;
+	}
+	receiver(rfd, when, stamp, r);
+	evaluate(when, stamp, r, dump);
+	report(r, dump ? "dump" : "net", pps);
+	rv = 0;
+done:
+	if (snd > 0)
+		waitpid(snd, &status, 0);
+	if (rtp > 0) {
+		kill(rtp, SIGTERM);
+		waitpid(rtp, &status, 0);
+	}
+	if (dfd != -1) {
+		close(dfd);
+		unlink(path);
+	}
+	if (sfd != -1)
+		close(sfd);
+	if (rfd != -1)
+		close(rfd);
+	free(when);
+	free(stamp);
+	free(r);
+	return rv;
+}
+
+int
+main(int argc, char** argv)
+{
+	int c, dump = 0, rv = 0;
+	char *rates = NULL, *p;
+	const char *e;
+	unsigned pps;
+	char defrates[] = "50,1000,10000";
+	char defrtp[] = "./rtp";
+	char *defcmd[] = { defrtp, NULL };
+
+	while ((c = getopt(argc, argv, "a:b:Hm:n:p:s:")) != -1) switch (c) {
+		case 'a':
+			inaddr = optarg;
+			break;
+		case 'b':
+			outaddr = optarg;
+			break;
+		case 'H':
+			plot = 1;
+			break;
+		case 'm':
+			if (strcmp(optarg, "net") == 0) {
+				dump = 0;
+			} else if (strcmp(optarg, "dump") == 0) {
+				dump = 1;
+			} else {
+				warnx("unknown mode: %s", optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+			if ((count = strtonum(optarg, 2, 10000000, &e)) == 0) {
+				warnx("count %s: %s", optarg, e);
+				return 1;
+			}
+			break;
+		case 'p':
+			rates = optarg;
+			break;
+		case 's':
+			if ((size = strtonum(optarg,
+			sizeof(struct rtphdr) + sizeof(struct stamp),
+			1400, &e)) == 0) {
+				warnx("size %s: %s", optarg, e);
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0) {
+		argv = defcmd;
+		argc = 1;
+	}
+	if (rates == NULL)
+		rates = defrates;
+	signal(SIGPIPE, SIG_IGN);
+	for (p = strtok(rates, ","); p; p = strtok(NULL, ",")) {
+		if ((pps = strtonum(p, 1, 1000000, &e)) == 0) {
+			warnx("rate %s: %s", p, e);
+			return 1;
+		}
+		if (bench(argv, argc, dump, pps) == -1)
+			rv = 1;
+	}
+	return rv;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Print the trace of the packets that rtp -T has written,
+ * one event per line, oldest first: when it happened (seconds
+ * since the start of the trace), the batch, what happened
+ * at which stage, and the packet, as rtp writes a txt line. */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "config.h"
+#include "trace.h"
+
+extern const char* __progname;
+
+static const char *what[] = { "in", "drop", "pass", "out" };
+
+static void
+usage(void)
+{
+	fprintf(stderr, "%s [-n count] tracefile\n", __progname);
+}
+
+/* Print the event, with the stages named as in the header. */
+static void
+print_event(const struct tracehdr *h, const struct traceevent *e)
+{
+	char name[TRACENAME];
+	snprintf(name, sizeof(name), "%.*s", TRACENAME - 1,
+		e->stage < TRACESTAGES ? h->stage[e->stage] : "?");
+	printf("%llu.%09llu %u %-4s %-9s %.3f",
+		(unsigned long long) e->ns / 1000000000,
+		(unsigned long long) e->ns % 1000000000, e->batch,
+		e->what <= TRACE_OUT ? what[e->what] : "?",
+		name, e->msec / 1e3);
+	if (e->flags & TRACE_RTP)
+		printf(" %#x %u %u %u%s", e->ssrc, e->seq, e->ts, e->pt,
+			e->flags & TRACE_MARKER ? "*" : "");
+	printf(" %u\n", e->len);
+}
+
+int
+main(int argc, char** argv)
+{
+	const struct traceevent *ev;
+	const struct tracehdr *h;
+	const char *errstr;
+	struct stat st;
+	uint64_t head, n, i;
+	time_t sec;
+	void *map;
+	int c, fd;
+	long long count = -1;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) switch (c) {
+		case 'n':
+			count = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "count is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+			return 1;
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1) {
+		usage();
+		return 1;
+	}
+
+	if ((fd = open(*argv, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		err(1, "%s", *argv);
+	if ((size_t) st.st_size < sizeof(*h))
+		errx(1, "%s: not a trace", *argv);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		err(1, "%s", *argv);
+	close(fd);
+	h = map;
+	if (memcmp(h->magic, TRACEMAGIC, sizeof(h->magic))
+	|| h->size != sizeof(struct traceevent) || h->events == 0
+	|| (size_t) st.st_size < sizeof(*h) + (size_t) h->events * h->size)
+		errx(1, "%s: not a trace of this rtp", *argv);
+	ev = (const struct traceevent*) (h + 1);
+
+	/* The ring holds the last events of those written. */
+	head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	n = head < h->events ? head : h->events;
+	if (count != -1 && (uint64_t) count < n)
+		n = count;
+	sec = h->start / 1000000000;
+	printf("# %llu events, started %.24s, %llu nsec\n",
+		(unsigned long long) head, ctime(&sec),
+		(unsigned long long) h->start % 1000000000);
+	for (i = head - n; i < head; i++)
+		print_event(h, &ev[i % h->events]);
+	munmap(map, st.st_size);
+	return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#if HAVE_PTHREAD
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#include "format-dump.h"
+#include "segment.h"
+#include "stats.h"
+
+/* The queue is a ring of SEGQUEUE bytes, with one writer (the capture)
+ * and one reader (the writer thread), who only ever move their own end;
+ * head and tail count the bytes ever queued and taken. The records in
+ * it keep their dpkthdr in local byte order, and start at four-byte
+ * boundaries; a record that does not fit before the end of the ring
+ * starts at its beginning, and a zero dlen marks the unused rest.
+ * Without threads, the records are written as they come. */
+
+#define SEGBUF	65536	/* bytes written at once */
+#define ALIGN4(n)	(((n) + 3) & ~(size_t) 3)
+
+struct seg {
+	const char	*path;	/* as given, numbered for each segment */
+	uint64_t	 size;	/* bytes per segment, or 0 */
+	uint32_t	 msec;	/* length of a segment, or 0 */
+	int		 ns;	/* the records have the nsec timeline */
+	int		 fd;	/* of the current segment */
+	unsigned	 n;	/* segments so far */
+	uint64_t	 bytes;	/* in the current segment */
+	uint32_t	 base;	/* msec of its start since the capture start */
+	int		 failed;
+	uint64_t	 errors;
+	struct sockaddr_in addr;
+	struct timeval	 start;
+	unsigned char	 buf[SEGBUF];
+	size_t		 buflen;
+#if HAVE_PTHREAD
+	unsigned char	*ring;
+	atomic_size_t	 head;
+	atomic_size_t	 tail;
+	atomic_int	 done;
+	int		 running;
+	pthread_t	 thread;
+#endif
+};
+
+/* Make a new segment writer. Each segment is named after
+ * the output with its number: out.000.rtp, out.001.rtp, and so on.
+ * A segment ends before it would grow over size bytes,
+ * or after secs seconds; either can be 0 for no limit.
+ * With ns, the records come with the nsec timeline,
+ * and the segments are dumps with the nsec timeline.
+ * Return the writer, or NULL for error. */
+struct seg*
+seg_open(const char *path, uint64_t size, unsigned secs, int ns)
+{
+	struct seg *s;
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+	s->path = path;
+	s->size = size;
+	s->msec = secs * 1000;
+	s->ns = ns;
+	s->fd = -1;
+	return s;
+}
+
+/* Write out the buffered records of the current segment.
+ * Return 0 for success, -1 for error. */
+static int
+flush(struct seg *s)
+{
+	ssize_t w;
+	size_t off = 0;
+	while (off < s->buflen) {
+		if ((w = write(s->fd, s->buf + off, s->buflen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("Error writing segment %u", s->n - 1);
+			s->errors++;
+			s->buflen = 0;
+			return -1;
+		}
+		off += w;
+	}
+	s->buflen = 0;
+	return 0;
+}
+
+/* Finish the current segment: write it out, and give back
+ * the space preallocated beyond what it needed.
+ * Return 0 for success, -1 for error. */
+static int
+finish(struct seg *s)
+{
+	int rv = flush(s);
+	if (s->size && ftruncate(s->fd, s->bytes) == -1) {
+		warn("ftruncate");
+		rv = -1;
+	}
+	if (close(s->fd) == -1) {
+		warn("close");
+		rv = -1;
+	}
+	s->fd = -1;
+	return rv;
+}
+
+/* Start a new segment with the record of the given time:
+ * at that time if the segments are cut by size,
+ * at the last multiple of their length if by time.
+ * Return 0 for success, -1 for error. */
+static int
+next(struct seg *s, uint32_t msec)
+{
+	int len;
+	char tag[16];
+	char name[PATH_MAX];
+	struct timeval t;
+	if (s->fd != -1 && finish(s) == -1)
+		s->errors++;
+	s->base = s->msec ? msec - (msec - s->base) % s->msec : msec;
+	t.tv_sec = s->start.tv_sec + s->base / 1000;
+	t.tv_usec = s->start.tv_usec + s->base % 1000 * 1000;
+	if (t.tv_usec >= 1000000) {
+		t.tv_usec -= 1000000;
+		t.tv_sec++;
+	}
+	snprintf(tag, sizeof(tag), "%03u", s->n);
+	if (tag_dumpname(name, sizeof(name), s->path, tag) == -1)
+		return -1;
+	if ((s->fd = open(name, O_WRONLY|O_CREAT|O_TRUNC, 0644)) == -1) {
+		warn("%s", name);
+		return -1;
+	}
+	s->n++;
+#if HAVE_FALLOCATE
+	/* Keep the size: the segment is a valid dump all the time. */
+	if (s->size && fallocate(s->fd, FALLOC_FL_KEEP_SIZE, 0, s->size) == -1
+	&& errno != EOPNOTSUPP)
+		warn("%s: fallocate", name);
+#endif
+	len = s->ns ? write_dumpnsline(s->fd, &s->addr)
+		: write_dumpline(s->fd, &s->addr);
+	if (len == -1 || write_dumphdr(s->fd, &s->addr, &t) == -1) {
+		warnx("%s: Error writing dump header", name);
+		return -1;
+	}
+	s->bytes = len + DUMPHDRSIZE;
+	return 0;
+}
+
+/* Append a record to the current segment, starting a new one first
+ * if the record does not belong to the current one. Once a segment
+ * cannot be started, the rest of the records are lost. */
+static void
+put(struct seg *s, unsigned char *rec)
+{
+	struct dpkthdr *pkt = (struct dpkthdr*) rec;
+	size_t len = pkt->dlen;
+	if (s->failed) {
+		s->errors++;
+		return;
+	}
+	if ((s->msec && pkt->msec - s->base >= s->msec)
+	||  (s->size && s->bytes + len > s->size)) {
+		if (next(s, pkt->msec) == -1) {
+			s->failed = 1;
+			s->errors++;
+			return;
+		}
+	}
+	pkt->msec -= s->base;
+	if (s->ns)
+		set_dpktns(rec, get_dpktns(rec) - s->base * 1000000ULL);
+	pack_dpkthdr(pkt);
+	if (s->buflen + len > SEGBUF)
+		flush(s);
+	memcpy(s->buf + s->buflen, rec, len);
+	s->buflen += len;
+	s->bytes += len;
+}
+
+#if HAVE_PTHREAD
+/* The writer thread: take the records off the queue and write them,
+ * writing out what is buffered whenever the queue runs empty. */
+static void *
+run(void *arg)
+{
+	int done;
+	size_t head, tail = 0, pos;
+	struct dpkthdr *pkt;
+	struct seg *s = arg;
+	struct timespec nap = { 0, 1000000 };
+	for (;;) {
+		/* Seen done, see everything queued before it. */
+		done = atomic_load_explicit(&s->done, memory_order_acquire);
+		head = atomic_load_explicit(&s->head, memory_order_acquire);
+		if (tail == head) {
+			if (s->buflen && s->fd != -1)
+				flush(s);
+			if (done)
+				break;
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		while (tail != head) {
+			pos = tail & (SEGQUEUE - 1);
+			pkt = (struct dpkthdr*) (s->ring + pos);
+			if (pkt->dlen == 0) {
+				tail += SEGQUEUE - pos;
+				continue;
+			}
+			tail += ALIGN4(pkt->dlen);
+			put(s, (unsigned char*) pkt);
+		}
+		atomic_store_explicit(&s->tail, tail, memory_order_release);
+	}
+	return NULL;
+}
+#endif
+
+/* Start the first segment, of a capture of addr started at start,
+ * and the thread writing the segments.
+ * Return 0 for success, -1 for error. */
+int
+seg_start(struct seg *s, struct sockaddr_in *addr, struct timeval *start)
+{
+	s->addr = *addr;
+	s->start = *start;
+	if (next(s, 0) == -1)
+		return -1;
+#if HAVE_PTHREAD
+	if ((s->ring = malloc(SEGQUEUE)) == NULL) {
+		warn(NULL);
+		return -1;
+	}
+	if ((errno = pthread_create(&s->thread, NULL, run, s))) {
+		warn("pthread_create");
+		return -1;
+	}
+	s->running = 1;
+#endif
+	return 0;
+}
+
+/* Hand a record, with the dpkthdr in local byte order, to the writer.
+ * Return the bytes queued, or 0 if the queue is full
+ * and the record has been dropped. */
+ssize_t
+seg_write(struct seg *s, void *rec, size_t len)
+{
+#if HAVE_PTHREAD
+	size_t head, tail, pos, gap;
+	head = atomic_load_explicit(&s->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&s->tail, memory_order_acquire);
+	pos = head & (SEGQUEUE - 1);
+	gap = SEGQUEUE - pos < ALIGN4(len) ? SEGQUEUE - pos : 0;
+	if (head + gap + ALIGN4(len) - tail > SEGQUEUE) {
+		stats.txdrop++;
+		return 0;
+	}
+	if (gap) {
+		((struct dpkthdr*) (s->ring + pos))->dlen = 0;
+		head += gap;
+		pos = 0;
+	}
+	memcpy(s->ring + pos, rec, len);
+	atomic_store_explicit(&s->head, head + ALIGN4(len),
+		memory_order_release);
+#else
+	put(s, rec);
+#endif
+	return len;
+}
+
+/* Let the writer write everything queued, finish the last segment,
+ * and free the writer. The writer's errors are counted as write errors.
+ * Return 0 for success, -1 if anything failed to be written. */
+int
+seg_close(struct seg *s)
+{
+	int rv = 0;
+	if (s == NULL)
+		return 0;
+#if HAVE_PTHREAD
+	if (s->running) {
+		atomic_store_explicit(&s->done, 1, memory_order_release);
+		pthread_join(s->thread, NULL);
+	}
+	free(s->ring);
+#endif
+	if (s->fd != -1 && finish(s) == -1)
+		s->errors++;
+	if (s->failed || s->errors)
+		rv = -1;
+	stats.txerr += s->errors;
+	free(s);
+	return rv;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Writing a capture into a series of dump files (segments),
+ * starting a new one when the current one grows too big or too old.
+ * Each segment is a complete dump, with its own dump line and header.
+ * The records are written by a thread of their own, which they are
+ * handed to through a bounded queue; when the queue is full,
+ * the record is dropped rather than waited for.
+ * Needs format-dump.h. */
+
+#define SEGQUEUE	(8 << 20)	/* bytes of records in the queue */
+
+struct seg;
+
+struct seg	*seg_open	(const char*, uint64_t, unsigned, int);
+int		 seg_start	(struct seg*, struct sockaddr_in*,
+				 struct timeval*);
+ssize_t		 seg_write	(struct seg*, void*, size_t);
+int		 seg_close	(struct seg*);
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE /* sendmmsg(2) with glibc */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "config.h"
+#include "server.h"
+#include "stats.h"
+
+#define SENDBATCH 64	/* subscribers per sendmmsg() */
+
+struct sub {
+	struct sockaddr_in	addr;
+	time_t			seen;
+};
+
+static struct sub *subs = NULL;
+static size_t nsubs = 0;
+static size_t maxsubs = 0;
+static size_t limit = SERVESUBS;
+static unsigned idle = SERVEIDLE;
+static int verbose = 0;
+static uint64_t lastpoll = 0;
+static time_t lastidle = 0;
+
+static struct sub*
+findsub(struct sockaddr_in *a)
+{
+	size_t i;
+	for (i = 0; i < nsubs; i++)
+		if (subs[i].addr.sin_addr.s_addr == a->sin_addr.s_addr
+		&&  subs[i].addr.sin_port == a->sin_port)
+			return &subs[i];
+	return NULL;
+}
+
+static void
+delsub(struct sub *s, const char *why)
+{
+	if (verbose)
+		warnx("%s:%u %s", inet_ntoa(s->addr.sin_addr),
+			ntohs(s->addr.sin_port), why);
+	*s = subs[--nsubs];
+}
+
+/* Add a subscriber, or note that an existing one is still there;
+ * refuse a new one with as many as the limit already there.
+ * Return 0 for success, -1 for error. */
+static int
+addsub(struct sockaddr_in *a, time_t now)
+{
+	struct sub *s;
+	if ((s = findsub(a))) {
+		s->seen = now;
+		return 0;
+	}
+	if (nsubs == limit) {
+		stats.subrefuse++;
+		if (verbose)
+			warnx("%s:%u refused", inet_ntoa(a->sin_addr),
+				ntohs(a->sin_port));
+		return -1;
+	}
+	if (nsubs == maxsubs) {
+		size_t max = maxsubs ? 2 * maxsubs : 16;
+		if ((s = realloc(subs, max * sizeof(struct sub))) == NULL) {
+			warn("subscriber %s", inet_ntoa(a->sin_addr));
+			return -1;
+		}
+		subs = s;
+		maxsubs = max;
+	}
+	s = &subs[nsubs++];
+	s->addr = *a;
+	s->seen = now;
+	stats.subjoin++;
+	if (verbose)
+		warnx("%s:%u subscribed",
+			inet_ntoa(a->sin_addr), ntohs(a->sin_port));
+	return 0;
+}
+
+/* Read whatever the (would-be) subscribers have sent us,
+ * and forget those that have been silent for too long.
+ * Return 0 for success, -1 for error. */
+static int
+control(int fd)
+{
+	ssize_t r;
+	size_t i;
+	time_t now = time(NULL);
+	struct sub *s;
+	struct sockaddr_in a;
+	socklen_t len;
+	char b[16];
+	for (;;) {
+		len = sizeof(a);
+		r = recvfrom(fd, b, sizeof(b), MSG_DONTWAIT,
+			(struct sockaddr*) &a, &len);
+		if (r == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			/* ICMP unreachable from a gone subscriber */
+			if (errno == ECONNREFUSED)
+				continue;
+			warn("recvfrom");
+			return -1;
+		}
+		if (len != sizeof(a) || a.sin_family != AF_INET || r != 1)
+			continue;
+		if (b[0] == '0') {
+			if ((s = findsub(&a))) {
+				stats.subleave++;
+				delsub(s, "unsubscribed");
+			}
+		} else if (b[0] == '1') {
+			addsub(&a, now);
+		}
+	}
+	if (idle && now != lastidle) {
+		lastidle = now;
+		for (i = nsubs; i > 0; i--)
+			if (now - subs[i-1].seen > (time_t) idle) {
+				stats.subidle++;
+				delsub(&subs[i-1], "timed out");
+			}
+	}
+	return 0;
+}
+
+/* Make the bound socket fd serve up to max subscribers, forgetting
+ * those silent for 'secs' (0 for never); be verbose about them.
+ * Return 0 for success, -1 for error. */
+int
+serve_init(int fd, unsigned secs, unsigned max, int v)
+{
+	int fl;
+	idle = secs;
+	limit = max;
+	verbose = v;
+	if ((fl = fcntl(fd, F_GETFL)) == -1
+	||  fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1) {
+		warn("O_NONBLOCK");
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait till there is at least one subscriber.
+ * Return 0 for success, -1 for error (or a signal). */
+int
+serve_wait(int fd)
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (nsubs == 0) {
+		if (poll(&pfd, 1, -1) == -1)
+			return -1;
+		if (control(fd) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Send the packet to every subscriber, in batches.
+ * A subscriber whose socket buffer is full misses the packet,
+ * which only counts as missed.
+ * Return len unless any of the sends failed otherwise, -1 if so. */
+ssize_t
+serve_send(int fd, const void *buf, size_t len)
+{
+	size_t i, n;
+	int rv = 0;
+	uint64_t now;
+	struct iovec iov;
+#if HAVE_SENDMMSG
+	int s;
+	size_t j;
+	struct mmsghdr msg[SENDBATCH];
+#endif
+	if ((now = stats_now()) - lastpoll > SERVEPOLL * 1000000ULL) {
+		lastpoll = now;
+		control(fd);
+	}
+	iov.iov_base = (void*) buf;
+	iov.iov_len = len;
+	for (i = 0; i < nsubs; i += n) {
+		n = nsubs - i < SENDBATCH ? nsubs - i : SENDBATCH;
+#if HAVE_SENDMMSG
+		memset(msg, 0, n * sizeof(struct mmsghdr));
+		for (j = 0; j < n; j++) {
+			msg[j].msg_hdr.msg_name = &subs[i+j].addr;
+			msg[j].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			msg[j].msg_hdr.msg_iov = &iov;
+			msg[j].msg_hdr.msg_iovlen = 1;
+		}
+		for (j = 0; j < n; j += s) {
+			if ((s = sendmmsg(fd, msg + j, n - j, 0)) == -1) {
+				/* this one fails, try the rest */
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					stats.submiss++;
+				else
+					rv = -1;
+				s = 1;
+			}
+		}
+#else
+		n = 1;
+		if (sendto(fd, buf, len, 0, (struct sockaddr*) &subs[i].addr,
+		sizeof(struct sockaddr_in)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				stats.submiss++;
+			else
+				rv = -1;
+		}
+#endif
+		hist_add(&stats.fanout, n);
+	}
+	return rv == -1 ? -1 : (ssize_t) len;
+}
+
+/* Say goodbye to the server we have subscribed to with fd. */
+void
+serve_done(int fd)
+{
+	send(fd, "0", 1, 0);
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Serving a stream to many subscribers on a local address.
+ * A subscriber joins (or says it is still there) by sending "1"
+ * to our address, and leaves by sending "0"; anything else is
+ * ignored. Past the given number of subscribers, no more join,
+ * so that spoofed hellos cannot send the stream everywhere. */
+
+#define SERVEIDLE	60	/* forget silent subscribers after this (sec) */
+#define SERVEPOLL	10	/* check for subscribers this often (msec) */
+#define KEEPALIVE	10	/* subscribers say hello this often (sec) */
+#define SERVESUBS	64	/* subscribers at most, by default */
+
+int	serve_init	(int, unsigned, unsigned, int);
+int	serve_wait	(int);
+ssize_t	serve_send	(int, const void*, size_t);
+void	serve_done	(int);
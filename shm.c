@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "stats.h"
+#include "shm.h"
+
+#if HAVE_FUTEX
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+/* The ring is a header followed by the slots. The writer counts
+ * the packets it has written in head; packet n goes in slot
+ * n % SHMSLOTS, whose seq is n + 1 once it is there, and zero
+ * while it is being written. A reader copies the slot out and
+ * checks the seq again: if it has changed, the writer has been
+ * there meanwhile. Each reader keeps its cursor in the header,
+ * which the writer looks at every SHMCHECK packets to tell
+ * the readers it has lapped, and those that have gone away. */
+
+#define SHMMAGIC	"RTPSHM1"
+#define SHMCHECK	(SHMSLOTS / 8)
+#define SHMNAP		100000		/* nsec between looks without futex */
+
+#define SHMNEW		0		/* the stream has not started yet */
+#define SHMLIVE		1		/* the writer is writing */
+#define SHMDONE		2		/* the writer is gone */
+
+struct cursor {
+	uint64_t	pos;		/* the next packet to read */
+	uint32_t	pid;		/* of the reader, zero if free */
+	uint32_t	lapped;		/* the writer has told */
+};
+
+struct shmhdr {
+	char		magic[8];
+	uint32_t	slots;
+	uint32_t	size;		/* of a slot */
+	uint32_t	state;
+	uint32_t	addr;		/* of the stream, network order */
+	uint16_t	port;		/* of the stream, host order */
+	uint16_t	pad;
+	uint32_t	waiting;	/* readers sleeping on wake */
+	int64_t		sec;		/* when the stream started */
+	int64_t		usec;
+	uint64_t	head;		/* packets written */
+	uint32_t	wake;		/* futex the readers sleep on */
+	uint32_t	pad2;
+	struct cursor	cursor[SHMREADERS];
+};
+
+struct slot {
+	uint64_t	seq;		/* the packet + 1, zero if being written */
+	uint64_t	t;		/* when it was received */
+	uint32_t	len;		/* of the record */
+	uint32_t	pad;
+	unsigned char	rec[];
+};
+
+#define SHMSLOT		(sizeof(struct slot) + SHMRECLEN)
+#define SHMLEN		(sizeof(struct shmhdr) + (size_t) SHMSLOTS * SHMSLOT)
+
+struct shm {
+	struct shmhdr	*hdr;
+	struct cursor	*cur;		/* ours if we are a reader */
+	uint64_t	 pos;		/* where we are reading */
+	uint64_t	 check;		/* head when the writer looks next */
+	uint64_t	 woke;		/* head when the writer last woke */
+};
+
+static struct slot*
+slot(struct shm *s, uint64_t n)
+{
+	return (struct slot*) ((unsigned char*) (s->hdr + 1)
+		+ (size_t) (n % SHMSLOTS) * SHMSLOT);
+}
+
+/* Sleep until the writer wakes us, but no longer than a second.
+ * The number of waiters tells the writer whether to bother. */
+static void
+sleepon(struct shmhdr *h, uint32_t wake)
+{
+#if HAVE_FUTEX
+	struct timespec ts = { 1, 0 };
+	syscall(__NR_futex, &h->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+#else
+	struct timespec ts = { 0, SHMNAP };
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void
+wakeup(struct shmhdr *h)
+{
+	if (__atomic_load_n(&h->waiting, __ATOMIC_SEQ_CST) == 0)
+		return;
+	__atomic_add_fetch(&h->wake, 1, __ATOMIC_SEQ_CST);
+#if HAVE_FUTEX
+	syscall(__NR_futex, &h->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static struct shm*
+shm_map(int fd)
+{
+	struct shm *s;
+	void *m;
+	if ((m = mmap(NULL, SHMLEN, PROT_READ | PROT_WRITE,
+	MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		warn("mmap");
+		return NULL;
+	}
+	if ((s = calloc(1, sizeof(struct shm))) == NULL) {
+		warn(NULL);
+		munmap(m, SHMLEN);
+		return NULL;
+	}
+	s->hdr = m;
+	return s;
+}
+
+/* Tell the readers of a ring that is there already that it is done,
+ * and make a new one in its place: the readers keep the old file
+ * mapped until they go. Truncating it instead would pull the pages
+ * from under them. Return NULL on error. */
+struct shm*
+shm_create(const char *path)
+{
+	struct shmhdr *h;
+	struct shm *s;
+	struct stat st;
+	int fd;
+	if ((fd = open(path, O_RDWR)) != -1) {
+		if (fstat(fd, &st) == 0 && (size_t) st.st_size >= SHMLEN
+		&& (s = shm_map(fd)) != NULL) {
+			if (memcmp(s->hdr->magic, SHMMAGIC, 8) == 0) {
+				__atomic_store_n(&s->hdr->state,
+					SHMDONE, __ATOMIC_SEQ_CST);
+				wakeup(s->hdr);
+			}
+			munmap(s->hdr, SHMLEN);
+			free(s);
+		}
+		close(fd);
+	}
+	if (unlink(path) == -1 && errno != ENOENT) {
+		warn("%s", path);
+		return NULL;
+	}
+	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (ftruncate(fd, SHMLEN) == -1) {
+		warn("%s", path);
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	s = shm_map(fd);
+	close(fd);
+	if (s == NULL) {
+		unlink(path);
+		return NULL;
+	}
+	h = s->hdr;
+	h->slots = SHMSLOTS;
+	h->size = SHMSLOT;
+	h->state = SHMNEW;
+	s->check = SHMCHECK;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(h->magic, SHMMAGIC, 8);
+	return s;
+}
+
+/* Take a free cursor in the ring and start reading
+ * at its head. Return NULL on error. */
+struct shm*
+shm_attach(const char *path)
+{
+	struct shmhdr *h;
+	struct shm *s;
+	struct stat st;
+	uint32_t none;
+	unsigned i;
+	int fd;
+	if ((fd = open(path, O_RDWR)) == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+	if ((size_t) st.st_size < SHMLEN) {
+		warnx("%s: Not a packet ring", path);
+		close(fd);
+		return NULL;
+	}
+	s = shm_map(fd);
+	close(fd);
+	if (s == NULL)
+		return NULL;
+	h = s->hdr;
+	if (memcmp(h->magic, SHMMAGIC, 8)
+	|| h->slots != SHMSLOTS || h->size != SHMSLOT) {
+		warnx("%s: Not a packet ring", path);
+		goto bad;
+	}
+	for (i = 0; i < SHMREADERS; i++) {
+		none = 0;
+		if (__atomic_compare_exchange_n(&h->cursor[i].pid, &none,
+		(uint32_t) getpid(), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+	}
+	if (i == SHMREADERS) {
+		warnx("%s: Too many readers", path);
+		goto bad;
+	}
+	s->cur = &h->cursor[i];
+	s->pos = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+	s->cur->lapped = 0;
+	__atomic_store_n(&s->cur->pos, s->pos, __ATOMIC_RELEASE);
+	return s;
+bad:
+	munmap(s->hdr, SHMLEN);
+	free(s);
+	return NULL;
+}
+
+/* Tell the readers what stream this is. Return 0. */
+int
+shm_start(struct shm *s, const struct sockaddr_in *addr,
+	const struct timeval *start)
+{
+	struct shmhdr *h = s->hdr;
+	h->addr = addr->sin_addr.s_addr;
+	h->port = ntohs(addr->sin_port);
+	h->sec = start->tv_sec;
+	h->usec = start->tv_usec;
+	__atomic_store_n(&h->state, SHMLIVE, __ATOMIC_RELEASE);
+	wakeup(h);
+	return 0;
+}
+
+/* Wait for the writer to start the stream and tell what it is.
+ * Return 0, or -1 with EAGAIN if it has not started yet. */
+int
+shm_stream(struct shm *s, struct sockaddr_in *addr, struct timeval *start)
+{
+	struct shmhdr *h = s->hdr;
+	uint32_t wake;
+	wake = __atomic_load_n(&h->wake, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == SHMNEW) {
+		__atomic_add_fetch(&h->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&h->state, __ATOMIC_SEQ_CST) == SHMNEW)
+			sleepon(h, wake);
+		__atomic_sub_fetch(&h->waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE) == SHMNEW) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = h->addr;
+	addr->sin_port = htons(h->port);
+	start->tv_sec = h->sec;
+	start->tv_usec = h->usec;
+	return 0;
+}
+
+/* Put a record in the next slot, with the time it was received.
+ * The readers only see it once it is whole.
+ * Return 0, or -1 if it does not fit in a slot. */
+int
+shm_write(struct shm *s, const void *rec, size_t len, uint64_t t)
+{
+	struct shmhdr *h = s->hdr;
+	struct slot *sl;
+	uint64_t n;
+	if (len > SHMRECLEN) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	n = h->head;
+	sl = slot(s, n);
+	__atomic_store_n(&sl->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(sl->rec, rec, len);
+	sl->len = len;
+	sl->t = t;
+	__atomic_store_n(&sl->seq, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&h->head, n + 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* Wake the readers waiting for what we have written, and every
+ * SHMCHECK packets, see which of them are a ring behind, once,
+ * and let go of the cursors of those no longer there. */
+void
+shm_flush(struct shm *s)
+{
+	struct shmhdr *h = s->hdr;
+	struct cursor *c;
+	uint64_t head, pos;
+	uint32_t pid;
+	unsigned i;
+	head = h->head;
+	if (head != s->woke) {
+		wakeup(h);
+		s->woke = head;
+	}
+	if (head < s->check)
+		return;
+	s->check = head + SHMCHECK;
+	for (i = 0; i < SHMREADERS; i++) {
+		c = &h->cursor[i];
+		if ((pid = __atomic_load_n(&c->pid, __ATOMIC_RELAXED)) == 0)
+			continue;
+		if (kill((pid_t) pid, 0) == -1 && errno == ESRCH) {
+			__atomic_compare_exchange_n(&c->pid, &pid, 0,
+				0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		pos = __atomic_load_n(&c->pos, __ATOMIC_RELAXED);
+		if (head - pos > SHMSLOTS && !c->lapped) {
+			warnx("reader %u fell behind the ring", pid);
+			c->lapped = 1;
+			stats.txslow++;
+		} else if (head - pos < SHMSLOTS / 2) {
+			c->lapped = 0;
+		}
+	}
+}
+
+/* Copy the next record out of the ring, with the time it was received,
+ * waiting a second at most if asked to. A reader that the writer has
+ * lapped skips to half a ring behind, counting the packets it missed.
+ * Return the length of the record, 0 when the writer is done and
+ * we have read everything, or -1 with EAGAIN if there is nothing. */
+ssize_t
+shm_read(struct shm *s, void *buf, size_t len, uint64_t *t, int wait)
+{
+	struct shmhdr *h = s->hdr;
+	struct slot *sl;
+	uint64_t head, seq, skip;
+	uint32_t wake;
+	size_t n;
+	for (;;) {
+		wake = __atomic_load_n(&h->wake, __ATOMIC_SEQ_CST);
+		head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		if (head == s->pos) {
+			if (__atomic_load_n(&h->state, __ATOMIC_ACQUIRE)
+			== SHMDONE && __atomic_load_n(&h->head,
+			__ATOMIC_ACQUIRE) == s->pos)
+				return 0;
+			if (!wait) {
+				errno = EAGAIN;
+				return -1;
+			}
+			__atomic_add_fetch(&h->waiting, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&h->head, __ATOMIC_SEQ_CST) == s->pos
+			&& __atomic_load_n(&h->state, __ATOMIC_SEQ_CST)
+			!= SHMDONE)
+				sleepon(h, wake);
+			__atomic_sub_fetch(&h->waiting, 1, __ATOMIC_SEQ_CST);
+			wait = 0;
+			continue;
+		}
+		if (head - s->pos <= SHMSLOTS) {
+			sl = slot(s, s->pos);
+			seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE);
+			if (seq == s->pos + 1) {
+				n = sl->len;
+				if (n > len)
+					n = len;
+				memcpy(buf, sl->rec, n);
+				*t = sl->t;
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&sl->seq, __ATOMIC_RELAXED)
+				== seq) {
+					s->pos++;
+					__atomic_store_n(&s->cur->pos, s->pos,
+						__ATOMIC_RELEASE);
+					return n;
+				}
+			}
+			head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		}
+		skip = head - SHMSLOTS / 2;
+		if (skip > s->pos) {
+			stats.rxoverrun += skip - s->pos;
+			s->pos = skip;
+		}
+	}
+}
+
+/* Tell the readers the writer is done,
+ * or let go of the reader's cursor. */
+void
+shm_close(struct shm *s)
+{
+	if (s == NULL)
+		return;
+	if (s->cur) {
+		__atomic_store_n(&s->cur->pid, 0, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&s->hdr->state, SHMDONE, __ATOMIC_SEQ_CST);
+		wakeup(s->hdr);
+	}
+	munmap(s->hdr, SHMLEN);
+	free(s);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A ring of packets in shared memory, for rtp processes on the same
+ * machine to pass a stream along without the net: one writes it,
+ * up to SHMREADERS read it, each at its own cursor. The ring is
+ * a file mapped by all of them (on a tmpfs such as /dev/shm,
+ * it stays in memory). Each slot holds a dump record and when
+ * the packet was received. The writer never waits for the readers:
+ * a reader falling more than the ring behind loses the packets
+ * written over meanwhile, which it counts as overrun, and which
+ * the writer warns about. A reader with nothing to read sleeps
+ * on a futex where there is one, waiting a second at most;
+ * the writer wakes the sleepers once per batch written. */
+
+#define SHMSLOTS	8192		/* packets in the ring */
+#define SHMRECLEN	2024		/* bytes of a record in a slot */
+#define SHMREADERS	16		/* readers at a time at most */
+
+struct shm;
+
+struct shm	*shm_create	(const char*);
+struct shm	*shm_attach	(const char*);
+int		 shm_start	(struct shm*, const struct sockaddr_in*,
+				 const struct timeval*);
+int		 shm_stream	(struct shm*, struct sockaddr_in*,
+				 struct timeval*);
+int		 shm_write	(struct shm*, const void*, size_t, uint64_t);
+void		 shm_flush	(struct shm*);
+ssize_t		 shm_read	(struct shm*, void*, size_t, uint64_t*, int);
+void		 shm_close	(struct shm*);
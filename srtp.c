@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "config.h"
+#include "srtp.h"
+
+#if HAVE_CRYPTO
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#define SHA1LEN		20	/* bytes of a HMAC-SHA1 key and digest */
+#define SHA1BLOCK	64
+
+static const struct suite {
+	const char	*name;
+	int		 gcm;
+	unsigned	 keylen;
+	unsigned	 saltlen;
+	unsigned	 taglen;
+} suites[] = {
+	{ "AES_CM_128_HMAC_SHA1_80",	0, 16, 14, 10 },
+	{ "AES_CM_128_HMAC_SHA1_32",	0, 16, 14,  4 },
+	{ "AES_256_CM_HMAC_SHA1_80",	0, 32, 14, 10 },
+	{ "AES_256_CM_HMAC_SHA1_32",	0, 32, 14,  4 },
+	{ "AEAD_AES_128_GCM",		1, 16, 12, 16 },
+	{ "AEAD_AES_256_GCM",		1, 32, 12, 16 },
+	{ NULL,				0,  0,  0,  0 }
+};
+
+/* What we know of each SSRC: the highest sequence number
+ * and the rollover counter (RFC 3711 3.3.1), and a bitmap
+ * of the last SRTPWINDOW packet indices seen up to the highest. */
+struct ssrc {
+	uint32_t	ssrc;
+	int		used;
+	uint32_t	roc;
+	uint16_t	seq;
+	uint64_t	seen;
+};
+
+struct srtp {
+	const struct suite	*suite;
+	unsigned char		 salt[14];	/* session salt */
+	EVP_CIPHER_CTX		*enc;		/* keyed with the session key */
+	EVP_CIPHER_CTX		*dec;		/* only for GCM */
+	EVP_MD_CTX		*inner;		/* HMAC with key ^ ipad */
+	EVP_MD_CTX		*outer;		/* HMAC with key ^ opad */
+	EVP_MD_CTX		*md;
+	struct ssrc		*ssrcs;		/* open addressing */
+	uint32_t		 size;		/* a power of two */
+	uint32_t		 count;
+};
+
+static const EVP_CIPHER*
+ctr(const struct suite *su)
+{
+	return su->keylen == 32 ? EVP_aes_256_ctr() : EVP_aes_128_ctr();
+}
+
+static const EVP_CIPHER*
+gcm(const struct suite *su)
+{
+	return su->keylen == 32 ? EVP_aes_256_gcm() : EVP_aes_128_gcm();
+}
+
+/* Decode base64 into at most size bytes.
+ * Return the number of bytes, or -1 for error. */
+static ssize_t
+unbase64(const char *s, size_t n, unsigned char *out, size_t size)
+{
+	static const char b64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const char *c;
+	uint32_t bits = 0;
+	unsigned nbits = 0;
+	size_t len = 0;
+	for (; n && *s != '='; s++, n--) {
+		if ((c = strchr(b64, *s)) == NULL || *s == '\0')
+			return -1;
+		bits = bits << 6 | (c - b64);
+		if ((nbits += 6) >= 8) {
+			if (len == size)
+				return -1;
+			out[len++] = bits >> (nbits -= 8);
+		}
+	}
+	return len;
+}
+
+/* Derive a session key from the master key and salt with the AES-CM
+ * PRF of RFC 3711 4.3.3: the label goes into the salt, as the index
+ * divided by a key derivation rate of zero is zero.
+ * Return 0 for success, -1 for error. */
+static int
+derive(const struct suite *su, const unsigned char *mkey,
+	const unsigned char *msalt, unsigned label,
+	unsigned char *out, int len)
+{
+	unsigned char iv[16], zero[32];
+	EVP_CIPHER_CTX *ctx;
+	int n, rv = -1;
+	memset(iv, 0, sizeof(iv));
+	memset(zero, 0, sizeof(zero));
+	memcpy(iv, msalt, su->saltlen);
+	iv[7] ^= label;
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+		return -1;
+	if (EVP_EncryptInit_ex(ctx, ctr(su), NULL, mkey, iv)
+	&& EVP_EncryptUpdate(ctx, out, &n, zero, len))
+		rv = 0;
+	EVP_CIPHER_CTX_free(ctx);
+	return rv;
+}
+
+/* Set up the session from the master key and salt.
+ * Return 0 for success, -1 for error. */
+static int
+session(struct srtp *s, const unsigned char *mkey, const unsigned char *msalt)
+{
+	const struct suite *su = s->suite;
+	unsigned char key[32], auth[SHA1LEN], pad[SHA1BLOCK];
+	unsigned i;
+	int rv = -1;
+	if (derive(su, mkey, msalt, 0, key, su->keylen) == -1
+	|| derive(su, mkey, msalt, 2, s->salt, su->saltlen) == -1
+	|| (s->enc = EVP_CIPHER_CTX_new()) == NULL)
+		goto done;
+	if (su->gcm) {
+		if ((s->dec = EVP_CIPHER_CTX_new()) == NULL
+		|| !EVP_EncryptInit_ex(s->enc, gcm(su), NULL, key, NULL)
+		|| !EVP_DecryptInit_ex(s->dec, gcm(su), NULL, key, NULL))
+			goto done;
+		rv = 0;
+		goto done;
+	}
+	if (!EVP_EncryptInit_ex(s->enc, ctr(su), NULL, key, NULL)
+	|| derive(su, mkey, msalt, 1, auth, SHA1LEN) == -1
+	|| (s->inner = EVP_MD_CTX_new()) == NULL
+	|| (s->outer = EVP_MD_CTX_new()) == NULL
+	|| (s->md = EVP_MD_CTX_new()) == NULL)
+		goto done;
+	/* HMAC (RFC 2104), with the padded key hashed once. */
+	memset(pad, 0x36, sizeof(pad));
+	for (i = 0; i < SHA1LEN; i++)
+		pad[i] ^= auth[i];
+	if (!EVP_DigestInit_ex(s->inner, EVP_sha1(), NULL)
+	|| !EVP_DigestUpdate(s->inner, pad, sizeof(pad)))
+		goto done;
+	memset(pad, 0x5c, sizeof(pad));
+	for (i = 0; i < SHA1LEN; i++)
+		pad[i] ^= auth[i];
+	if (!EVP_DigestInit_ex(s->outer, EVP_sha1(), NULL)
+	|| !EVP_DigestUpdate(s->outer, pad, sizeof(pad)))
+		goto done;
+	rv = 0;
+done:
+	OPENSSL_cleanse(key, sizeof(key));
+	OPENSSL_cleanse(auth, sizeof(auth));
+	OPENSSL_cleanse(pad, sizeof(pad));
+	return rv;
+}
+
+/* Parse a key line: "[a=crypto:tag] suite inline:key[|lifetime]".
+ * Return 0 for success, -1 for error. */
+static int
+keyline(struct srtp *s, char *line, unsigned char *master, size_t size)
+{
+	const struct suite *su;
+	char *suite, *key, *end;
+	ssize_t len;
+	if (strncmp(line, "a=crypto:", 9) == 0) {
+		line += 9;
+		while (isdigit((unsigned char) *line))
+			line++;
+	}
+	suite = line + strspn(line, " \t");
+	line = suite + strcspn(suite, " \t");
+	if (*line)
+		*line++ = '\0';
+	line += strspn(line, " \t");
+	for (su = suites; su->name; su++)
+		if (strcmp(su->name, suite) == 0)
+			break;
+	if (su->name == NULL) {
+		warnx("unknown SRTP suite: %s", suite);
+		return -1;
+	}
+	if (strncmp(line, "inline:", 7)) {
+		warnx("SRTP key needs to be inline:");
+		return -1;
+	}
+	key = line + 7;
+	end = key + strcspn(key, "| \t\r\n");
+	if (*end == '|' && strpbrk(end + 1, "|:")) {
+		warnx("SRTP key with an MKI is not supported");
+		return -1;
+	}
+	len = unbase64(key, end - key, master, size);
+	if (len != (ssize_t) (su->keylen + su->saltlen)) {
+		warnx("SRTP key of %s needs %u bytes", su->name,
+			su->keylen + su->saltlen);
+		return -1;
+	}
+	s->suite = su;
+	return 0;
+}
+
+/* Read the master key of the session from the first line of the file
+ * that is not empty or a comment, and derive the session keys.
+ * Return the session, or NULL for error. */
+struct srtp*
+srtp_open(const char *path)
+{
+	unsigned char master[64];
+	char line[512], *p;
+	struct srtp *s;
+	FILE *f;
+	int rv = -1;
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		warn(NULL);
+		return NULL;
+	}
+	if ((f = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		free(s);
+		return NULL;
+	}
+	while ((p = fgets(line, sizeof(line), f))) {
+		p += strspn(p, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+		if (keyline(s, p, master, sizeof(master)) == 0) {
+			if ((rv = session(s, master,
+			master + s->suite->keylen)) == -1)
+				warnx("%s: cannot set up SRTP", path);
+		}
+		break;
+	}
+	if (p == NULL)
+		warnx("%s: no SRTP key", path);
+	OPENSSL_cleanse(master, sizeof(master));
+	OPENSSL_cleanse(line, sizeof(line));
+	fclose(f);
+	if (rv == -1) {
+		srtp_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+static uint32_t
+hash(uint32_t ssrc, uint32_t size)
+{
+	return (ssrc * 0x9e3779b1U) & (size - 1);
+}
+
+/* Find what we know of the SSRC.
+ * Return the SSRC, or NULL if not known. */
+static struct ssrc*
+find(struct srtp *s, uint32_t ssrc)
+{
+	uint32_t h;
+	if (s->size == 0)
+		return NULL;
+	for (h = hash(ssrc, s->size); s->ssrcs[h].used;
+	h = (h + 1) & (s->size - 1))
+		if (s->ssrcs[h].ssrc == ssrc)
+			return &s->ssrcs[h];
+	return NULL;
+}
+
+/* Make the SSRC known, which it is not yet.
+ * Return the SSRC, or NULL for error. */
+static struct ssrc*
+add(struct srtp *s, uint32_t ssrc)
+{
+	struct ssrc *t, *x;
+	uint32_t h, i, size;
+	if (4 * ((uint64_t) s->count + 1) > 3 * (uint64_t) s->size) {
+		size = s->size ? 2 * s->size : 64;
+		if ((t = calloc(size, sizeof(*t))) == NULL) {
+			warn(NULL);
+			return NULL;
+		}
+		for (i = 0; i < s->size; i++) {
+			if (!s->ssrcs[i].used)
+				continue;
+			for (h = hash(s->ssrcs[i].ssrc, size); t[h].used;
+			h = (h + 1) & (size - 1))
+				;
+			t[h] = s->ssrcs[i];
+		}
+		free(s->ssrcs);
+		s->ssrcs = t;
+		s->size = size;
+	}
+	for (h = hash(ssrc, s->size); s->ssrcs[h].used;
+	h = (h + 1) & (s->size - 1))
+		;
+	x = &s->ssrcs[h];
+	x->ssrc = ssrc;
+	x->used = 1;
+	s->count++;
+	return x;
+}
+
+/* Guess the rollover counter of the packet (RFC 3711 3.3.1). */
+static uint32_t
+guess(const struct ssrc *x, uint16_t seq)
+{
+	if (x->seq < 32768)
+		return (int) seq - x->seq > 32768 && x->roc
+			? x->roc - 1 : x->roc;
+	return x->seq - 32768 > seq ? x->roc + 1 : x->roc;
+}
+
+/* Note the index of a packet, once it is known to be good. */
+static void
+update(struct ssrc *x, uint32_t roc, uint16_t seq)
+{
+	uint64_t top = (uint64_t) x->roc << 16 | x->seq;
+	uint64_t idx = (uint64_t) roc << 16 | seq;
+	if (idx > top) {
+		x->seen = idx - top < SRTPWINDOW ? x->seen << (idx - top) : 0;
+		x->seen |= 1;
+		x->roc = roc;
+		x->seq = seq;
+	} else if (top - idx < SRTPWINDOW)
+		x->seen |= (uint64_t) 1 << (top - idx);
+}
+
+/* Has a packet with this index been seen, or is it too old to tell? */
+static int
+replayed(const struct ssrc *x, uint32_t roc, uint16_t seq)
+{
+	uint64_t top = (uint64_t) x->roc << 16 | x->seq;
+	uint64_t idx = (uint64_t) roc << 16 | seq;
+	if (idx > top)
+		return 0;
+	if (top - idx >= SRTPWINDOW)
+		return 1;
+	return (x->seen >> (top - idx)) & 1;
+}
+
+/* Make the IV of a packet: with AES-CM, the session salt
+ * XORed with the SSRC and the index, shifted by 16 bits;
+ * with GCM, the session salt XORed with the SSRC, ROC and SEQ. */
+static void
+mkiv(const struct srtp *s, unsigned char *iv, const unsigned char *pkt,
+	uint32_t roc)
+{
+	unsigned i, off = s->suite->gcm ? 2 : 4;
+	memset(iv, 0, 16);
+	memcpy(iv + off, pkt + 8, 4);
+	iv[off + 4] = roc >> 24;
+	iv[off + 5] = roc >> 16;
+	iv[off + 6] = roc >> 8;
+	iv[off + 7] = roc;
+	iv[off + 8] = pkt[2];
+	iv[off + 9] = pkt[3];
+	for (i = 0; i < s->suite->saltlen; i++)
+		iv[i] ^= s->salt[i];
+}
+
+/* Compute the HMAC-SHA1 of len bytes and the ROC.
+ * Return 0 for success, -1 for error. */
+static int
+hmac(struct srtp *s, const unsigned char *buf, size_t len, uint32_t roc,
+	unsigned char *mac)
+{
+	unsigned char r[4], in[SHA1LEN];
+	r[0] = roc >> 24;
+	r[1] = roc >> 16;
+	r[2] = roc >> 8;
+	r[3] = roc;
+	if (!EVP_MD_CTX_copy_ex(s->md, s->inner)
+	|| !EVP_DigestUpdate(s->md, buf, len)
+	|| !EVP_DigestUpdate(s->md, r, sizeof(r))
+	|| !EVP_DigestFinal_ex(s->md, in, NULL)
+	|| !EVP_MD_CTX_copy_ex(s->md, s->outer)
+	|| !EVP_DigestUpdate(s->md, in, sizeof(in))
+	|| !EVP_DigestFinal_ex(s->md, mac, NULL))
+		return -1;
+	return 0;
+}
+
+/* Encrypt the RTP packet of len bytes, with a header of hlen bytes,
+ * and append the authentication tag; the buffer must have room
+ * for it, see SRTPTAG. The packet must have a whole RTP header.
+ * Return the length of the SRTP packet, or -1 for error. */
+ssize_t
+srtp_protect(struct srtp *s, unsigned char *pkt, size_t hlen, size_t len)
+{
+	const struct suite *su = s->suite;
+	unsigned char iv[16], mac[SHA1LEN];
+	uint16_t seq = pkt[2] << 8 | pkt[3];
+	uint32_t ssrc = (uint32_t) pkt[8] << 24
+		| pkt[9] << 16 | pkt[10] << 8 | pkt[11];
+	struct ssrc *x;
+	uint32_t roc;
+	int n;
+	if (hlen > len
+	|| ((x = find(s, ssrc)) == NULL && (x = add(s, ssrc)) == NULL))
+		return -1;
+	if (x->seen == 0)
+		x->seq = seq;
+	update(x, roc = guess(x, seq), seq);
+	mkiv(s, iv, pkt, roc);
+	if (su->gcm) {
+		if (!EVP_EncryptInit_ex(s->enc, NULL, NULL, NULL, iv)
+		|| !EVP_EncryptUpdate(s->enc, NULL, &n, pkt, hlen)
+		|| !EVP_EncryptUpdate(s->enc, pkt + hlen, &n,
+			pkt + hlen, len - hlen)
+		|| !EVP_EncryptFinal_ex(s->enc, pkt + len, &n)
+		|| !EVP_CIPHER_CTX_ctrl(s->enc, EVP_CTRL_GCM_GET_TAG,
+			su->taglen, pkt + len))
+			return -1;
+		return len + su->taglen;
+	}
+	if (!EVP_EncryptInit_ex(s->enc, NULL, NULL, NULL, iv)
+	|| !EVP_EncryptUpdate(s->enc, pkt + hlen, &n, pkt + hlen, len - hlen)
+	|| hmac(s, pkt, len, roc, mac) == -1)
+		return -1;
+	memcpy(pkt + len, mac, su->taglen);
+	return len + su->taglen;
+}
+
+/* Authenticate and decrypt the SRTP packet of len bytes,
+ * with a header of hlen bytes, which must be whole.
+ * An SSRC not known yet only becomes known with a packet
+ * that is authentic, so that forged ones take no memory.
+ * Return the length of the RTP packet, -1 if it is not authentic,
+ * or -2 if it has been seen before. */
+ssize_t
+srtp_unprotect(struct srtp *s, unsigned char *pkt, size_t hlen, size_t len)
+{
+	const struct suite *su = s->suite;
+	unsigned char iv[16], mac[SHA1LEN];
+	uint16_t seq = pkt[2] << 8 | pkt[3];
+	uint32_t ssrc = (uint32_t) pkt[8] << 24
+		| pkt[9] << 16 | pkt[10] << 8 | pkt[11];
+	struct ssrc *x, new;
+	uint32_t roc;
+	int n;
+	if (len < hlen + su->taglen)
+		return -1;
+	if ((x = find(s, ssrc)) == NULL) {
+		memset(&new, 0, sizeof(new));
+		new.ssrc = ssrc;
+		new.seq = seq;
+		x = &new;
+	} else if (x->seen == 0)
+		x->seq = seq;
+	roc = guess(x, seq);
+	if (x->seen && replayed(x, roc, seq))
+		return -2;
+	len -= su->taglen;
+	mkiv(s, iv, pkt, roc);
+	if (su->gcm) {
+		if (!EVP_DecryptInit_ex(s->dec, NULL, NULL, NULL, iv)
+		|| !EVP_DecryptUpdate(s->dec, NULL, &n, pkt, hlen)
+		|| !EVP_DecryptUpdate(s->dec, pkt + hlen, &n,
+			pkt + hlen, len - hlen)
+		|| !EVP_CIPHER_CTX_ctrl(s->dec, EVP_CTRL_GCM_SET_TAG,
+			su->taglen, pkt + len)
+		|| EVP_DecryptFinal_ex(s->dec, pkt + len, &n) <= 0)
+			return -1;
+	} else {
+		if (hmac(s, pkt, len, roc, mac) == -1
+		|| CRYPTO_memcmp(mac, pkt + len, su->taglen)
+		|| !EVP_EncryptInit_ex(s->enc, NULL, NULL, NULL, iv)
+		|| !EVP_EncryptUpdate(s->enc, pkt + hlen, &n,
+			pkt + hlen, len - hlen))
+			return -1;
+	}
+	if (x == &new) {
+		if ((x = add(s, ssrc)) == NULL)
+			return -1;
+		x->seq = seq;
+	}
+	update(x, roc, seq);
+	return len;
+}
+
+void
+srtp_close(struct srtp *s)
+{
+	if (s == NULL)
+		return;
+	EVP_CIPHER_CTX_free(s->enc);
+	EVP_CIPHER_CTX_free(s->dec);
+	EVP_MD_CTX_free(s->inner);
+	EVP_MD_CTX_free(s->outer);
+	EVP_MD_CTX_free(s->md);
+	OPENSSL_cleanse(s->salt, sizeof(s->salt));
+	free(s->ssrcs);
+	free(s);
+}
+
+#else
+
+struct srtp*
+srtp_open(const char *path)
+{
+	warnx("SRTP needs libcrypto");
+	return NULL;
+}
+
+ssize_t
+srtp_protect(struct srtp *s, unsigned char *pkt, size_t hlen, size_t len)
+{
+	return -1;
+}
+
+ssize_t
+srtp_unprotect(struct srtp *s, unsigned char *pkt, size_t hlen, size_t len)
+{
+	return -1;
+}
+
+void
+srtp_close(struct srtp *s)
+{
+}
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* SRTP (RFC 3711): encrypting and authenticating RTP packets
+ * with a master key and salt given as in SDES (RFC 4568),
+ * one line of the form "[a=crypto:tag] suite inline:key[|lifetime]"
+ * in a key file. The suites are AES_CM_128_HMAC_SHA1_80 and _32,
+ * AES_256_CM_HMAC_SHA1_80 and _32 (RFC 6188), AEAD_AES_128_GCM
+ * and AEAD_AES_256_GCM (RFC 7714). The session keys are derived once,
+ * as with a key derivation rate of zero; each SSRC then has its own
+ * rollover counter and replay window. The ciphers are those of
+ * libcrypto, which uses the AES instructions of the CPU if it has them. */
+
+#define SRTPTAG		16	/* bytes of authentication tag at most */
+#define SRTPWINDOW	64	/* packets of the replay window */
+
+struct srtp;
+
+struct srtp	*srtp_open	(const char*);
+ssize_t		 srtp_protect	(struct srtp*, unsigned char*,
+				 size_t, size_t);
+ssize_t		 srtp_unprotect	(struct srtp*, unsigned char*,
+				 size_t, size_t);
+void		 srtp_close	(struct srtp*);
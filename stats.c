@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/time.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <err.h>
+
+#include "stats.h"
+
+#define DUE_FILE	1	/* time to rewrite the stats file */
+#define DUE_PRINT	2	/* SIGUSR1: print to stderr */
+
+/* Sequence numbers are followed for this many sources at most.
+ * A jump further than MAXDROPOUT ahead or MAXMISORDER back
+ * is taken for a restart of the source (RFC 3550, A.1). */
+#define SEQSOURCES	256
+#define MAXDROPOUT	3000
+#define MAXMISORDER	100
+
+struct source {
+	uint32_t	ssrc;
+	uint16_t	next;	/* the seq number expected */
+	int		used;
+};
+
+static struct source sources[SEQSOURCES];
+
+struct stats stats;
+volatile sig_atomic_t statsdue = 0;
+
+static const char *statsfile = NULL;
+static uint64_t statsstart;
+
+static void
+onsignal(int sig)
+{
+	statsdue |= (sig == SIGUSR1) ? DUE_PRINT : DUE_FILE;
+}
+
+/* Return the current CLOCK_MONOTONIC time in nsec. */
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Follow the sequence numbers of a source, counting the packets
+ * missing between them as lost, and those coming after a later one
+ * as late (so a packet that is merely reordered counts as both). */
+void
+stats_seq(uint32_t ssrc, uint16_t seq)
+{
+	int16_t d;
+	unsigned i, n;
+	struct source *s = NULL;
+	stats.rxseq++;
+	for (i = (ssrc * 0x9e3779b1U) >> 24, n = 0; n < SEQSOURCES; n++) {
+		s = &sources[(i + n) % SEQSOURCES];
+		if (!s->used || s->ssrc == ssrc)
+			break;
+	}
+	if (n == SEQSOURCES)
+		return;
+	if (!s->used) {
+		s->used = 1;
+		s->ssrc = ssrc;
+		s->next = seq + 1;
+		return;
+	}
+	d = seq - s->next;
+	if (d >= 0 && d < MAXDROPOUT) {
+		stats.rxlost += d;
+		s->next = seq + 1;
+	} else if (d < 0 && d >= -MAXMISORDER) {
+		stats.rxlate++;
+	} else {
+		s->next = seq + 1;
+	}
+}
+
+/* Start counting. Print the stats to stderr on SIGUSR1;
+ * if 'file' is given, also rewrite it every 'interval' seconds.
+ * Return 0 for success, -1 for error. */
+int
+stats_init(const char *file, unsigned interval)
+{
+	struct sigaction sa;
+	struct itimerval it;
+	memset(&stats, 0, sizeof(stats));
+	memset(sources, 0, sizeof(sources));
+	hist_init(&stats.late);
+	hist_init(&stats.delay);
+	hist_init(&stats.batch);
+	hist_init(&stats.fanout);
+	statsstart = stats_now();
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onsignal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+		warn("sigaction");
+		return -1;
+	}
+	if ((statsfile = file) == NULL || interval == 0)
+		return 0;
+	if (sigaction(SIGALRM, &sa, NULL) == -1) {
+		warn("sigaction");
+		return -1;
+	}
+	memset(&it, 0, sizeof(it));
+	it.it_interval.tv_sec = it.it_value.tv_sec = interval;
+	if (setitimer(ITIMER_REAL, &it, NULL) == -1) {
+		warn("setitimer");
+		return -1;
+	}
+	return 0;
+}
+
+/* Print the stats as "name value" lines. */
+void
+stats_print(FILE *f)
+{
+	fprintf(f, "uptime %.3f\n", (stats_now() - statsstart) / 1e9);
+	fprintf(f, "rx.packets %llu\n", (unsigned long long) stats.rxpkts);
+	fprintf(f, "rx.bytes %llu\n", (unsigned long long) stats.rxbytes);
+	fprintf(f, "rx.skipped %llu\n", (unsigned long long) stats.rxskip);
+	if (stats.rxfilt)
+		fprintf(f, "rx.filtered %llu\n",
+			(unsigned long long) stats.rxfilt);
+	fprintf(f, "rx.badheader %llu\n", (unsigned long long) stats.rxbad);
+	fprintf(f, "rx.truncated %llu\n", (unsigned long long) stats.rxtrunc);
+	if (stats.rxauth || stats.rxreplay) {
+		fprintf(f, "rx.unauthentic %llu\n",
+			(unsigned long long) stats.rxauth);
+		fprintf(f, "rx.replayed %llu\n",
+			(unsigned long long) stats.rxreplay);
+	}
+	if (stats.rxseq) {
+		fprintf(f, "rx.lost %llu\n",
+			(unsigned long long) stats.rxlost);
+		fprintf(f, "rx.late %llu\n",
+			(unsigned long long) stats.rxlate);
+		fprintf(f, "rx.dropped %llu\n",
+			(unsigned long long) stats.rxkdrop);
+	}
+	if (stats.rxoverrun)
+		fprintf(f, "rx.overrun %llu\n",
+			(unsigned long long) stats.rxoverrun);
+	if (stats.implost || stats.impdup || stats.impreorder
+	|| stats.impdelay || stats.impfull) {
+		fprintf(f, "imp.lost %llu\n",
+			(unsigned long long) stats.implost);
+		fprintf(f, "imp.duplicated %llu\n",
+			(unsigned long long) stats.impdup);
+		fprintf(f, "imp.reordered %llu\n",
+			(unsigned long long) stats.impreorder);
+		fprintf(f, "imp.delayed %llu\n",
+			(unsigned long long) stats.impdelay);
+		fprintf(f, "imp.full %llu\n",
+			(unsigned long long) stats.impfull);
+	}
+	fprintf(f, "tx.packets %llu\n", (unsigned long long) stats.txpkts);
+	fprintf(f, "tx.bytes %llu\n", (unsigned long long) stats.txbytes);
+	fprintf(f, "tx.errors %llu\n", (unsigned long long) stats.txerr);
+	fprintf(f, "tx.short %llu\n", (unsigned long long) stats.txshort);
+	fprintf(f, "tx.late %llu\n", (unsigned long long) stats.txlate);
+	if (stats.txdrop)
+		fprintf(f, "tx.dropped %llu\n",
+			(unsigned long long) stats.txdrop);
+	if (stats.txslow)
+		fprintf(f, "tx.slowreaders %llu\n",
+			(unsigned long long) stats.txslow);
+	if (stats.subjoin || stats.subrefuse) {
+		fprintf(f, "sub.joined %llu\n",
+			(unsigned long long) stats.subjoin);
+		fprintf(f, "sub.left %llu\n",
+			(unsigned long long) stats.subleave);
+		fprintf(f, "sub.idle %llu\n",
+			(unsigned long long) stats.subidle);
+		fprintf(f, "sub.refused %llu\n",
+			(unsigned long long) stats.subrefuse);
+		fprintf(f, "sub.missed %llu\n",
+			(unsigned long long) stats.submiss);
+	}
+	hist_print(f, "hist.late.usec", &stats.late, 1e3);
+	hist_print(f, "hist.delay.usec", &stats.delay, 1e3);
+	hist_print(f, "hist.batch", &stats.batch, 1);
+	if (stats.fanout.count)
+		hist_print(f, "hist.fanout", &stats.fanout, 1);
+}
+
+/* Write the stats into the stats file. Write a temporary file
+ * and rename it, so that readers never see a partial file. */
+static void
+stats_write(void)
+{
+	FILE *f;
+	char tmp[PATH_MAX];
+	if (statsfile == NULL)
+		return;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", statsfile) >= PATH_MAX) {
+		warnx("%s: name too long", statsfile);
+		return;
+	}
+	if ((f = fopen(tmp, "w")) == NULL) {
+		warn("%s", tmp);
+		return;
+	}
+	fprintf(f, "time %lld\n", (long long) time(NULL));
+	stats_print(f);
+	if (fclose(f) == EOF || rename(tmp, statsfile) == -1)
+		warn("%s", statsfile);
+}
+
+/* Do whatever the signals asked for since the last time. */
+void
+stats_flush(void)
+{
+	sig_atomic_t due = statsdue;
+	statsdue = 0;
+	if (due & DUE_PRINT)
+		stats_print(stderr);
+	if (due & DUE_FILE)
+		stats_write();
+}
+
+/* Write the final stats, and print them if asked to. */
+void
+stats_exit(int print)
+{
+	struct itimerval it;
+	memset(&it, 0, sizeof(it));
+	setitimer(ITIMER_REAL, &it, NULL);
+	stats_write();
+	if (print)
+		stats_print(stderr);
+}
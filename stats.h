@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "hist.h"
+
+/* A packet sent later than this (nsec) after its time counts as late. */
+#define STATSLATE 1000000
+
+/* Runtime counters of the packet path. These are plain
+ * increments done by the one thread that moves the packets,
+ * except the input batches, which the input thread counts
+ * with -O pipeline; they are only read when printing the stats. */
+struct stats {
+	uint64_t	rxpkts;		/* packets read from the input */
+	uint64_t	rxbytes;
+	uint64_t	rxskip;		/* records skipped as not RTP */
+	uint64_t	rxfilt;		/* records not matching the filter */
+	uint64_t	rxbad;		/* packets with a bad RTP header */
+	uint64_t	rxtrunc;	/* packets truncated in the dump */
+	uint64_t	rxseq;		/* packets with their seq tracked */
+	uint64_t	rxlost;		/* missing from the seq numbers */
+	uint64_t	rxlate;		/* came after a later seq number */
+	uint64_t	rxkdrop;	/* dropped by the kernel */
+	uint64_t	rxauth;		/* SRTP failing authentication */
+	uint64_t	rxreplay;	/* SRTP seen before */
+	uint64_t	rxoverrun;	/* written over before we read them */
+	uint64_t	implost;	/* lost by the impairment */
+	uint64_t	impdup;		/* duplicated by the impairment */
+	uint64_t	impreorder;	/* sent ahead of the delayed ones */
+	uint64_t	impdelay;	/* delayed by the impairment */
+	uint64_t	impfull;	/* that could not be held back */
+	uint64_t	txpkts;		/* packets written to the output */
+	uint64_t	txbytes;
+	uint64_t	txerr;		/* failed writes */
+	uint64_t	txshort;	/* short writes */
+	uint64_t	txlate;		/* sent later than STATSLATE */
+	uint64_t	txdrop;		/* dropped with the writer behind */
+	uint64_t	txslow;		/* readers that fell a ring behind */
+	uint64_t	subjoin;	/* subscribers that came */
+	uint64_t	subleave;	/* subscribers that said goodbye */
+	uint64_t	subidle;	/* subscribers that went silent */
+	uint64_t	subrefuse;	/* subscribers refused past the limit */
+	uint64_t	submiss;	/* packets missed for a full buffer */
+	struct hist	late;		/* nsec after the packet's time */
+	struct hist	delay;		/* nsec from recv to write */
+	struct hist	batch;		/* packets per input wakeup */
+	struct hist	fanout;		/* subscribers per send call */
+};
+
+extern struct stats stats;
+extern volatile sig_atomic_t statsdue;
+
+#define STATS_CHECK()	do { if (statsdue) stats_flush(); } while (0)
+
+int		stats_init	(const char*, unsigned);
+void		stats_flush	(void);
+void		stats_print	(FILE*);
+void		stats_exit	(int);
+uint64_t	stats_now	(void);
+void		stats_seq	(uint32_t, uint16_t);
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "stats.h"
+#include "trace.h"
+
+#define TRACELEN	(sizeof(struct tracehdr) \
+			+ TRACEEVENTS * sizeof(struct traceevent))
+
+struct trace {
+	struct tracehdr		*hdr;
+	struct traceevent	*ev;
+	uint64_t		 head;
+	uint64_t		 zero;	/* stats_now() at ns 0 */
+};
+
+/* Create the trace file at path, with the stages named
+ * by the NULL-terminated names, up to TRACESTAGES of them.
+ * Return NULL on error. */
+struct trace*
+trace_open(const char *path, const char *const *names)
+{
+	struct timespec ts;
+	struct trace *t;
+	unsigned i;
+	void *map;
+	int fd;
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		warn("%s", path);
+		return NULL;
+	}
+	if (ftruncate(fd, TRACELEN) == -1) {
+		warn("%s", path);
+		close(fd);
+		return NULL;
+	}
+#if HAVE_FALLOCATE
+	/* Have the blocks now, not a SIGBUS on a full disk later. */
+	if (fallocate(fd, 0, 0, TRACELEN) == -1 && errno != EOPNOTSUPP)
+		warn("%s: fallocate", path);
+#endif
+	map = mmap(NULL, TRACELEN, PROT_READ | PROT_WRITE, MAP_SHARED
+#ifdef MAP_POPULATE
+		| MAP_POPULATE
+#endif
+		, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("%s", path);
+		return NULL;
+	}
+	if ((t = calloc(1, sizeof(*t))) == NULL) {
+		warn(NULL);
+		munmap(map, TRACELEN);
+		return NULL;
+	}
+	t->hdr = map;
+	t->ev = (struct traceevent*) (t->hdr + 1);
+	t->hdr->size = sizeof(struct traceevent);
+	t->hdr->events = TRACEEVENTS;
+	for (i = 0; names[i] && i < TRACESTAGES; i++)
+		strncpy(t->hdr->stage[i], names[i], TRACENAME - 1);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	t->zero = stats_now();
+	t->hdr->start = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	memcpy(t->hdr->magic, TRACEMAGIC, sizeof(t->hdr->magic));
+	return t;
+}
+
+/* Take the next event of the ring, for what happened at the stage
+ * at the time now of stats_now(); the caller fills in the packet.
+ * The head in the file says how far the events are filled in,
+ * so it moves on by the previous one. */
+struct traceevent*
+trace_add(struct trace *t, uint64_t now, int what, int stage)
+{
+	struct traceevent *e;
+	if (t->head)
+		__atomic_store_n(&t->hdr->head, t->head, __ATOMIC_RELEASE);
+	e = &t->ev[t->head++ % TRACEEVENTS];
+	e->ns = now - t->zero;
+	e->what = what;
+	e->stage = stage;
+	return e;
+}
+
+void
+trace_close(struct trace *t)
+{
+	if (t == NULL)
+		return;
+	__atomic_store_n(&t->hdr->head, t->head, __ATOMIC_RELEASE);
+	munmap(t->hdr, TRACELEN);
+	free(t);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Tracing the packets through the stages: each packet read in,
+ * left out by a stage, or written out is an event of a fixed size,
+ * put in a ring of events mapped from a file, with no system call
+ * and no formatting, so that the tracing can stay on under load.
+ * Once the ring is full, the newest events take the place of the
+ * oldest. The file is in the byte order of the machine that wrote
+ * it; rtptrace prints it, during or after the run. */
+
+#define TRACEMAGIC	"RTPTRC1"
+#define TRACEEVENTS	(1 << 20)	/* events in the ring */
+#define TRACESTAGES	16		/* stages named in the file */
+#define TRACENAME	12		/* bytes of a stage name */
+
+#define TRACE_IN	0		/* read from the input */
+#define TRACE_DROP	1		/* left out by the stage */
+#define TRACE_PASS	2		/* let go of by the stage */
+#define TRACE_OUT	3		/* written to the output */
+
+#define TRACE_RTP	0x01		/* the RTP fields are valid */
+#define TRACE_MARKER	0x02		/* the marker bit is set */
+
+struct traceevent {
+	uint64_t	ns;		/* since the start of the trace */
+	uint32_t	batch;		/* read from the input together */
+	uint32_t	msec;		/* the time of the packet */
+	uint32_t	ssrc;
+	uint32_t	ts;
+	uint16_t	seq;
+	uint16_t	len;		/* of the packet, as captured */
+	uint8_t		what;		/* TRACE_IN, ... */
+	uint8_t		stage;		/* index into the stage names */
+	uint8_t		pt;
+	uint8_t		flags;		/* TRACE_RTP, TRACE_MARKER */
+};
+
+struct tracehdr {
+	char		magic[8];
+	uint32_t	size;		/* of an event */
+	uint32_t	events;		/* in the ring */
+	uint64_t	head;		/* events written so far */
+	uint64_t	start;		/* nsec since the epoch at ns 0 */
+	char		stage[TRACESTAGES][TRACENAME];
+	char		pad[32];
+};
+
+struct trace;
+
+struct trace		*trace_open	(const char*, const char *const*);
+struct traceevent	*trace_add	(struct trace*, uint64_t, int, int);
+void			 trace_close	(struct trace*);
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "format-dump.h"
+#include "uring.h"
+
+#if HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "stats.h"
+
+/* There are three queues of requests: receiving datagrams from
+ * a socket, reading a dump file ahead, and writing the output file
+ * behind. Each has depth slots, with a buffer of URINGCHUNK bytes;
+ * the buffer of slot i of queue k is registered as buffer k*depth+i,
+ * which is also what the request of the slot carries as user data.
+ *
+ * Received datagrams are taken in the order they complete.
+ * The dump file is read in chunks at consecutive offsets,
+ * and the chunks are taken in that order. The output is written
+ * into one slot until it fills up (or until we are about to wait
+ * for the net), then it is written out at its offset while we go
+ * on filling the next slot; we only wait for a write to complete
+ * when we come around to its slot again. */
+
+enum { UR_RECV, UR_READ, UR_WRITE, UR_QUEUES };
+
+struct slot {
+	unsigned char	*buf;
+	size_t		 pos;	/* bytes taken (recv, read) or filled (write) */
+	off_t		 off;	/* file offset of the write */
+	int		 res;	/* result of the request */
+	int		 busy;	/* request in flight */
+};
+
+struct queue {
+	int		 fd;	/* -1 until first used */
+	int		 sync;	/* fd cannot be used this way */
+	int		 err;	/* errno of a failed write */
+	off_t		 off;	/* file offset of the next request */
+	unsigned	 next;	/* slot to take next (read, write) */
+	unsigned	*ready;	/* completed slots (recv) */
+	unsigned	 head;
+	unsigned	 tail;
+	int		 prev;	/* slot to receive into again (recv) */
+	struct slot	*slot;
+};
+
+static struct {
+	int		 fd;
+	unsigned	 depth;
+	unsigned	*sqhead;
+	unsigned	*sqtail;
+	unsigned	*sqarray;
+	unsigned	 sqmask;
+	unsigned	*cqhead;
+	unsigned	*cqtail;
+	unsigned	 cqmask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void		*sq;
+	void		*cq;
+	size_t		 sqlen;
+	size_t		 cqlen;
+	size_t		 sqeslen;
+	unsigned char	*pool;
+} ring = { .fd = -1 };
+
+static struct queue queue[UR_QUEUES];
+
+static void
+teardown(void)
+{
+	unsigned k;
+	if (ring.sqes && ring.sqes != MAP_FAILED)
+		munmap(ring.sqes, ring.sqeslen);
+	if (ring.cq && ring.cq != MAP_FAILED && ring.cq != ring.sq)
+		munmap(ring.cq, ring.cqlen);
+	if (ring.sq && ring.sq != MAP_FAILED)
+		munmap(ring.sq, ring.sqlen);
+	if (ring.fd != -1)
+		close(ring.fd);
+	for (k = 0; k < UR_QUEUES; k++) {
+		free(queue[k].slot);
+		free(queue[k].ready);
+	}
+	free(ring.pool);
+	memset(&ring, 0, sizeof(ring));
+	memset(queue, 0, sizeof(queue));
+	ring.fd = -1;
+}
+
+/* Set up the ring for depth requests of each kind,
+ * and register the buffers with the kernel.
+ * Return 0 for success, -1 for error. */
+int
+uring_init(unsigned depth)
+{
+	struct io_uring_params p;
+	struct iovec *iov = NULL;
+	unsigned char *sq, *cq;
+	unsigned k, i;
+	int e;
+	memset(&p, 0, sizeof(p));
+	if ((ring.fd = syscall(__NR_io_uring_setup, 4 * depth, &p)) == -1) {
+		warn("io_uring_setup");
+		return -1;
+	}
+	ring.depth = depth;
+	ring.sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cqlen > ring.sqlen)
+			ring.sqlen = ring.cqlen;
+		ring.cqlen = ring.sqlen;
+	}
+	ring.sq = mmap(NULL, ring.sqlen, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq == MAP_FAILED)
+		goto bad;
+	ring.cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? ring.sq
+		: mmap(NULL, ring.cqlen, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if (ring.cq == MAP_FAILED)
+		goto bad;
+	ring.sqes = mmap(NULL, ring.sqeslen, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto bad;
+	sq = ring.sq;
+	cq = ring.cq;
+	ring.sqhead  = (unsigned*) (sq + p.sq_off.head);
+	ring.sqtail  = (unsigned*) (sq + p.sq_off.tail);
+	ring.sqarray = (unsigned*) (sq + p.sq_off.array);
+	ring.sqmask  = *(unsigned*) (sq + p.sq_off.ring_mask);
+	ring.cqhead  = (unsigned*) (cq + p.cq_off.head);
+	ring.cqtail  = (unsigned*) (cq + p.cq_off.tail);
+	ring.cqmask  = *(unsigned*) (cq + p.cq_off.ring_mask);
+	ring.cqes    = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	if ((e = posix_memalign((void**) &ring.pool, getpagesize(),
+	UR_QUEUES * depth * URINGCHUNK))) {
+		errno = e;
+		goto bad;
+	}
+	if ((iov = calloc(UR_QUEUES * depth, sizeof(struct iovec))) == NULL)
+		goto bad;
+	for (k = 0; k < UR_QUEUES; k++) {
+		queue[k].fd = -1;
+		queue[k].prev = -1;
+		if ((queue[k].slot = calloc(depth, sizeof(struct slot))) == NULL
+		|| (queue[k].ready = calloc(depth, sizeof(unsigned))) == NULL)
+			goto bad;
+		for (i = 0; i < depth; i++) {
+			iov[k * depth + i].iov_base = queue[k].slot[i].buf =
+				ring.pool + (k * depth + i) * URINGCHUNK;
+			iov[k * depth + i].iov_len = URINGCHUNK;
+		}
+	}
+	if (syscall(__NR_io_uring_register, ring.fd,
+	IORING_REGISTER_BUFFERS, iov, UR_QUEUES * depth) == -1)
+		goto bad;
+	free(iov);
+	return 0;
+bad:
+	warn("io_uring");
+	free(iov);
+	teardown();
+	return -1;
+}
+
+/* Prepare a request for slot i of queue k. */
+static void
+prep(unsigned k, unsigned i, uint8_t op, off_t off, size_t len)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ring.sqtail;
+	unsigned idx = tail & ring.sqmask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = queue[k].fd;
+	sqe->off = off;
+	sqe->addr = (uintptr_t) queue[k].slot[i].buf;
+	sqe->len = len;
+	sqe->buf_index = k * ring.depth + i;
+	sqe->user_data = k * ring.depth + i;
+	ring.sqarray[idx] = idx;
+	__atomic_store_n(ring.sqtail, tail + 1, __ATOMIC_RELEASE);
+	queue[k].slot[i].busy = 1;
+}
+
+/* Submit the prepared requests, and maybe wait for a completion.
+ * Return 0 for success, -1 for error (including EINTR). */
+static int
+enter(int wait)
+{
+	unsigned n;
+	n = *ring.sqtail - __atomic_load_n(ring.sqhead, __ATOMIC_ACQUIRE);
+	if (n == 0 && !wait)
+		return 0;
+	if (syscall(__NR_io_uring_enter, ring.fd, n, wait ? 1 : 0,
+	wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1)
+		return -1;
+	return 0;
+}
+
+/* A write has completed: finish it if it was short. */
+static void
+wdone(struct slot *s, int res)
+{
+	struct queue *q = &queue[UR_WRITE];
+	size_t have = res < 0 ? 0 : res;
+	ssize_t w;
+	if (res < 0)
+		q->err = -res;
+	else while (have < s->pos) {
+		w = pwrite(q->fd, s->buf + have, s->pos - have, s->off + have);
+		if (w <= 0) {
+			q->err = w == -1 ? errno : EIO;
+			break;
+		}
+		have += w;
+	}
+	s->pos = 0;
+}
+
+/* Take the completions.
+ * Return the number of completions taken. */
+static unsigned
+reap(void)
+{
+	struct io_uring_cqe *cqe;
+	struct queue *q;
+	struct slot *s;
+	unsigned head, tail, k, i, n = 0;
+	head = *ring.cqhead;
+	tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, n++) {
+		cqe = &ring.cqes[head & ring.cqmask];
+		k = cqe->user_data / ring.depth;
+		i = cqe->user_data % ring.depth;
+		q = &queue[k];
+		s = &q->slot[i];
+		s->busy = 0;
+		s->res = cqe->res;
+		if (k == UR_RECV)
+			q->ready[q->tail++ % ring.depth] = i;
+		else if (k == UR_WRITE)
+			wdone(s, cqe->res);
+	}
+	__atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+/* Wait until the request of the slot completes.
+ * Return 0 for success, -1 for error. */
+static int
+await(struct slot *s)
+{
+	while (s->busy) {
+		if (reap())
+			continue;
+		if (enter(1) == -1 && errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/* Start using fd for queue k. A file must be seekable,
+ * as the requests in flight go to different offsets,
+ * starting at the current one. The receives and the reads
+ * are issued right away; the writes as they fill up.
+ * Return 0 for success, -1 if fd is to be used synchronously. */
+static int
+start(unsigned k, int fd)
+{
+	struct queue *q = &queue[k];
+	unsigned i;
+	if (q->fd == fd)
+		return q->sync ? -1 : 0;
+	q->fd = fd;
+	if (k != UR_RECV && (q->off = lseek(fd, 0, SEEK_CUR)) == -1) {
+		q->sync = 1;
+		return -1;
+	}
+	if (k == UR_WRITE)
+		return 0;
+	for (i = 0; i < ring.depth; i++) {
+		prep(k, i, IORING_OP_READ_FIXED, q->off, URINGCHUNK);
+		if (k == UR_READ)
+			q->off += URINGCHUNK;
+	}
+	return enter(0) == -1 && errno != EINTR ? -1 : 0;
+}
+
+/* Write out the slot being filled. */
+static void
+wsubmit(void)
+{
+	struct queue *q = &queue[UR_WRITE];
+	struct slot *s = &q->slot[q->next];
+	s->off = q->off;
+	prep(UR_WRITE, q->next, IORING_OP_WRITE_FIXED, s->off, s->pos);
+	q->off += s->pos;
+	q->next = (q->next + 1) % ring.depth;
+	enter(0);
+}
+
+/* Write out what we have, if anything. */
+static void
+wflush(void)
+{
+	struct queue *q = &queue[UR_WRITE];
+	struct slot *s;
+	if (q->fd == -1 || q->sync)
+		return;
+	s = &q->slot[q->next];
+	if (!s->busy && s->pos)
+		wsubmit();
+}
+
+/* Receive a datagram like recv(2). As the buffer of the returned
+ * datagram gets received into again on the next call, we do not
+ * wait for that, and wait only if no other datagram is ready;
+ * before that, we write out what we have.
+ * Return the datagram size, or -1 for error. */
+ssize_t
+uring_recv(int fd, void *buf, size_t len)
+{
+	struct queue *q = &queue[UR_RECV];
+	struct slot *s;
+	size_t n;
+	if (ring.fd == -1 || start(UR_RECV, fd) == -1)
+		return recv(fd, buf, len, 0);
+	if (q->prev != -1) {
+		prep(UR_RECV, q->prev, IORING_OP_READ_FIXED, 0, URINGCHUNK);
+		q->prev = -1;
+	}
+	if (q->head == q->tail) {
+		wflush();
+		while (q->head == q->tail)
+			if (reap() == 0 && enter(1) == -1)
+				return -1;
+		hist_add(&stats.batch, q->tail - q->head);
+	}
+	q->prev = q->ready[q->head++ % ring.depth];
+	s = &q->slot[q->prev];
+	if (s->res < 0) {
+		errno = -s->res;
+		return -1;
+	}
+	n = (size_t) s->res < len ? (size_t) s->res : len;
+	memcpy(buf, s->buf, n);
+	return n;
+}
+
+/* Copy the next n bytes of the file being read ahead.
+ * A read only comes back short at the end of the file,
+ * so a chunk which is not full is the last one.
+ * Return the number of bytes copied, or -1 for error. */
+static ssize_t
+rget(unsigned char *p, size_t n)
+{
+	struct queue *q = &queue[UR_READ];
+	struct slot *s;
+	size_t have = 0, m;
+	while (have < n) {
+		s = &q->slot[q->next];
+		if (await(s) == -1)
+			return -1;
+		if (s->res < 0) {
+			errno = -s->res;
+			warn("read");
+			return -1;
+		}
+		if (s->res == 0)
+			break;
+		if (s->pos == (size_t) s->res) {
+			s->pos = 0;
+			prep(UR_READ, q->next, IORING_OP_READ_FIXED,
+				q->off, URINGCHUNK);
+			q->off += URINGCHUNK;
+			q->next = (q->next + 1) % ring.depth;
+			enter(0);
+			continue;
+		}
+		m = s->res - s->pos < n - have ? s->res - s->pos : n - have;
+		memcpy(p + have, s->buf + s->pos, m);
+		s->pos += m;
+		have += m;
+	}
+	return have;
+}
+
+/* Read a record from a dump file like read_dump().
+ * Return bytes read, or -1 on error. */
+ssize_t
+uring_read_dump(int fd, void *buf, size_t len)
+{
+	struct dpkthdr *pkt = buf;
+	ssize_t r, want;
+	if (ring.fd == -1 || start(UR_READ, fd) == -1)
+		return read_dump(fd, buf, len);
+	if ((r = rget(buf, DPKTHDRSIZE)) == 0) {
+		return 0;
+	} else if (r != DPKTHDRSIZE) {
+		warnx("Error reading dumped packet header");
+		return -1;
+	}
+	parse_dpkthdr(pkt);
+	want = pkt->dlen - (ssize_t) DPKTHDRSIZE;
+	if (want < 0 || DPKTHDRSIZE + want > len
+	|| rget((unsigned char*) buf + DPKTHDRSIZE, want) != want) {
+		warnx("Error reading %zd bytes of RTP packet", want);
+		return -1;
+	}
+	return DPKTHDRSIZE + want;
+}
+
+/* Write like write(2), but only copy the data to be written.
+ * Failed writes are reported by a later call, or by uring_done().
+ * Return bytes written, or -1 for error. */
+ssize_t
+uring_write(int fd, const void *buf, size_t len)
+{
+	struct queue *q = &queue[UR_WRITE];
+	const unsigned char *p = buf;
+	struct slot *s;
+	size_t n;
+	if (ring.fd == -1 || start(UR_WRITE, fd) == -1)
+		return write(fd, buf, len);
+	while (len) {
+		s = &q->slot[q->next];
+		if (await(s) == -1)
+			return -1;
+		if (q->err) {
+			errno = q->err;
+			return -1;
+		}
+		n = URINGCHUNK - s->pos < len ? URINGCHUNK - s->pos : len;
+		memcpy(s->buf + s->pos, p, n);
+		s->pos += n;
+		p += n;
+		len -= n;
+		if (s->pos == URINGCHUNK)
+			wsubmit();
+	}
+	return p - (const unsigned char*) buf;
+}
+
+/* Write out what is left, wait for the writes,
+ * and drop whatever else is in flight.
+ * Return 0 for success, -1 if a write failed. */
+int
+uring_done(void)
+{
+	struct queue *q = &queue[UR_WRITE];
+	unsigned i;
+	int rv = 0;
+	if (ring.fd == -1)
+		return 0;
+	wflush();
+	for (i = 0; q->fd != -1 && i < ring.depth; i++)
+		if (await(&q->slot[i]) == -1)
+			q->err = errno;
+	if (q->err) {
+		errno = q->err;
+		warn("write");
+		rv = -1;
+	}
+	teardown();
+	return rv;
+}
+
+#else
+
+int
+uring_init(unsigned depth)
+{
+	warnx("io_uring is not supported");
+	return -1;
+}
+
+ssize_t
+uring_recv(int fd, void *buf, size_t len)
+{
+	return recv(fd, buf, len, 0);
+}
+
+ssize_t
+uring_read_dump(int fd, void *buf, size_t len)
+{
+	return read_dump(fd, buf, len);
+}
+
+ssize_t
+uring_write(int fd, const void *buf, size_t len)
+{
+	return write(fd, buf, len);
+}
+
+int
+uring_done(void)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Asynchronous I/O through io_uring(7): up to depth receives,
+ * file reads and file writes are kept in flight at the same time,
+ * each in its own buffer from a fixed pool registered with the kernel.
+ * The calls below behave like recv(2), read_dump() and write(2),
+ * and fall back to them for descriptors we cannot use that way. */
+
+#define URINGDEPTH	8	/* requests of each kind in flight */
+#define URINGCHUNK	65536	/* bytes per request */
+
+int	uring_init	(unsigned);
+ssize_t	uring_recv	(int, void*, size_t);
+ssize_t	uring_read_dump	(int, void*, size_t);
+ssize_t	uring_write	(int, const void*, size_t);
+int	uring_done	(void);
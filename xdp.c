@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "config.h"
+#include "xdp.h"
+
+#if HAVE_XDP
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <poll.h>
+
+#include "stats.h"
+
+/* All the frames of the UMEM start in the fill ring, which the kernel
+ * takes them from to put the packets in, handing them over to us
+ * in the rx ring; as soon as we have copied a packet out, its frame
+ * goes back to the fill ring. The completion ring is only there
+ * because the kernel wants one; we never send. */
+
+#define XDPWAIT		1000	/* msec to wait for a packet */
+#define XDPCOMP		64	/* entries of the completion ring */
+#define XDPSTATS	4096	/* packets between looking at the drops */
+
+#define ETHLEN		14
+#define IPLEN		20
+#define UDPLEN		8
+#define HDRLEN		(ETHLEN + IPLEN + UDPLEN)
+
+struct xring {
+	uint32_t	*prod;
+	uint32_t	*cons;
+	uint32_t	*flags;
+	void		*desc;
+	void		*map;
+	size_t		 len;
+	uint32_t	 mask;
+};
+
+struct xdp {
+	int		 fd;	/* the AF_XDP socket */
+	int		 map;	/* XSKMAP of the queue to the socket */
+	int		 prog;	/* the XDP program */
+	int		 link;	/* of the program to the interface */
+	unsigned char	*umem;
+	struct xring	 rx;
+	struct xring	 fill;
+	uint64_t	 drops;	/* as the kernel last told us */
+	unsigned	 count;	/* packets since we last looked */
+};
+
+static int
+bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static struct bpf_insn
+insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	struct bpf_insn i;
+	memset(&i, 0, sizeof(i));
+	i.code = code;
+	i.dst_reg = dst;
+	i.src_reg = src;
+	i.off = off;
+	i.imm = imm;
+	return i;
+}
+
+/* Load the header field of the given size at off into r5,
+ * and go to the end unless it is val. */
+static unsigned
+check(struct bpf_insn *p, unsigned n, uint8_t size, int16_t off, int32_t val)
+{
+	p[n++] = insn(BPF_LDX | BPF_MEM | size, BPF_REG_5, BPF_REG_2, off, 0);
+	p[n++] = insn(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, val);
+	return n;
+}
+
+/* Load the program redirecting what is for addr:port into the socket
+ * the map has for the queue it came on, passing anything else on;
+ * every conditional jump goes to the end, which passes it on.
+ * The map has the socket for our queue only, so what comes on
+ * another one gets passed on too (as the flags of the redirect say).
+ * Return the program descriptor, or -1 for error. */
+static int
+loadprog(int map, const struct sockaddr_in *addr)
+{
+	struct bpf_insn p[32];
+	union bpf_attr attr;
+	unsigned i, n = 0;
+	p[n++] = insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+	p[n++] = insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1,
+		offsetof(struct xdp_md, data), 0);
+	p[n++] = insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1,
+		offsetof(struct xdp_md, data_end), 0);
+	p[n++] = insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+	p[n++] = insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, HDRLEN);
+	p[n++] = insn(BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0, 0);
+	n = check(p, n, BPF_H, 12, htons(0x0800));	/* IPv4 */
+	n = check(p, n, BPF_B, ETHLEN, 0x45);		/* no options */
+	n = check(p, n, BPF_B, ETHLEN + 9, IPPROTO_UDP);
+	p[n++] = insn(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2,
+		ETHLEN + 6, 0);
+	p[n++] = insn(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0,
+		htons(0x3fff));				/* no fragment */
+	p[n++] = insn(BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0, 0);
+	n = check(p, n, BPF_H, ETHLEN + IPLEN + 2, addr->sin_port);
+	if (addr->sin_addr.s_addr != INADDR_ANY)
+		n = check(p, n, BPF_W, ETHLEN + 16, addr->sin_addr.s_addr);
+	p[n++] = insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6,
+		offsetof(struct xdp_md, rx_queue_index), 0);
+	p[n++] = insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1,
+		BPF_PSEUDO_MAP_FD, 0, map);
+	p[n++] = insn(0, 0, 0, 0, 0);
+	p[n++] = insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+	p[n++] = insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+	p[n++] = insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	for (i = 0; i < n; i++)
+		if (BPF_OP(p[i].code) == BPF_JNE || BPF_OP(p[i].code) == BPF_JGT)
+			if (BPF_CLASS(p[i].code) == BPF_JMP
+			||  BPF_CLASS(p[i].code) == BPF_JMP32)
+				p[i].off = n - i - 1;
+	p[n++] = insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+	p[n++] = insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (uintptr_t) p;
+	attr.insn_cnt = n;
+	attr.license = (uintptr_t) "Dual BSD/GPL";
+	return bpf(BPF_PROG_LOAD, &attr);
+}
+
+/* Attach the program to the interface in the native mode of its
+ * driver, or in the generic mode if it has none. The link goes
+ * away, detaching the program, when its descriptor gets closed.
+ * Return the link descriptor, or -1 for error. */
+static int
+attach(int prog, unsigned ifindex, int verbose)
+{
+	union bpf_attr attr;
+	int fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+	if ((fd = bpf(BPF_LINK_CREATE, &attr)) != -1) {
+		if (verbose)
+			warnx("XDP in native mode");
+		return fd;
+	}
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	if ((fd = bpf(BPF_LINK_CREATE, &attr)) != -1 && verbose)
+		warnx("XDP in generic mode");
+	return fd;
+}
+
+/* Map a ring of size entries of each bytes at pgoff of the socket.
+ * Return 0 for success, -1 for error. */
+static int
+mapring(struct xring *r, int fd, const struct xdp_ring_offset *o,
+	uint32_t size, size_t each, off_t pgoff)
+{
+	unsigned char *m;
+	r->len = o->desc + size * each;
+	if ((r->map = mmap(NULL, r->len, PROT_READ | PROT_WRITE,
+	MAP_SHARED | MAP_POPULATE, fd, pgoff)) == MAP_FAILED) {
+		r->map = NULL;
+		return -1;
+	}
+	m = r->map;
+	r->prod = (uint32_t*) (m + o->producer);
+	r->cons = (uint32_t*) (m + o->consumer);
+	r->flags = (uint32_t*) (m + o->flags);
+	r->desc = m + o->desc;
+	r->mask = size - 1;
+	return 0;
+}
+
+/* Create the socket with its UMEM and rings, bind it to the queue,
+ * and give all the frames to the kernel to fill.
+ * Return 0 for success, -1 for error. */
+static int
+xsock(struct xdp *x, unsigned ifindex, unsigned queue)
+{
+	struct xdp_umem_reg reg;
+	struct xdp_mmap_offsets off;
+	struct sockaddr_xdp sx;
+	socklen_t len = sizeof(off);
+	int size = XDPFRAMES, comp = XDPCOMP;
+	uint64_t *fill;
+	uint32_t i;
+	if ((x->fd = socket(AF_XDP, SOCK_RAW, 0)) == -1) {
+		warn("AF_XDP socket");
+		return -1;
+	}
+	if ((x->umem = mmap(NULL, (size_t) XDPFRAMES * XDPFRAME,
+	PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0))
+	== MAP_FAILED) {
+		x->umem = NULL;
+		warn("UMEM");
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (uintptr_t) x->umem;
+	reg.len = (uint64_t) XDPFRAMES * XDPFRAME;
+	reg.chunk_size = XDPFRAME;
+	if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1
+	|| setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size))
+	== -1
+	|| setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+	&comp, sizeof(comp)) == -1
+	|| setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1
+	|| getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1) {
+		warn("AF_XDP rings");
+		return -1;
+	}
+	if (mapring(&x->rx, x->fd, &off.rx, XDPFRAMES,
+	sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1
+	|| mapring(&x->fill, x->fd, &off.fr, XDPFRAMES,
+	sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1) {
+		warn("AF_XDP rings");
+		return -1;
+	}
+	memset(&sx, 0, sizeof(sx));
+	sx.sxdp_family = AF_XDP;
+	sx.sxdp_ifindex = ifindex;
+	sx.sxdp_queue_id = queue;
+	sx.sxdp_flags = XDP_USE_NEED_WAKEUP;
+	if (bind(x->fd, (struct sockaddr*) &sx, sizeof(sx)) == -1) {
+		warn("AF_XDP bind to queue %u", queue);
+		return -1;
+	}
+	fill = x->fill.desc;
+	for (i = 0; i < XDPFRAMES; i++)
+		fill[i] = (uint64_t) i * XDPFRAME;
+	__atomic_store_n(x->fill.prod, XDPFRAMES, __ATOMIC_RELEASE);
+	return 0;
+}
+
+struct xdp*
+xdp_open(const char *ifname, unsigned queue,
+	const struct sockaddr_in *addr, int verbose)
+{
+	union bpf_attr attr;
+	struct xdp *x;
+	unsigned ifindex;
+	uint32_t key = queue;
+	if ((ifindex = if_nametoindex(ifname)) == 0) {
+		warn("%s", ifname);
+		return NULL;
+	}
+	if ((x = calloc(1, sizeof(*x))) == NULL) {
+		warn("calloc");
+		return NULL;
+	}
+	x->fd = x->map = x->prog = x->link = -1;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(int);
+	attr.max_entries = queue + 1;
+	if ((x->map = bpf(BPF_MAP_CREATE, &attr)) == -1) {
+		warn("XSKMAP");
+		goto bad;
+	}
+	if ((x->prog = loadprog(x->map, addr)) == -1) {
+		warn("XDP program");
+		goto bad;
+	}
+	if (xsock(x, ifindex, queue) == -1)
+		goto bad;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = x->map;
+	attr.key = (uintptr_t) &key;
+	attr.value = (uintptr_t) &x->fd;
+	attr.flags = BPF_ANY;
+	if (bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+		warn("XSKMAP");
+		goto bad;
+	}
+	if ((x->link = attach(x->prog, ifindex, verbose)) == -1) {
+		warn("XDP on %s", ifname);
+		goto bad;
+	}
+	return x;
+bad:
+	xdp_close(x);
+	return NULL;
+}
+
+int
+xdp_fd(const struct xdp *x)
+{
+	return x->fd;
+}
+
+/* Account for the packets the kernel dropped
+ * for the rings being full, of which it keeps the totals. */
+static void
+xdrops(struct xdp *x)
+{
+	struct xdp_statistics st;
+	socklen_t len = sizeof(st);
+	uint64_t total;
+	x->count = 0;
+	if (getsockopt(x->fd, SOL_XDP, XDP_STATISTICS, &st, &len) == -1)
+		return;
+	total = st.rx_dropped + st.rx_ring_full;
+	stats.rxkdrop += total - x->drops;
+	x->drops = total;
+}
+
+/* Find the UDP payload in the frame of len bytes.
+ * Return its length, or -1 if there is none. */
+static ssize_t
+payload(const unsigned char *f, size_t len)
+{
+	uint16_t ulen;
+	if (len < HDRLEN || f[12] != 0x08 || f[13] != 0x00
+	|| f[ETHLEN] != 0x45 || f[ETHLEN + 9] != IPPROTO_UDP)
+		return -1;
+	memcpy(&ulen, f + ETHLEN + IPLEN + 4, sizeof(ulen));
+	ulen = ntohs(ulen);
+	if (ulen < UDPLEN || ulen - UDPLEN > (ssize_t) (len - HDRLEN))
+		return -1;
+	return ulen - UDPLEN;
+}
+
+/* Copy out the next datagram in the rx ring, giving its frame
+ * back to the fill ring; unless told to wait, only if there is one.
+ * Return its size, or -1 for error (EAGAIN if none came). */
+ssize_t
+xdp_recv(struct xdp *x, void *buf, size_t len, int wait)
+{
+	const struct xdp_desc *d;
+	struct pollfd pfd;
+	uint64_t *fill;
+	uint32_t cons, prod;
+	ssize_t r;
+	size_t n = 0;
+	for (;;) {
+		cons = *x->rx.cons;
+		if (cons == __atomic_load_n(x->rx.prod, __ATOMIC_ACQUIRE)) {
+			xdrops(x);
+			if (!wait) {
+				errno = EAGAIN;
+				return -1;
+			}
+			pfd.fd = x->fd;
+			pfd.events = POLLIN;
+			if ((r = poll(&pfd, 1, XDPWAIT)) <= 0) {
+				if (r == 0)
+					errno = EAGAIN;
+				return -1;
+			}
+			wait = 0;
+			continue;
+		}
+		d = (const struct xdp_desc*) x->rx.desc + (cons & x->rx.mask);
+		if ((r = payload(x->umem + d->addr, d->len)) != -1) {
+			n = (size_t) r < len ? (size_t) r : len;
+			memcpy(buf, x->umem + d->addr + HDRLEN, n);
+		}
+		fill = x->fill.desc;
+		prod = *x->fill.prod;
+		fill[prod & x->fill.mask] = d->addr - d->addr % XDPFRAME;
+		__atomic_store_n(x->fill.prod, prod + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(x->rx.cons, cons + 1, __ATOMIC_RELEASE);
+		if (__atomic_load_n(x->fill.flags, __ATOMIC_RELAXED)
+		& XDP_RING_NEED_WAKEUP)
+			recvfrom(x->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		if (++x->count == XDPSTATS)
+			xdrops(x);
+		if (r != -1)
+			return n;
+	}
+}
+
+void
+xdp_close(struct xdp *x)
+{
+	if (x == NULL)
+		return;
+	if (x->fd != -1)
+		xdrops(x);
+	if (x->link != -1)
+		close(x->link);
+	if (x->prog != -1)
+		close(x->prog);
+	if (x->rx.map)
+		munmap(x->rx.map, x->rx.len);
+	if (x->fill.map)
+		munmap(x->fill.map, x->fill.len);
+	if (x->fd != -1)
+		close(x->fd);
+	if (x->map != -1)
+		close(x->map);
+	if (x->umem)
+		munmap(x->umem, (size_t) XDPFRAMES * XDPFRAME);
+	free(x);
+}
+
+#else
+
+struct xdp*
+xdp_open(const char *ifname, unsigned queue,
+	const struct sockaddr_in *addr, int verbose)
+{
+	warnx("AF_XDP is not supported");
+	return NULL;
+}
+
+int
+xdp_fd(const struct xdp *x)
+{
+	return -1;
+}
+
+ssize_t
+xdp_recv(struct xdp *x, void *buf, size_t len, int wait)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void
+xdp_close(struct xdp *x)
+{
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2018 Jan Stary <hans@stare.cz>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Capturing through AF_XDP: a small XDP program on the interface
+ * steers the UDP datagrams for the given address and port (any
+ * address if it is INADDR_ANY) that come on the given queue into
+ * a ring we share with the kernel, past the network stack; all else
+ * goes on to the stack as before. Only untagged Ethernet with IPv4
+ * without options is steered. The program is attached in the native
+ * mode of the driver where it has one, in the generic mode otherwise,
+ * and goes away with us. xdp_recv() behaves like recv(2) on the socket
+ * the datagrams were for, waiting for one a second at most. */
+
+#define XDPFRAME	2048		/* bytes per frame of the UMEM */
+#define XDPFRAMES	4096		/* frames of the UMEM */
+
+struct xdp;
+
+struct xdp	*xdp_open	(const char*, unsigned,
+				 const struct sockaddr_in*, int);
+int		 xdp_fd		(const struct xdp*);
+ssize_t		 xdp_recv	(struct xdp*, void*, size_t, int);
+void		 xdp_close	(struct xdp*);